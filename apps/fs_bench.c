@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+#include <trace.h>
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+/* Size of each read and write issued by the benchmarks */
+#define BENCH_IO_SIZE 4096
+
+/* Number of random reads issued by the random read benchmark */
+#define BENCH_RANDOM_READS 1024
+
+/* Number of calls timed by the call overhead benchmark */
+#define BENCH_CALLS 1000000
+
+static const char *words[] = {
+	"block", "chain", "data", "directory", "disk", "entry", "error", "file",
+	"index", "info", "mount", "offset", "read", "root", "size", "write"
+};
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Fills buffer with log-like text, or with random bytes if !text */
+static void fill(char *buf, size_t size, int text)
+{
+	size_t pos = 0;
+
+	if (!text) {
+		for (pos = 0; pos < size; pos++)
+			buf[pos] = rand();
+		return;
+	}
+
+	while (pos < size) {
+		char line[128];
+		int len = snprintf(line, sizeof(line), "%08d %s %s: %s %d\n",
+				   rand() % 100000, words[rand() % 16],
+				   words[rand() % 16], words[rand() % 16],
+				   rand() % 4096);
+		if ((size_t)len > size - pos)
+			len = size - pos;
+		memcpy(buf + pos, line, len);
+		pos += len;
+	}
+}
+
+static void report(const char *name, size_t bytes, double seconds)
+{
+	printf("%-24s %10.1f MB/s\n", name, bytes / seconds / 1e6);
+}
+
+static void bench(const char *filename, char *data, size_t size, int compress)
+{
+	char buf[BENCH_IO_SIZE], name[64];
+	struct timespec start;
+	size_t pos;
+	int fd;
+
+	ASSERT(!fs_create(filename), "fs_create");
+	if (compress)
+		ASSERT(!fs_compress(filename, 1), "fs_compress");
+	fd = fs_open(filename);
+	ASSERT(fd >= 0, "fs_open");
+
+	/* Sequential write */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pos = 0; pos < size; pos += BENCH_IO_SIZE)
+		ASSERT(fs_write(fd, data + pos, BENCH_IO_SIZE) == BENCH_IO_SIZE,
+		       "fs_write");
+	snprintf(name, sizeof(name), "%s seq_write", filename);
+	report(name, size, elapsed(&start));
+
+	/* Sequential read */
+	ASSERT(!fs_lseek(fd, 0), "fs_lseek");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pos = 0; pos < size; pos += BENCH_IO_SIZE)
+		ASSERT(fs_read(fd, buf, BENCH_IO_SIZE) == BENCH_IO_SIZE,
+		       "fs_read");
+	snprintf(name, sizeof(name), "%s seq_read", filename);
+	report(name, size, elapsed(&start));
+
+	/* Random reads */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_RANDOM_READS; i++) {
+		pos = rand() % (size / BENCH_IO_SIZE) * BENCH_IO_SIZE;
+		ASSERT(!fs_lseek(fd, pos), "fs_lseek");
+		ASSERT(fs_read(fd, buf, BENCH_IO_SIZE) == BENCH_IO_SIZE,
+		       "fs_read");
+		ASSERT(!memcmp(buf, data + pos, BENCH_IO_SIZE), "fs_read content");
+	}
+	snprintf(name, sizeof(name), "%s rand_read", filename);
+	report(name, (size_t)BENCH_RANDOM_READS * BENCH_IO_SIZE, elapsed(&start));
+
+	ASSERT(!fs_close(fd), "fs_close");
+}
+
+/* Times the cheapest call of the API, so that the cost of the tracepoints
+   shows against a build without them (make T=1) */
+static void bench_calls(const char *name)
+{
+	struct timespec start;
+	int fd;
+
+	ASSERT(!fs_create("calls"), "fs_create");
+	fd = fs_open("calls");
+	ASSERT(fd >= 0, "fs_open");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_CALLS; i++)
+		ASSERT(fs_stat(fd) == 0, "fs_stat");
+	printf("%-24s %10.1f ns/call\n", name,
+	       elapsed(&start) * 1e9 / BENCH_CALLS);
+
+	ASSERT(!fs_close(fd), "fs_close");
+	ASSERT(!fs_delete("calls"), "fs_delete");
+}
+
+static void bench_all(char *text, char *random, size_t size)
+{
+	bench("plain.txt", text, size, 0);
+	bench("plain.bin", random, size, 0);
+	bench("lz.txt", text, size, 1);
+	bench("lz.bin", random, size, 1);
+
+	fs_delete("plain.txt");
+	fs_delete("plain.bin");
+	fs_delete("lz.txt");
+	fs_delete("lz.bin");
+}
+
+int main(int argc, char *argv[])
+{
+	char *diskname, *text, *random;
+	size_t size = 1024 * 1024;
+	int traced = 0;
+
+	/* Run the suite a second time with tracing started */
+	if (argc > 1 && !strcmp(argv[1], "-t")) {
+		traced = 1;
+		argc--;
+		argv++;
+	}
+
+	if (argc < 2) {
+		printf("Usage: %s [-t] <diskimage> [<file size in KiB>]\n",
+		       argv[0]);
+		exit(1);
+	}
+
+	diskname = argv[1];
+	if (argc > 2)
+		size = (size_t)atoi(argv[2]) * 1024;
+	size = size / BENCH_IO_SIZE * BENCH_IO_SIZE;
+	if (size == 0)
+		size = BENCH_IO_SIZE;
+
+	text = malloc(size);
+	random = malloc(size);
+	ASSERT(text && random, "malloc");
+	srand(150);
+	fill(text, size, 1);
+	fill(random, size, 0);
+
+	ASSERT(!fs_mount(diskname), "fs_mount");
+
+	bench_all(text, random, size);
+	bench_calls("calls");
+
+	/* Compression ratio and codec throughput of the whole run */
+	fs_info();
+
+	if (traced) {
+		ASSERT(!trace_start(), "trace_start");
+		printf("Traced:\n");
+		bench_all(text, random, size);
+		bench_calls("traced calls");
+		trace_stop();
+	}
+
+	ASSERT(!fs_umount(), "fs_umount");
+
+	free(text);
+	free(random);
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f <FAT block count>] [-d] [-p] <diskname> "
+		"<data block count>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fs_format_options options = { 0 };
+	char *diskname;
+	int data_blocks, opt;
+
+	while ((opt = getopt(argc, argv, "f:dp")) != -1) {
+		switch (opt) {
+		case 'f':
+			options.fat_blocks = atoi(optarg);
+			break;
+		case 'd':
+			options.dedup = 1;
+			break;
+		case 'p':
+			options.pack = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	diskname = argv[optind];
+	data_blocks = atoi(argv[optind + 1]);
+
+	if (fs_format(diskname, data_blocks, &options)) {
+		fprintf(stderr, "Cannot create virtual disk '%s' with '%d' data "
+			"blocks\n", diskname, data_blocks);
+		exit(1);
+	}
+
+	printf("Created virtual disk '%s' with '%d' data blocks\n", diskname,
+	       data_blocks);
+
+	return 0;
+}
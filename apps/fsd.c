@@ -0,0 +1,52 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+#include <fsd.h>
+
+static void stop(int signum)
+{
+	(void)signum;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa = { .sa_handler = stop };
+	char sockname[4096];
+	struct fs *fs;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [<socket>]\n", argv[0]);
+		exit(1);
+	}
+
+	if (argc > 2)
+		snprintf(sockname, sizeof(sockname), "%s", argv[2]);
+	else
+		snprintf(sockname, sizeof(sockname), "%s%s", argv[1],
+			 FSD_SOCKET_SUFFIX);
+
+	/* Metadata stays loaded for all clients until the server stops */
+	fs = fsh_mount(argv[1]);
+	if (!fs) {
+		fprintf(stderr, "Cannot mount diskname '%s'\n", argv[1]);
+		exit(1);
+	}
+
+	/* Interrupting the wait for requests stops the server cleanly */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = fsd_serve(fs, sockname);
+
+	if (fsh_umount(fs)) {
+		fprintf(stderr, "Cannot unmount diskname '%s'\n", argv[1]);
+		exit(1);
+	}
+
+	return ret ? 1 : 0;
+}
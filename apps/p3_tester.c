@@ -1,8 +1,13 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <fs.h>
+#include <record.h>
 
 #define ASSERT(cond, func)                               \
 do {                                                     \
@@ -172,9 +177,452 @@ int main(int argc, char *argv[])
 	ret = fs_delete("file1");
 	ASSERT(ret == 0, "fs_delete");
 
+	/*----------fs_mkdir() Testing Coverage [Currently 4/4]------------------*/
+	printf("----------fs_mkdir() Testing----------\n");
+
+	/* Error 1 */
+	ret = fs_mkdir("");
+	ASSERT(ret == -1, "dirname invalid handling");
+
+	/* Error 2 */
+	ret = fs_mkdir("dir1/dir2");
+	ASSERT(ret == -1, "parent missing handling");
+
+	/* Create */
+	ret = fs_mkdir("dir1");
+	ASSERT(ret == 0, "fs_mkdir");
+
+	/* Error 3 */
+	ret = fs_mkdir("dir1");
+	ASSERT(ret == -1, "dirname repeat handling");
+
+	/* Path Create */
+	ret = fs_create("dir1/file3");
+	ASSERT(ret == 0, "fs_create path");
+
+	fd = fs_open("/dir1/file3");
+	ASSERT(fd >= 0, "fs_open path");
+	fs_close(fd);
+
+	/* Remount */
+	char dir_file[FS_FILENAME_LEN * 2];
+	int dir_found = 0;
+	for (int i = 0; i < 510; i++) {
+		sprintf(dir_file, "dir1/n%d", i);
+		fs_create(dir_file);
+	}
+	fs_umount();
+	fs_mount(diskname);
+	for (int i = 0; i < 510; i++) {
+		sprintf(dir_file, "dir1/n%d", i);
+		fd = fs_open(dir_file);
+		dir_found += fd >= 0;
+		fs_close(fd);
+		fs_delete(dir_file);
+	}
+	ASSERT(dir_found == 510, "directory remount handling");
+
+	/*----------fs_rmdir() Testing Coverage [Currently 3/3]------------------*/
+	printf("----------fs_rmdir() Testing----------\n");
+
+	/* Error 1 */
+	ret = fs_rmdir("dir2");
+	ASSERT(ret == -1, "dirname invalid handling");
+
+	/* Error 2 */
+	ret = fs_rmdir("dir1");
+	ASSERT(ret == -1, "directory not empty handling");
+
+	/* Error 3 */
+	ret = fs_delete("dir1");
+	ASSERT(ret == -1, "fs_delete directory handling");
+
+	/* Remove */
+	fs_delete("dir1/file3");
+	ret = fs_rmdir("dir1");
+	ASSERT(ret == 0, "fs_rmdir");
+
+	/*----------fs_clone() Testing Coverage [Currently 3/3]------------------*/
+	printf("----------fs_clone() Testing----------\n");
+
+	/* Error 1 */
+	ret = fs_clone("file2", "file3");
+	ASSERT(ret == -1, "src invalid handling");
+
+	/* Error 2 */
+	fs_create("file2");
+	fs_create("file3");
+	ret = fs_clone("file2", "file3");
+	ASSERT(ret == -1, "dst repeat handling");
+	fs_delete("file3");
+
+	/* Clone */
+	char block[8192];
+	memset(block, 'a', sizeof(block));
+	fd = fs_open("file2");
+	fs_write(fd, block, sizeof(block));
+	fs_close(fd);
+	ret = fs_clone("file2", "file3");
+	ASSERT(ret == 0, "fs_clone");
+
+	/* Error 3 */
+	fd = fs_open("file3");
+	fs_lseek(fd, 4096);
+	fs_write(fd, "b", 1);
+	fs_close(fd);
+	fd = fs_open("file2");
+	fs_lseek(fd, 4096);
+	fs_read(fd, block, 1);
+	fs_close(fd);
+	ASSERT(block[0] == 'a', "copy on write handling");
+	fs_delete("file2");
+	fs_delete("file3");
+
+	/*----------fs_compress() Testing Coverage [Currently 4/4]---------------*/
+	printf("----------fs_compress() Testing----------\n");
+
+	/* Error 1 */
+	ret = fs_compress("file2", 1);
+	ASSERT(ret == -1, "file invalid handling");
+
+	/* Compress */
+	fs_create("file2");
+	ret = fs_compress("file2", 1);
+	ASSERT(ret == 0, "fs_compress");
+
+	/* Error 2 */
+	fd = fs_open("file2");
+	fs_write(fd, block, sizeof(block));
+	fs_lseek(fd, 4096);
+	fs_read(fd, block, 1);
+	fs_close(fd);
+	ASSERT(block[0] == 'a', "compressed read handling");
+	ret = fs_compress("file2", 0);
+	ASSERT(ret == -1, "non-empty file handling");
+	fs_delete("file2");
+
+	/*----------fs_defrag() Testing Coverage [Currently 1/1]-----------------*/
+	printf("----------fs_defrag() Testing----------\n");
+
+	/* Defragment */
+	fs_create("file2");
+	fs_create("file3");
+	for (int i = 0; i < 4; i++) {
+		fd = fs_open(i % 2 ? "file3" : "file2");
+		fs_lseek(fd, fs_stat(fd));
+		fs_write(fd, block, sizeof(block));
+		fs_close(fd);
+	}
+	fs_delete("file2");
+	ret = fs_defrag(0);
+	ASSERT(ret > 0, "fs_defrag");
+	fs_delete("file3");
+
+	/*----------fs_grow() Testing Coverage [Currently 4/4]-------------------*/
+	printf("----------fs_grow() Testing----------\n");
+
+	/* Error 1 */
+	ret = fs_grow(1);
+	ASSERT(ret == -1, "block count invalid handling");
+
+	/* Grow */
+	fs_create("file2");
+	fd = fs_open("file2");
+	memset(block, 'c', sizeof(block));
+	fs_write(fd, block, sizeof(block));
+	fs_close(fd);
+	ret = fs_grow(4100);
+	ASSERT(ret == 0, "fs_grow");
+
+	/* Error 2 */
+	fd = fs_open("file2");
+	fs_lseek(fd, 4096);
+	fs_read(fd, block, 1);
+	fs_close(fd);
+	ASSERT(block[0] == 'c', "grown read handling");
+	fs_delete("file2");
+
+	/* Error 3 */
+	struct rlimit limit, saved;
+	struct stat st;
+	stat(diskname, &st);
+	getrlimit(RLIMIT_FSIZE, &saved);
+	limit = saved;
+	limit.rlim_cur = st.st_size;
+	signal(SIGXFSZ, SIG_IGN);
+	setrlimit(RLIMIT_FSIZE, &limit);
+	ret = fs_grow(8000);
+	setrlimit(RLIMIT_FSIZE, &saved);
+	signal(SIGXFSZ, SIG_DFL);
+	fs_create("file2");
+	fd = fs_open("file2");
+	fs_close(fd);
+	fs_delete("file2");
+	ASSERT(ret == -1 && fd >= 0, "host out of space handling");
+
+	/*----------fs_trim() Testing Coverage [Currently 1/1]-------------------*/
+	printf("----------fs_trim() Testing----------\n");
+
+	/* Trim */
+	ret = fs_trim();
+	ASSERT(ret > 0, "fs_trim");
+
+	/*----------fs_reserve() Testing Coverage [Currently 3/3]----------------*/
+	printf("----------fs_reserve() Testing----------\n");
+
+	/* Reserve */
+	fs_create("reserve");
+	fd = fs_open("reserve");
+	ret = fs_reserve(fd, 4 * sizeof(block));
+	ASSERT(!ret, "fs_reserve");
+
+	/* Error 1 */
+	ret = fs_reserve(fd, sizeof(block));
+	ASSERT(ret == -1, "blocks already reserved handling");
+
+	/* Write past the reserved blocks */
+	ret = fs_write(fd, block, sizeof(block)) + fs_write(fd, block, 3000);
+	fs_close(fd);
+	fd = fs_open("reserve");
+	ASSERT(ret == 8192 + 3000 && fs_stat(fd) == ret, "reserved file size");
+	fs_close(fd);
+	fs_delete("reserve");
+
+	/*----------fs_readdir() Testing Coverage [Currently 2/2]----------------*/
+	printf("----------fs_readdir() Testing----------\n");
+
+	/* Read */
+	struct fs_dirent dirent;
+	fs_create("dirent");
+	int index = 0, found = 0;
+	while ((index = fs_readdir("", index, &dirent)) > 0)
+		found += !strcmp(dirent.name, "dirent") && !dirent.dir;
+	ASSERT(index == 0 && found == 1, "fs_readdir");
+	fs_delete("dirent");
+
+	/* Error 1 */
+	ret = fs_readdir("nothere", 0, &dirent);
+	ASSERT(ret == -1, "directory invalid handling");
+
+	/*----------fs_export_fd() Testing Coverage [Currently 3/3]--------------*/
+	printf("----------fs_export_fd() Testing----------\n");
+
+	/* Import */
+	char host_buf[3 * 4096 + 100], host_check[sizeof(host_buf)];
+	for (size_t i = 0; i < sizeof(host_buf); i++)
+		host_buf[i] = i * 7;
+	FILE *host = tmpfile();
+	int host_fd = fileno(host);
+	write(host_fd, host_buf, sizeof(host_buf));
+	lseek(host_fd, 0, SEEK_SET);
+	fs_create("host");
+	fd = fs_open("host");
+	ret = fs_import_fd(fd, host_fd, sizeof(host_buf));
+	fs_lseek(fd, 0);
+	fs_read(fd, host_check, sizeof(host_check));
+	ASSERT(ret == sizeof(host_buf) && fs_stat(fd) == sizeof(host_buf) &&
+	!memcmp(host_buf, host_check, sizeof(host_buf)), "fs_import_fd");
+
+	/* Export */
+	ftruncate(host_fd, 0);
+	lseek(host_fd, 0, SEEK_SET);
+	fs_lseek(fd, 0);
+	ret = fs_export_fd(fd, host_fd);
+	lseek(host_fd, 0, SEEK_SET);
+	memset(host_check, 0, sizeof(host_check));
+	read(host_fd, host_check, sizeof(host_check));
+	ASSERT(ret == sizeof(host_buf) &&
+	!memcmp(host_buf, host_check, sizeof(host_buf)), "fs_export_fd");
+	fs_close(fd);
+	fs_delete("host");
+	fclose(host);
+
+	/* Error 1 */
+	ret = fs_export_fd(fd, STDOUT_FILENO);
+	ASSERT(ret == -1, "fd invalid handling");
+
+	/*----------fs_stats() Testing Coverage [Currently 3/3]------------------*/
+	printf("----------fs_stats() Testing----------\n");
+
+	/* Stats */
+	struct fs_stats stats;
+	fs_stats_reset();
+	fs_create("stats");
+	fd = fs_open("stats");
+	fs_write(fd, host_buf, sizeof(host_buf));
+	fs_close(fd);
+	fs_delete("stats");
+	ret = fs_stats(&stats);
+	ASSERT(!ret && stats.ops[FS_STATS_WRITE].calls == 1 &&
+	stats.ops[FS_STATS_WRITE].bytes == sizeof(host_buf) &&
+	stats.ops[FS_STATS_CREATE].calls == 1 && stats.blocks_written >= 4,
+	"fs_stats");
+
+	/* Reset */
+	fs_stats_reset();
+	fs_stats(&stats);
+	ASSERT(stats.ops[FS_STATS_WRITE].calls == 0 && stats.disk_writes == 0,
+	"fs_stats_reset");
+
+	/* Error 1 */
+	ret = fs_stats(NULL);
+	ASSERT(ret == -1, "stats invalid handling");
+
+	/*----------fs_heatmap() Testing Coverage [Currently 2/2]----------------*/
+	printf("----------fs_heatmap() Testing----------\n");
+
+	/* Mode */
+	ret = fs_heatmap_mode(1);
+	ASSERT(!ret, "fs_heatmap_mode");
+
+	/* Report */
+	fflush(stdout);
+	FILE *report = tmpfile();
+	int saved_stdout = dup(STDOUT_FILENO);
+	dup2(fileno(report), STDOUT_FILENO);
+	fs_create("heat");
+	fd = fs_open("heat");
+	fs_write(fd, host_buf, sizeof(host_buf));
+	fs_close(fd);
+	ret = fs_heatmap();
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	char line[128];
+	int found_heat = 0;
+	rewind(report);
+	while (fgets(line, sizeof(line), report))
+		found_heat += !strncmp(line, "file: heat, reads: 0, writes: 4,", 32);
+	fclose(report);
+	fs_delete("heat");
+	fs_heatmap_mode(0);
+	ASSERT(!ret && found_heat == 1, "fs_heatmap");
+
+	/*----------record_start() Testing Coverage [Currently 3/3]--------------*/
+	printf("----------record_start() Testing----------\n");
+
+	/* Record */
+	char rec_name[] = "/tmp/p3_tester.XXXXXX";
+	close(mkstemp(rec_name));
+	ret = record_start(rec_name);
+	fs_create("rec");
+	fd = fs_open("rec");
+	fs_write(fd, host_buf, 100);
+	fs_lseek(fd, 10);
+	fs_read(fd, host_check, 20);
+	fs_close(fd);
+	fs_delete("rec");
+	ASSERT(!ret && !record_stop(), "record_start");
+
+	/* Replay */
+	enum record_op ops[] = { RECORD_CREATE, RECORD_OPEN, RECORD_WRITE,
+		RECORD_SEEK, RECORD_READ, RECORD_CLOSE, RECORD_DELETE };
+	struct record rec, read_rec = { 0 };
+	FILE *rec_file = record_open(rec_name);
+	int rec_count = 0, rec_match = 1;
+	while (rec_file && record_next(rec_file, &rec) == 1) {
+		rec_match &= rec_count < 7 && rec.op == ops[rec_count];
+		if (rec.op == RECORD_READ)
+			read_rec = rec;
+		rec_count++;
+	}
+	if (rec_file)
+		fclose(rec_file);
+	unlink(rec_name);
+	ASSERT(rec_count == 7 && rec_match && read_rec.fd == fd &&
+	read_rec.offset == 10 && read_rec.count == 20 && read_rec.ret == 20,
+	"record_next");
+
+	/* Error 1 */
+	ret = record_stop();
+	ASSERT(ret == -1, "recording stopped handling");
+
 	/* Unmount */
 	ret = fs_umount();
 	ASSERT(!ret, "fs_unmount");
 
+	/*----------fs_mount_ro() Testing Coverage [Currently 2/2]---------------*/
+	printf("----------fs_mount_ro() Testing----------\n");
+
+	/* Mount */
+	ret = fs_mount_ro(diskname);
+	ASSERT(!ret, "fs_mount_ro");
+
+	/* Error 1 */
+	ret = fs_create("file2");
+	ASSERT(ret == -1, "read-only handling");
+	fs_umount();
+
+	/*----------fsh_mount() Testing Coverage [Currently 4/4]-----------------*/
+	printf("----------fsh_mount() Testing----------\n");
+
+	/* Mount */
+	struct fs *fs1 = fsh_mount_ro(diskname);
+	struct fs *fs2 = fsh_mount_ro(diskname);
+	ASSERT(fs1 != NULL && fs2 != NULL, "fsh_mount_ro");
+
+	/* Error 1 */
+	ret = fsh_open(NULL, data[FS_OPEN_MAX_COUNT]);
+	ASSERT(ret == -1, "handle invalid handling");
+
+	/* Error 2 */
+	fd = fsh_open(fs1, data[FS_OPEN_MAX_COUNT]);
+	ret = fsh_open(fs2, data[FS_OPEN_MAX_COUNT]);
+	ASSERT(fd == 0 && ret == 0, "independent handles handling");
+	fsh_close(fs1, fd);
+	fsh_close(fs2, ret);
+
+	/* Unmount */
+	ret = fsh_umount(fs1) || fsh_umount(fs2);
+	ASSERT(!ret, "fsh_umount");
+
+	/*----------fs_stripe() Testing Coverage [Currently 2/2]-----------------*/
+	printf("----------fs_stripe() Testing----------\n");
+
+	/* Error 1 */
+	const char *members[] = {"stripe1.fs"};
+	ret = fs_stripe(diskname, members, 0, 16);
+	ASSERT(ret == -1, "count invalid handling");
+
+	/* Error 2 */
+	ret = fs_stripe(diskname, members, 1, 0);
+	ASSERT(ret == -1, "stripe unit invalid handling");
+
+	/*----------fs_format() Testing Coverage [Currently 5/5]-----------------*/
+	printf("----------fs_format() Testing----------\n");
+
+	/* Error 1 */
+	ret = fs_format("format.fs", 0, NULL);
+	ASSERT(ret == -1, "block count invalid handling");
+
+	/* Error 2 */
+	struct fs_format_options options = { .fat_blocks = 1 };
+	ret = fs_format("format.fs", 4096, &options);
+	ASSERT(ret == -1, "FAT block count invalid handling");
+
+	/* Format */
+	options.fat_blocks = 4;
+	ret = fs_format("format.fs", 4096, &options);
+	ASSERT(!ret, "fs_format");
+
+	/* Mount */
+	fs1 = fsh_mount("format.fs");
+	ASSERT(fs1 != NULL && !fsh_umount(fs1), "fsh_mount formatted");
+
+	/* Pack */
+	options.fat_blocks = 0;
+	options.pack = 1;
+	fs_format("format.fs", 3, &options);
+	fs1 = fsh_mount("format.fs");
+	found = 0;
+	for (int i = 0; i < 4; i++) {
+		fsh_create(fs1, data[i]);
+		fd = fsh_open(fs1, data[i]);
+		found += fsh_write(fs1, fd, block, 300) == 300;
+		fsh_close(fs1, fd);
+	}
+	ASSERT(found == 4 && !fsh_umount(fs1), "fs_format packed");
+	remove("format.fs");
+
 	return 0;
 }
@@ -1,15 +1,24 @@
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
+#include <record.h>
+#include <trace.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -19,35 +28,237 @@
 #define die(...)				\
 do {							\
 	test_fs_error(__VA_ARGS__);	\
-	exit(1);					\
+	test_fs_exit();				\
 } while (0)
 
 #define die_perror(msg)			\
 do {							\
 	perror(msg);				\
-	exit(1);					\
+	test_fs_exit();				\
 } while (0)
 
+/* Batch mode state: disk mounted once for all commands, and where a failing
+   command returns to instead of exiting */
+static const char *batch_diskname;
+static jmp_buf batch_env;
+
+void test_fs_exit(void)
+{
+	if (batch_diskname)
+		longjmp(batch_env, 1);
+	exit(1);
+}
+
+/* Mounts the disk of a command, which is already mounted in batch mode */
+int test_fs_mount(const char *diskname)
+{
+	if (batch_diskname)
+		return strcmp(diskname, batch_diskname) ? -1 : 0;
+	return fs_mount(diskname);
+}
+
+int test_fs_mount_ro(const char *diskname)
+{
+	if (batch_diskname)
+		return strcmp(diskname, batch_diskname) ? -1 : 0;
+	return fs_mount_ro(diskname);
+}
+
+int test_fs_umount(void)
+{
+	if (batch_diskname)
+		return 0;
+	return fs_umount();
+}
 
 struct thread_arg {
 	int argc;
 	char **argv;
 };
 
+/* Returns the upper bound of the latency bucket holding fraction 'p' of the
+   calls counted by 'stats' */
+unsigned long long stats_percentile(struct fs_op_stats *stats, double p)
+{
+	uint64_t seen = 0;
+
+	for (int i = 0; i < FS_STATS_BUCKETS; i++) {
+		seen += stats->latency[i];
+		if (seen && seen >= p * stats->calls)
+			return (2ULL << i) - 1;
+	}
+
+	return 0;
+}
+
+/* Maximum nesting of the REPEAT blocks of a script */
+#define SCRIPT_REPEAT_DEPTH 16
+
+/* Command of a script, parsed once however many times it runs */
+struct script_cmd {
+	char *text;
+	char *args[4];
+	int line;
+	/* REPEAT and END, and TIMER START and STOP, give the index of each
+	   other */
+	int match;
+	/* Index of the REPEAT of the block holding the command, or -1 */
+	int block;
+	/* Data written or compared, loaded the first time the command runs */
+	char *data;
+	int data_size;
+	int data_owned;
+	/* Latency of the fs_* call of every run since the timer of the command
+	   started, and time TIMER START ran at */
+	struct fs_op_stats stats;
+	uint64_t timer;
+};
+
+/* Loads the data given to 'cmd' by its arguments from 'arg' on: DATA <data>,
+   FILE <host filename>, or SIZE <size> for 'size' generated bytes. The data is
+   always followed by a NULL character. Returns -1 if the data is not given by
+   any of them. */
+int script_data(struct script_cmd *cmd, int arg)
+{
+	char *source = cmd->args[arg], *description = cmd->args[arg + 1];
+	struct stat st;
+	int data_fd = -1;
+
+	if (cmd->data)
+		return 0;
+	if (!source || !description)
+		return -1;
+
+	if (strcmp(source, "DATA") == 0) {
+		cmd->data = description;
+		cmd->data_size = strlen(description);
+		return 0;
+	}
+
+	if (strcmp(source, "FILE") == 0) {
+		data_fd = open(description, O_RDONLY);
+		if (data_fd < 0) {
+			fs_umount();
+			die_perror("open");
+		}
+		if (fstat(data_fd, &st)) {
+			fs_umount();
+			die_perror("fstat");
+		}
+		if (!S_ISREG(st.st_mode)) {
+			fs_umount();
+			die("Not a regular file: %s\n", description);
+		}
+		cmd->data_size = st.st_size;
+	} else if (strcmp(source, "SIZE") == 0) {
+		cmd->data_size = atoi(description);
+		if (cmd->data_size < 0)
+			return -1;
+	} else {
+		return -1;
+	}
+
+	cmd->data = malloc(cmd->data_size + 1);
+	if (!cmd->data) {
+		fs_umount();
+		die_perror("malloc");
+	}
+	cmd->data_owned = 1;
+	cmd->data[cmd->data_size] = '\0';
+
+	if (strcmp(source, "SIZE") == 0) {
+		for (int i = 0; i < cmd->data_size; i++)
+			cmd->data[i] = 'a' + i % 26;
+		return 0;
+	}
+
+	for (int done = 0, n; done < cmd->data_size; done += n) {
+		n = read(data_fd, cmd->data + done, cmd->data_size - done);
+		if (n <= 0) {
+			fs_umount();
+			die_perror("read");
+		}
+	}
+	close(data_fd);
+
+	return 0;
+}
+
+/* Counts a run of 'cmd' started at 'start', which returned 'ret' after moving
+   'bytes' bytes */
+void script_account(struct script_cmd *cmd, uint64_t start, int ret,
+					size_t bytes)
+{
+	struct fs_op_stats *stats = &cmd->stats;
+	uint64_t time = record_now() - start;
+	int bucket = 0;
+
+	while (bucket < FS_STATS_BUCKETS - 1 && time >> (bucket + 1))
+		bucket++;
+
+	stats->calls++;
+	stats->errors += ret < 0;
+	stats->bytes += bytes;
+	stats->time_ns += time;
+	stats->latency[bucket]++;
+}
+
+/* Prints the time the timer section ending with command 'stop' took, and the
+   latency and throughput of each command it ran */
+void script_timer_report(struct script_cmd *cmds, int stop)
+{
+	int start = cmds[stop].match;
+	uint64_t elapsed = record_now() - cmds[start].timer;
+	unsigned long long calls = 0, bytes = 0;
+
+	for (int i = start + 1; i < stop; i++) {
+		calls += cmds[i].stats.calls;
+		bytes += cmds[i].stats.bytes;
+	}
+
+	printf("TIMER %s: elapsed_us=%llu calls=%llu calls_per_s=%llu bytes=%llu "
+		   "mb_per_s=%.1f\n", cmds[stop].args[2],
+		   (unsigned long long)elapsed / 1000, calls,
+		   elapsed ? (unsigned long long)(calls * 1e9 / elapsed) : 0, bytes,
+		   elapsed ? bytes * 1e3 / elapsed : 0);
+
+	for (int i = start + 1; i < stop; i++) {
+		struct fs_op_stats *s = &cmds[i].stats;
+
+		if (!s->calls)
+			continue;
+		printf("  line %d %s: calls=%llu errors=%llu avg_ns=%llu p50_ns=%llu "
+			   "p99_ns=%llu mb_per_s=%.1f\n", cmds[i].line, cmds[i].args[0],
+			   (unsigned long long)s->calls,
+			   (unsigned long long)s->errors,
+			   (unsigned long long)(s->time_ns / s->calls),
+			   stats_percentile(s, 0.5), stats_percentile(s, 0.99),
+			   s->time_ns ? s->bytes * 1e3 / s->time_ns : 0);
+	}
+}
+
+/*
+ * Runs the commands of a script, documented by scripts/README.md. The script
+ * is parsed once before it runs, so that REPEAT blocks and TIMER sections
+ * time libfs rather than the parsing, and buffers are kept from one run of a
+ * command to the next.
+ */
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	struct stat st;
 	char *diskname, *script;
 	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
 	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
+	struct script_cmd *cmds = NULL;
+	int cmd_count = 0, line = 0;
+	int blocks[SCRIPT_REPEAT_DEPTH], repeat_left[SCRIPT_REPEAT_DEPTH];
+	int depth = 0, timer = -1;
+	char *read_buf = NULL;
+	int read_buf_size = 0;
 	char mounted = 0;
 
 	char line_buffer[1024];
-	int command_index = 1;
+	int command_index;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <script filename>");
@@ -60,204 +271,297 @@ void thread_fs_script(void *arg)
 	if (!fd_script)
 		die_perror("fopen");
 
-	int fs_fd = -1;
-
-	/* Loop through the script and execute the specified commands */
+	/* Parse the whole script, matching REPEAT blocks and TIMER sections */
 	while (fgets(line_buffer, 1024, fd_script) != NULL) {
+		struct script_cmd *cmd;
+		char *command;
+
+		line++;
+
 		/* Remove trailing newline from command line */
 		char *nl = strchr(line_buffer, '\n');
 		if (nl)
 			*nl = '\0';
 
+		if (cmd_count % 64 == 0) {
+			cmds = realloc(cmds, (cmd_count + 64) * sizeof(*cmds));
+			if (!cmds)
+				die_perror("realloc");
+		}
+		cmd = &cmds[cmd_count];
+		memset(cmd, 0, sizeof(*cmd));
+		cmd->text = strdup(line_buffer);
+		if (!cmd->text)
+			die_perror("strdup");
+
 		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
+		cmd->args[0] = strtok(cmd->text, "\t");
+		for (command_index = 1; command_index < total_command_parts; command_index++)
+			cmd->args[command_index] = strtok(NULL, "\t");
+		command = cmd->args[0];
+
+		/* End when no command present, and skip comments */
+		if (!command || command[0] == '#') {
+			free(cmd->text);
+			if (!command)
+				break;
+			continue;
+		}
+
+		cmd->line = line;
+		cmd->match = -1;
+		cmd->block = depth ? blocks[depth - 1] : -1;
+		cmd_count++;
+
+		if (strcmp(command, "REPEAT") == 0) {
+			if (!cmd->args[1] || atoi(cmd->args[1]) < 0)
+				die("line %d: invalid repetition count", line);
+			if (depth == SCRIPT_REPEAT_DEPTH)
+				die("line %d: too many nested REPEAT blocks", line);
+			blocks[depth++] = cmd_count - 1;
+
+		} else if (strcmp(command, "END") == 0) {
+			if (!depth)
+				die("line %d: END without REPEAT", line);
+			cmd->match = blocks[--depth];
+			cmd->block = cmd->match;
+			cmds[cmd->match].match = cmd_count - 1;
+
+		} else if (strcmp(command, "TIMER") == 0) {
+			if (!cmd->args[1] || !cmd->args[2])
+				die("line %d: Usage: TIMER START|STOP <name>", line);
+			if (strcmp(cmd->args[1], "START") == 0) {
+				if (timer != -1)
+					die("line %d: timer '%s' not stopped", line,
+						cmds[timer].args[2]);
+				timer = cmd_count - 1;
+			} else if (strcmp(cmd->args[1], "STOP") == 0) {
+				if (timer == -1 || strcmp(cmd->args[2], cmds[timer].args[2]) ||
+					cmds[timer].block != cmd->block)
+					die("line %d: timer '%s' not started in this block", line,
+						cmd->args[2]);
+				cmd->match = timer;
+				cmds[timer].match = cmd_count - 1;
+				timer = -1;
+			} else {
+				die("line %d: Usage: TIMER START|STOP <name>", line);
+			}
+		}
+	}
+	fclose(fd_script);
 
-		int data_fd;
-		int count, data_size;
+	if (depth)
+		die("line %d: REPEAT without END", cmds[blocks[depth - 1]].line);
+	if (timer != -1)
+		die("line %d: timer '%s' not stopped", cmds[timer].line,
+			cmds[timer].args[2]);
 
-		char *read_buf;
+	int fs_fd = -1;
 
-		/* End when no command present */
-		if (!command)
-			break;
+	/* Execute the specified commands, repeated ones printing nothing but
+	   errors */
+	for (int pc = 0; pc < cmd_count; pc++) {
+		struct script_cmd *cmd = &cmds[pc];
+		char *command = cmd->args[0], *fs_filename = cmd->args[1];
+		int quiet = depth > 0;
+		int count, offset;
+		uint64_t start;
+
+		if (strcmp(command, "REPEAT") == 0) {
+			int repeat = atoi(cmd->args[1]);
+
+			/* Skip blocks repeated 0 times */
+			if (!repeat)
+				pc = cmd->match;
+			else
+				repeat_left[depth++] = repeat;
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+		} else if (strcmp(command, "END") == 0) {
+			if (--repeat_left[depth - 1])
+				pc = cmd->match;
+			else
+				depth--;
+
+		} else if (strcmp(command, "TIMER") == 0) {
+			if (strcmp(cmd->args[1], "START") == 0) {
+				for (int i = pc + 1; i < cmd->match; i++)
+					memset(&cmds[i].stats, 0, sizeof(cmds[i].stats));
+				cmd->timer = record_now();
+			} else {
+				script_timer_report(cmds, pc);
+			}
+
+		} else if (strcmp(command, "MOUNT") == 0) {
+			start = record_now();
+			count = fs_mount(diskname);
+			script_account(cmd, start, count, 0);
+			if (count)
 				die("Cannot mount disk");
 			else {
-				printf("MOUNT successful.\n");
+				if (!quiet)
+					printf("MOUNT successful.\n");
 				mounted = 1;
 			}
 
 		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
+			start = record_now();
+			count = mounted ? fs_umount() : 0;
+			script_account(cmd, start, count, 0);
+			if (count)
 				die("Cannot unmount");
 			else {
-				printf("UMOUNT successful.\n");
+				if (!quiet)
+					printf("UMOUNT successful.\n");
 				mounted = 0;
 			}
 
 		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
-
-			if(fs_create(fs_filename)) {
+			start = record_now();
+			count = fs_create(fs_filename);
+			script_account(cmd, start, count, 0);
+			if(count) {
 				fs_umount();
 				die("Cannot create file");
 			}
 
-			printf("CREATE successful.\n");
+			if (!quiet)
+				printf("CREATE successful.\n");
 
 		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
-
-			if(fs_delete(fs_filename)) {
+			start = record_now();
+			count = fs_delete(fs_filename);
+			script_account(cmd, start, count, 0);
+			if(count) {
 				fs_umount();
 				die("Cannot delete file");
 			}
 
-			printf("DELETE successful.\n");
+			if (!quiet)
+				printf("DELETE successful.\n");
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+		} else if (strcmp(command, "MKDIR") == 0) {
+			start = record_now();
+			count = fs_mkdir(fs_filename);
+			script_account(cmd, start, count, 0);
+			if(count) {
+				fs_umount();
+				die("Cannot create directory");
+			}
+
+			if (!quiet)
+				printf("MKDIR successful.\n");
+
+		} else if (strcmp(command, "RMDIR") == 0) {
+			start = record_now();
+			count = fs_rmdir(fs_filename);
+			script_account(cmd, start, count, 0);
+			if(count) {
+				fs_umount();
+				die("Cannot delete directory");
+			}
 
+			if (!quiet)
+				printf("RMDIR successful.\n");
+
+		} else if (strcmp(command, "OPEN") == 0) {
+			start = record_now();
 			fs_fd = fs_open(fs_filename);
+			script_account(cmd, start, fs_fd, 0);
 
 			if (fs_fd < 0) {
 				fs_umount();
 				die("Cannot open file");
 			}
 
-			printf("OPEN successful.\n");
+			if (!quiet)
+				printf("OPEN successful.\n");
 
 		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
+			start = record_now();
+			count = fs_close(fs_fd);
+			script_account(cmd, start, count, 0);
+			if (count) {
 				fs_umount();
 				die("Cannot close file");
 			}
 
-			printf("CLOSE successful.\n");
+			if (!quiet)
+				printf("CLOSE successful.\n");
 
 		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+			offset = atoi(cmd->args[1]);
 
-			if (fs_lseek(fs_fd, offset)) {
+			start = record_now();
+			count = fs_lseek(fs_fd, offset);
+			script_account(cmd, start, count, 0);
+			if (count) {
 				fs_umount();
 				die("Cannot seek to position");
-			} else {
+			} else if (!quiet) {
 				printf("SEEK successful.\n");
 			}
 
 		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
-			}
-
-			if (!data) {
+			if (script_data(cmd, 1)) {
 				fs_umount();
 				die_perror("Could not find data to write");
 			}
 
-			count = fs_write(fs_fd, data, data_size);
+			start = record_now();
+			count = fs_write(fs_fd, cmd->data, cmd->data_size);
+			script_account(cmd, start, count, count < 0 ? 0 : count);
 			if (count < 0) {
 				fs_umount();
 				die("write error");
 			}
-			printf("Wrote %d bytes to file.\n", count);
+			if (!quiet)
+				printf("Wrote %d bytes to file.\n", count);
 
 		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
+			int read_req_length = atoi(cmd->args[1]);
+			int data_size;
 
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
+			if (script_data(cmd, 2)) {
 				fs_umount();
 				die("Invalid data description");
 			}
-
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+			data_size = cmd->data_size;
 
 			if (read_req_length < 0) {
 				fs_umount();
 				die("invalid data read length");
 			}
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
+			/* The buffer also holds the canary compared past the data */
+			if (read_buf_size <= read_req_length || read_buf_size <= data_size) {
+				read_buf_size = (read_req_length > data_size ?
+								 read_req_length : data_size) + 1;
+				free(read_buf);
+				read_buf = malloc(read_buf_size);
+				if (!read_buf) {
+					fs_umount();
+					die_perror("malloc");
+				}
+			}
+
+			start = record_now();
 			count = fs_read(fs_fd, read_buf, read_req_length);
+			script_account(cmd, start, count, count < 0 ? 0 : count);
 
 			if (count < 0) {
 				fs_umount();
 				die("read error");
 			}
 
-			// both data and read_buf were allocated with an extra zero byte
+			// the data is followed by a zero byte, and so is what was read
 			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
+			read_buf[count] = '\0';
+			if (count < data_size)
+				memset(read_buf + count, 0, data_size + 1 - count);
+			if (memcmp(cmd->data, read_buf, data_size+1) != 0)
+				printf("Read unexpected data! %s read vs given %s\n", read_buf, cmd->data);
+			else if (!quiet)
 				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
-
-			free(read_buf);
-			if(file_loaded){
-				free(data);
-			}
 		}
 	}
 
@@ -266,7 +570,13 @@ void thread_fs_script(void *arg)
 	if (mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	for (int i = 0; i < cmd_count; i++) {
+		if (cmds[i].data_owned)
+			free(cmds[i].data);
+		free(cmds[i].text);
+	}
+	free(cmds);
+	free(read_buf);
 }
 
 void thread_fs_stat(void *arg)
@@ -282,35 +592,35 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (test_fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
-		fs_umount();
+		test_fs_umount();
 		die("Cannot open file");
 	}
 
 	stat = fs_stat(fs_fd);
 	if (stat < 0) {
 		fs_close(fs_fd);
-		fs_umount();
+		test_fs_umount();
 		die("Cannot stat file");
 	}
 	if (!stat) {
 		fs_close(fs_fd);
-		fs_umount();
+		test_fs_umount();
 		/* Nothing to read, file is empty */
 		printf("Empty file\n");
 		return;
 	}
 
 	if (fs_close(fs_fd)) {
-		fs_umount();
+		test_fs_umount();
 		die("Cannot close file");
 	}
 
-	if (fs_umount())
+	if (test_fs_umount())
 		die("cannot unmount diskname");
 
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
@@ -319,9 +629,11 @@ void thread_fs_stat(void *arg)
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fs_fd;
 	int stat, read;
+	off_t offset = 0;
+	FILE *content;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -329,18 +641,18 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (test_fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
-		fs_umount();
+		test_fs_umount();
 		die("Cannot open file");
 	}
 
 	stat = fs_stat(fs_fd);
 	if (stat < 0) {
-		fs_umount();
+		test_fs_umount();
 		die("Cannot stat file");
 	}
 	if (!stat) {
@@ -348,29 +660,40 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
 
-	read = fs_read(fs_fd, buf, stat);
+	/* The content goes from the disk to a host temporary file, and from
+	 * there to stdout, without passing through user space, so that the
+	 * number of bytes actually read comes ahead of it */
+	content = tmpfile();
+	if (!content) {
+		perror("tmpfile");
+		test_fs_umount();
+		die("Cannot read file");
+	}
+	read = fs_export_fd(fs_fd, fileno(content));
 
 	if (fs_close(fs_fd)) {
-		fs_umount();
+		fclose(content);
+		test_fs_umount();
 		die("Cannot close file");
 	}
 
-	if (fs_umount())
+	if (test_fs_umount()) {
+		fclose(content);
 		die("cannot unmount diskname");
+	}
 
 	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
 	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
 	fflush(stdout);
-
-	free(buf);
+	while (offset < read &&
+		   sendfile(STDOUT_FILENO, fileno(content), &offset,
+					read - offset) > 0)
+		;
+	fclose(content);
+
+	if (read != stat)
+		die("Cannot read file (%d/%d bytes)", read, stat);
 }
 
 void thread_fs_rm(void *arg)
@@ -384,24 +707,173 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (test_fs_mount(diskname))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
-		fs_umount();
+		test_fs_umount();
 		die("Cannot delete file");
 	}
 
-	if (fs_umount())
+	if (test_fs_umount())
 		die("Cannot unmount diskname");
 
 	printf("Removed file '%s'\n", filename);
 }
 
-void thread_fs_add(void *arg)
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <src filename> <dst filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (test_fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		test_fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
+void thread_fs_grow(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int blocks;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count>");
+
+	diskname = t_arg->argv[0];
+	blocks = atoi(t_arg->argv[1]);
+
+	if (test_fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_grow(blocks)) {
+		test_fs_umount();
+		die("Cannot grow diskname");
+	}
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Grew '%s' to %d data blocks\n", diskname, blocks);
+}
+
+void thread_fs_trim(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int released;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (test_fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	released = fs_trim();
+	if (released < 0) {
+		test_fs_umount();
+		die("Cannot trim diskname");
+	}
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Released %d free blocks of '%s'\n", released, diskname);
+}
+
+void thread_fs_stripe(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int unit;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <stripe unit> <member diskname>...");
+
+	diskname = t_arg->argv[0];
+	unit = atoi(t_arg->argv[1]);
+
+	if (fs_stripe(diskname, (const char **)&t_arg->argv[2], t_arg->argc - 2,
+				  unit))
+		die("Cannot stripe diskname");
+
+	printf("Striped '%s' across %d disks in units of %d blocks\n", diskname,
+		   t_arg->argc - 1, unit);
+}
+
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (test_fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(dirname)) {
+		test_fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (test_fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(dirname)) {
+		test_fs_umount();
+		die("Cannot remove directory");
+	}
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", dirname);
+}
+
+/* Copies a host file into the file system, compressed if 'compress' is set */
+void fs_add(void *arg, int compress)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fd, fs_fd;
 	struct stat st;
 	int written;
@@ -412,53 +884,73 @@ void thread_fs_add(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	/* Open file on host computer */
+	/* Open file on host computer, closed before failing as batches go on
+	 * after failed commands */
 	fd = open(filename, O_RDONLY);
 	if (fd < 0)
 		die_perror("open");
-	if (fstat(fd, &st))
-		die_perror("fstat");
-	if (!S_ISREG(st.st_mode))
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		test_fs_exit();
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
 		die("Not a regular file: %s\n", filename);
-
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
+	}
 
 	/* Now, deal with our filesystem:
 	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
+	 *   file straight from the host file, close the new file, and umount
 	 */
-	if (fs_mount(diskname))
+	if (test_fs_mount(diskname)) {
+		close(fd);
 		die("Cannot mount diskname");
+	}
 
 	if (fs_create(filename)) {
-		fs_umount();
+		close(fd);
+		test_fs_umount();
 		die("Cannot create file");
 	}
 
+	if (compress && fs_compress(filename, 1)) {
+		close(fd);
+		test_fs_umount();
+		die("Cannot compress file");
+	}
+
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
-		fs_umount();
+		close(fd);
+		test_fs_umount();
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	fs_reserve(fs_fd, st.st_size);
+	written = fs_import_fd(fs_fd, fd, st.st_size);
+	close(fd);
 
 	if (fs_close(fs_fd)) {
-		fs_umount();
+		test_fs_umount();
 		die("Cannot close file");
 	}
 
-	if (fs_umount())
+	if (test_fs_umount())
 		die("Cannot unmount diskname");
 
 	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
 		   st.st_size);
+}
 
-	munmap(buf, st.st_size);
-	close(fd);
+void thread_fs_add(void *arg)
+{
+	fs_add(arg, 0);
+}
+
+void thread_fs_addz(void *arg)
+{
+	fs_add(arg, 1);
 }
 
 void thread_fs_ls(void *arg)
@@ -467,36 +959,819 @@ void thread_fs_ls(void *arg)
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [<dirname>]");
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (test_fs_mount_ro(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (t_arg->argc < 2)
+		fs_ls();
+	else if (fs_lsdir(t_arg->argv[1])) {
+		test_fs_umount();
+		die("Cannot list directory");
+	}
 
-	if (fs_umount())
+	if (test_fs_umount())
 		die("Cannot unmount diskname");
 }
 
-void thread_fs_info(void *arg)
+void thread_fs_dedup(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
+	struct timespec start, end;
+	int saved;
 
 	if (t_arg->argc < 1)
 		die("Usage: <diskname>");
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (test_fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_info();
+	if (fs_dedup_mode(1)) {
+		test_fs_umount();
+		die("Cannot enable deduplication");
+	}
 
-	if (fs_umount())
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	saved = fs_dedup();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Deduplicated '%s' (%d bytes saved in %ld us)\n", diskname, saved,
+		   (end.tv_sec - start.tv_sec) * 1000000 +
+		   (end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	struct timespec start, end;
+	int budget = 0, moved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<block budget>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		budget = atoi(t_arg->argv[1]);
+
+	if (test_fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fraginfo();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	moved = fs_defrag(budget);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (moved < 0) {
+		test_fs_umount();
+		die("Cannot defragment diskname");
+	}
+
+	fs_fraginfo();
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Defragmented '%s' (%d blocks written in %ld us)\n", diskname,
+		   moved, (end.tv_sec - start.tv_sec) * 1000000 +
+		   (end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+void thread_fs_info(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (test_fs_mount_ro(diskname))
+		die("Cannot mount diskname");
+
+	fs_info();
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_stats(void *arg)
+{
+	static const char *names[FS_STATS_OP_COUNT] = {
+		[FS_STATS_READ] = "read",
+		[FS_STATS_WRITE] = "write",
+		[FS_STATS_OPEN] = "open",
+		[FS_STATS_CREATE] = "create",
+		[FS_STATS_DELETE] = "delete",
+	};
+	struct thread_arg *t_arg = arg;
+	struct fs_stats stats;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [reset]");
+
+	diskname = t_arg->argv[0];
+
+	if (test_fs_mount_ro(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_stats(&stats)) {
+		test_fs_umount();
+		die("Cannot get statistics");
+	}
+	if (t_arg->argc > 1 && !strcmp(t_arg->argv[1], "reset"))
+		fs_stats_reset();
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	for (int op = 0; op < FS_STATS_OP_COUNT; op++) {
+		struct fs_op_stats *s = &stats.ops[op];
+
+		printf("%s_calls=%llu\n", names[op], (unsigned long long)s->calls);
+		printf("%s_errors=%llu\n", names[op],
+			   (unsigned long long)s->errors);
+		printf("%s_bytes=%llu\n", names[op], (unsigned long long)s->bytes);
+		printf("%s_avg_ns=%llu\n", names[op],
+			   s->calls ? (unsigned long long)(s->time_ns / s->calls) : 0);
+		printf("%s_p50_ns=%llu\n", names[op], stats_percentile(s, 0.5));
+		printf("%s_p99_ns=%llu\n", names[op], stats_percentile(s, 0.99));
+	}
+	printf("disk_reads=%llu\n", (unsigned long long)stats.disk_reads);
+	printf("disk_writes=%llu\n", (unsigned long long)stats.disk_writes);
+	printf("blocks_read=%llu\n", (unsigned long long)stats.blocks_read);
+	printf("blocks_written=%llu\n",
+		   (unsigned long long)stats.blocks_written);
+	printf("dcache_hit_ratio=%llu/%llu\n",
+		   (unsigned long long)stats.dcache_hits,
+		   (unsigned long long)(stats.dcache_hits + stats.dcache_misses));
+	printf("chunk_hit_ratio=%llu/%llu\n",
+		   (unsigned long long)stats.chunk_hits,
+		   (unsigned long long)(stats.chunk_hits + stats.chunk_misses));
+	printf("fat_hops=%llu\n", (unsigned long long)stats.fat_hops);
+}
+
+void thread_fs_heatmap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [on|off]");
+
+	diskname = t_arg->argv[0];
+
+	if (test_fs_mount_ro(diskname))
+		die("Cannot mount diskname");
+
+	/* Counting only makes sense in batch mode or through fsd, where the
+	   disk stays mounted between commands */
+	if (t_arg->argc > 1)
+		ret = fs_heatmap_mode(!strcmp(t_arg->argv[1], "on"));
+	else
+		ret = fs_heatmap();
+
+	if (test_fs_umount())
 		die("Cannot unmount diskname");
+
+	if (ret)
+		die("Cannot %s heatmap", t_arg->argc > 1 ? "set" : "display");
+}
+
+/* Number of threads reading host files during an import */
+#define IMPORT_THREADS 4
+
+/* Number of host files read ahead of the one being written */
+#define IMPORT_WINDOW 16
+
+/* Host file or directory to import, and its content once read */
+struct import_file {
+	char host_path[PATH_MAX];
+	char fs_path[PATH_MAX];
+	int dir;
+	char *buf;
+	size_t size;
+	/* 0 while being read, 1 once read, -1 if it could not be */
+	int state;
+};
+
+/* Import shared between the reader threads and the writer */
+struct import {
+	struct import_file *files;
+	int count;
+	/* Next file to read, and number of files written */
+	int next;
+	int written;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+long elapsed_us(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000000 +
+		   (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Lists host directory 'host_path' recursively, each directory ahead of its
+   content. Returns -1 if a directory cannot be listed, the files listed so far
+   being left for the caller to free. */
+int import_scan(struct import *imp, const char *host_path,
+				const char *fs_path)
+{
+	DIR *dir = opendir(host_path);
+	struct dirent *ent;
+	struct stat st;
+
+	if (!dir) {
+		perror("opendir");
+		return -1;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		struct import_file *f;
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		f = realloc(imp->files, (imp->count + 1) * sizeof(*f));
+		if (!f) {
+			perror("realloc");
+			closedir(dir);
+			return -1;
+		}
+		imp->files = f;
+		f = &imp->files[imp->count];
+		memset(f, 0, sizeof(*f));
+		snprintf(f->host_path, PATH_MAX, "%s/%s", host_path, ent->d_name);
+		snprintf(f->fs_path, PATH_MAX, "%s%s%s", fs_path,
+				 *fs_path ? "/" : "", ent->d_name);
+
+		if (stat(f->host_path, &st)) {
+			perror("stat");
+			closedir(dir);
+			return -1;
+		}
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+			continue;
+		f->dir = S_ISDIR(st.st_mode);
+		imp->count++;
+
+		if (f->dir) {
+			/* 'f' moves as the list grows */
+			char host[PATH_MAX], fs[PATH_MAX];
+			strcpy(host, f->host_path);
+			strcpy(fs, f->fs_path);
+			if (import_scan(imp, host, fs)) {
+				closedir(dir);
+				return -1;
+			}
+		}
+	}
+
+	closedir(dir);
+
+	return 0;
+}
+
+/* Reads whole host file 'f' into memory */
+int import_read(struct import_file *f)
+{
+	struct stat st;
+	int fd = open(f->host_path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !(f->buf = malloc(st.st_size ? st.st_size : 1))) {
+		close(fd);
+		return -1;
+	}
+
+	for (f->size = 0; f->size < (size_t)st.st_size;) {
+		ssize_t ret = read(fd, f->buf + f->size, st.st_size - f->size);
+		if (ret <= 0)
+			break;
+		f->size += ret;
+	}
+	close(fd);
+
+	return f->size == (size_t)st.st_size ? 0 : -1;
+}
+
+/* Reader thread: reads host files in order, at most IMPORT_WINDOW ahead of
+   the writer */
+void *import_reader(void *arg)
+{
+	struct import *imp = arg;
+
+	pthread_mutex_lock(&imp->lock);
+	for (;;) {
+		struct import_file *f;
+		int state;
+
+		while (!imp->stop && imp->next < imp->count &&
+			   imp->next >= imp->written + IMPORT_WINDOW)
+			pthread_cond_wait(&imp->cond, &imp->lock);
+		if (imp->stop || imp->next >= imp->count)
+			break;
+		f = &imp->files[imp->next++];
+		pthread_mutex_unlock(&imp->lock);
+
+		state = f->dir || !import_read(f) ? 1 : -1;
+
+		pthread_mutex_lock(&imp->lock);
+		f->state = state;
+		pthread_cond_broadcast(&imp->cond);
+	}
+	pthread_mutex_unlock(&imp->lock);
+
+	return NULL;
+}
+
+/* Writes imported file or directory 'f' into the file system */
+int import_write(struct import_file *f)
+{
+	int fs_fd, written;
+
+	if (f->dir)
+		return fs_mkdir(f->fs_path);
+
+	if (fs_create(f->fs_path) || (fs_fd = fs_open(f->fs_path)) < 0)
+		return -1;
+
+	/* The blocks of the file are allocated at once from its known size */
+	fs_reserve(fs_fd, f->size);
+	written = fs_write(fs_fd, f->buf, f->size);
+
+	if (fs_close(fs_fd) || written != (int)f->size)
+		return -1;
+
+	return 0;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct import imp = { .lock = PTHREAD_MUTEX_INITIALIZER,
+						  .cond = PTHREAD_COND_INITIALIZER };
+	pthread_t readers[IMPORT_THREADS];
+	char *diskname, *hostdir;
+	struct import_file *failed = NULL;
+	struct timespec start;
+	size_t bytes = 0;
+	int files = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory>");
+
+	diskname = t_arg->argv[0];
+	hostdir = t_arg->argv[1];
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (import_scan(&imp, hostdir, "")) {
+		free(imp.files);
+		die("Cannot list directory '%s'", hostdir);
+	}
+
+	if (test_fs_mount(diskname)) {
+		free(imp.files);
+		die("Cannot mount diskname");
+	}
+
+	/* Host files are read in parallel, and written in order by this thread
+	   alone as libfs is not thread-safe */
+	for (int i = 0; i < IMPORT_THREADS; i++)
+		pthread_create(&readers[i], NULL, import_reader, &imp);
+
+	for (int i = 0; i < imp.count && !failed; i++) {
+		struct import_file *f = &imp.files[i];
+
+		pthread_mutex_lock(&imp.lock);
+		while (!f->state)
+			pthread_cond_wait(&imp.cond, &imp.lock);
+		pthread_mutex_unlock(&imp.lock);
+
+		if (f->state < 0 || import_write(f))
+			failed = f;
+		else if (!f->dir) {
+			files++;
+			bytes += f->size;
+		}
+		free(f->buf);
+		f->buf = NULL;
+
+		pthread_mutex_lock(&imp.lock);
+		imp.written++;
+		pthread_cond_broadcast(&imp.cond);
+		pthread_mutex_unlock(&imp.lock);
+	}
+
+	/* Readers are stopped before failing, the files read ahead dropped */
+	pthread_mutex_lock(&imp.lock);
+	imp.stop = 1;
+	pthread_cond_broadcast(&imp.cond);
+	pthread_mutex_unlock(&imp.lock);
+	for (int i = 0; i < IMPORT_THREADS; i++)
+		pthread_join(readers[i], NULL);
+	for (int i = 0; i < imp.count; i++)
+		free(imp.files[i].buf);
+
+	if (failed) {
+		test_fs_error("Cannot import '%s'", failed->host_path);
+		free(imp.files);
+		test_fs_umount();
+		die("Cannot import directory");
+	}
+	free(imp.files);
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Imported %d files (%zu bytes) from '%s' in %ld us\n", files,
+		   bytes, hostdir, elapsed_us(&start));
+}
+
+/* Copies file system directory 'fs_path' into host directory 'host_path'
+   recursively */
+void export_dir(const char *fs_path, const char *host_path, int *files,
+				size_t *bytes)
+{
+	struct fs_dirent ent;
+	int index = 0;
+
+	if (mkdir(host_path, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	while ((index = fs_readdir(fs_path, index, &ent)) > 0) {
+		char fs_child[PATH_MAX], host_child[PATH_MAX];
+		int fs_fd, fd, count;
+
+		snprintf(fs_child, PATH_MAX, "%s%s%s", fs_path, *fs_path ? "/" : "",
+				 ent.name);
+		snprintf(host_child, PATH_MAX, "%s/%s", host_path, ent.name);
+
+		if (ent.dir) {
+			export_dir(fs_child, host_child, files, bytes);
+			continue;
+		}
+
+		if ((fs_fd = fs_open(fs_child)) < 0)
+			die("Cannot open file '%s'", fs_child);
+		fd = open(host_child, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die_perror("open");
+
+		/* The content goes straight from the disk to the host file */
+		count = fs_export_fd(fs_fd, fd);
+		close(fd);
+		if (count != (int)ent.size)
+			die("Cannot export file '%s'", fs_child);
+		*bytes += count;
+
+		if (fs_close(fs_fd))
+			die("Cannot close file '%s'", fs_child);
+		(*files)++;
+	}
+
+	if (index < 0)
+		die("Cannot list directory '%s'", fs_path);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *hostdir;
+	struct timespec start;
+	size_t bytes = 0;
+	int files = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory>");
+
+	diskname = t_arg->argv[0];
+	hostdir = t_arg->argv[1];
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (test_fs_mount_ro(diskname))
+		die("Cannot mount diskname");
+
+	export_dir("", hostdir, &files, &bytes);
+
+	if (test_fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Exported %d files (%zu bytes) to '%s' in %ld us\n", files, bytes,
+		   hostdir, elapsed_us(&start));
+}
+
+/* Reads the next command of script 'f' into 'rec', its file descriptor being
+   -1 for the file opened last and its data being only counted. Returns -1 if
+   the command is invalid, REPEAT blocks being left to the script command, 0
+   at the end of the script, 1 otherwise. */
+int script_next(FILE *f, struct record *rec)
+{
+	char line[1024], *args[3];
+	struct stat st;
+	int op;
+
+	if (!fgets(line, sizeof(line), f))
+		return 0;
+	line[strcspn(line, "\n")] = '\0';
+
+	/* End when no command present, as the script command does */
+	if (!(args[0] = strtok(line, "\t")))
+		return 0;
+	args[1] = strtok(NULL, "\t");
+	args[2] = strtok(NULL, "\t");
+
+	/* Comments and timers do not call the file system */
+	if (args[0][0] == '#' || !strcmp(args[0], "TIMER"))
+		return script_next(f, rec);
+
+	for (op = 0; op < RECORD_OP_COUNT; op++)
+		if (!strcmp(args[0], record_op_names[op]))
+			break;
+	if (op == RECORD_OP_COUNT)
+		return -1;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->op = op;
+	rec->fd = -1;
+
+	switch (rec->op) {
+	case RECORD_CREATE:
+	case RECORD_DELETE:
+	case RECORD_MKDIR:
+	case RECORD_RMDIR:
+	case RECORD_OPEN:
+		if (!args[1])
+			return -1;
+		snprintf(rec->name, sizeof(rec->name), "%s", args[1]);
+		break;
+	case RECORD_SEEK:
+	case RECORD_READ:
+		if (!args[1])
+			return -1;
+		rec->count = atoi(args[1]);
+		break;
+	case RECORD_WRITE:
+		if (!args[1] || !args[2])
+			return -1;
+		if (!strcmp(args[1], "DATA"))
+			rec->count = strlen(args[2]);
+		else if (!strcmp(args[1], "SIZE") && atoi(args[2]) >= 0)
+			rec->count = atoi(args[2]);
+		else if (!strcmp(args[1], "FILE") && !stat(args[2], &st))
+			rec->count = st.st_size;
+		else
+			return -1;
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+/* Latency of every replayed call of an operation, and bytes moved by them */
+struct replay_op {
+	uint64_t *latency;
+	size_t calls;
+	size_t size;
+	uint64_t bytes;
+};
+
+int replay_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Returns the latency of fraction 'p' of the calls of 'op', sorted */
+unsigned long long replay_percentile(struct replay_op *op, double p)
+{
+	size_t rank = p * op->calls + 0.999999;
+
+	return op->latency[rank ? rank - 1 : 0];
+}
+
+/*
+ * Replays the calls of a recording made by the record command, or the
+ * commands of a script, on a disk: as fast as possible, or at the times they
+ * were recorded at with -t. Recorded file descriptors are mapped to the ones
+ * opened again, recorded disk names are replaced by the disk given, and the
+ * data written is generated. Prints the throughput of the replay and the
+ * latency percentiles of each operation.
+ */
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct replay_op ops[RECORD_OP_COUNT] = { 0 };
+	int argc = t_arg->argc, timed = 0, script = 0;
+	char **argv = t_arg->argv;
+	int fds[FS_OPEN_MAX_COUNT];
+	int fd = -1, mounted = 0, diverged = 0, ret;
+	uint64_t origin = 0, first = 0, elapsed = 0, bytes = 0;
+	char *diskname, *buf = NULL;
+	size_t buf_size = 0, calls = 0;
+	struct record rec;
+	FILE *f;
+
+	if (argc > 0 && !strcmp(argv[0], "-t")) {
+		timed = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2)
+		die("Usage: [-t] <diskname> <recording or script filename>");
+
+	diskname = argv[0];
+
+	/* Anything but a recording is taken as a script */
+	if (!(f = record_open(argv[1]))) {
+		script = 1;
+		if (!(f = fopen(argv[1], "r")))
+			die_perror("fopen");
+	}
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		fds[i] = -1;
+
+	while ((ret = script ? script_next(f, &rec) : record_next(f, &rec)) > 0) {
+		struct replay_op *op = &ops[rec.op];
+		int target = rec.fd < 0 ? fd :
+			rec.fd < FS_OPEN_MAX_COUNT ? fds[rec.fd] : -1;
+		uint64_t start;
+		int res = -1;
+
+		/* Recordings started on a mounted disk start with no mount */
+		if (!mounted && rec.op != RECORD_MOUNT) {
+			if (fs_mount(diskname))
+				die("Cannot mount diskname");
+			mounted = 1;
+		}
+
+		/* The buffer is only filled as it grows, so that calls move the
+		   same data whatever the order they come in */
+		if ((rec.op == RECORD_WRITE || rec.op == RECORD_READ) &&
+			rec.count > buf_size) {
+			char *grown = realloc(buf, rec.count);
+
+			if (!grown) {
+				fs_umount();
+				die_perror("realloc");
+			}
+			for (size_t i = buf_size; i < rec.count; i++)
+				grown[i] = 'a' + i % 26;
+			buf = grown;
+			buf_size = rec.count;
+		}
+
+		if (!calls) {
+			origin = record_now();
+			first = rec.start;
+		} else if (timed && rec.start > first) {
+			uint64_t at = origin + rec.start - first;
+			struct timespec ts = {
+				.tv_sec = at / 1000000000,
+				.tv_nsec = at % 1000000000,
+			};
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+								   NULL) == EINTR)
+				;
+		}
+
+		start = record_now();
+		switch (rec.op) {
+		case RECORD_MOUNT:
+			if (!(res = fs_mount(diskname)))
+				mounted = 1;
+			break;
+		case RECORD_UMOUNT:
+			if (!(res = fs_umount()))
+				mounted = 0;
+			break;
+		case RECORD_CREATE:
+			res = fs_create(rec.name);
+			break;
+		case RECORD_DELETE:
+			res = fs_delete(rec.name);
+			break;
+		case RECORD_MKDIR:
+			res = fs_mkdir(rec.name);
+			break;
+		case RECORD_RMDIR:
+			res = fs_rmdir(rec.name);
+			break;
+		case RECORD_OPEN:
+			res = fs_open(rec.name);
+			if (res >= 0)
+				fd = res;
+			if (rec.fd >= 0 && rec.fd < FS_OPEN_MAX_COUNT)
+				fds[rec.fd] = res;
+			break;
+		case RECORD_CLOSE:
+			res = fs_close(target);
+			break;
+		case RECORD_SEEK:
+			res = fs_lseek(target, rec.count);
+			break;
+		case RECORD_WRITE:
+			res = fs_write(target, buf, rec.count);
+			break;
+		case RECORD_READ:
+			res = fs_read(target, buf, rec.count);
+			break;
+		default:
+			break;
+		}
+
+		if (op->calls == op->size) {
+			size_t size = op->size ? 2 * op->size : 1024;
+			uint64_t *latency = realloc(op->latency,
+										size * sizeof(*latency));
+
+			if (!latency) {
+				fs_umount();
+				die_perror("realloc");
+			}
+			op->latency = latency;
+			op->size = size;
+		}
+		op->latency[op->calls++] = record_now() - start;
+		if ((rec.op == RECORD_WRITE || rec.op == RECORD_READ) && res > 0)
+			op->bytes += res;
+
+		/* Calls failing where they succeeded, or the other way round */
+		if (!script)
+			diverged += (res < 0) != (rec.ret < 0);
+		else
+			diverged += res < 0;
+		calls++;
+	}
+	if (calls)
+		elapsed = record_now() - origin;
+
+	/* Close files left open by the recording */
+	for (int i = 0; mounted && i < FS_OPEN_MAX_COUNT; i++)
+		fs_close(i);
+	if (mounted && fs_umount())
+		die("Cannot unmount diskname");
+	fclose(f);
+	free(buf);
+
+	if (ret < 0)
+		die("Invalid %s '%s'", script ? "script" : "recording", argv[1]);
+
+	for (int i = 0; i < RECORD_OP_COUNT; i++)
+		bytes += ops[i].bytes;
+
+	printf("calls=%zu\n", calls);
+	printf("diverged=%d\n", diverged);
+	printf("elapsed_us=%llu\n", (unsigned long long)elapsed / 1000);
+	printf("calls_per_s=%llu\n",
+		   elapsed ? (unsigned long long)(calls * 1e9 / elapsed) : 0);
+	printf("bytes=%llu\n", (unsigned long long)bytes);
+	printf("mb_per_s=%.1f\n", elapsed ? bytes * 1e3 / elapsed : 0);
+
+	for (int i = 0; i < RECORD_OP_COUNT; i++) {
+		struct replay_op *op = &ops[i];
+		char name[16];
+
+		if (!op->calls)
+			continue;
+
+		for (size_t j = 0; j < sizeof(name); j++)
+			if (!(name[j] = tolower(record_op_names[i][j])))
+				break;
+
+		qsort(op->latency, op->calls, sizeof(*op->latency), replay_compare);
+		printf("%s_calls=%zu\n", name, op->calls);
+		printf("%s_p50_ns=%llu\n", name, replay_percentile(op, 0.5));
+		printf("%s_p99_ns=%llu\n", name, replay_percentile(op, 0.99));
+		printf("%s_p999_ns=%llu\n", name, replay_percentile(op, 0.999));
+		printf("%s_max_ns=%llu\n", name,
+			   (unsigned long long)op->latency[op->calls - 1]);
+		free(op->latency);
+	}
 }
 
 size_t get_argv(char *argv)
@@ -507,19 +1782,222 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_batch(void *arg);
+void thread_fs_trace(void *arg);
+void thread_fs_record(void *arg);
+
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
 	{ "info",	thread_fs_info },
+	{ "stats",	thread_fs_stats },
+	{ "heatmap",	thread_fs_heatmap },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "addz",	thread_fs_addz },
 	{ "rm",		thread_fs_rm },
+	{ "clone",	thread_fs_clone },
+	{ "dedup",	thread_fs_dedup },
+	{ "defrag",	thread_fs_defrag },
+	{ "grow",	thread_fs_grow },
+	{ "stripe",	thread_fs_stripe },
+	{ "trim",	thread_fs_trim },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
 	{ "cat",	thread_fs_cat },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "replay",	thread_fs_replay },
+	{ "batch",	thread_fs_batch },
+	{ "trace",	thread_fs_trace },
+	{ "record",	thread_fs_record }
 };
 
+/* File the calls traced by the trace command are dumped to on exit */
+static const char *trace_filename;
+
+void trace_dump_exit(void)
+{
+	int count;
+
+	trace_stop();
+	count = trace_dump(trace_filename);
+	if (count >= 0)
+		fprintf(stderr, "Dumped %d trace events to '%s'\n", count,
+			trace_filename);
+}
+
+/*
+ * Runs another command with the fs_* and disk calls it makes traced, and dumps
+ * them once it exits, even if it fails.
+ */
+void thread_fs_trace(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	void (*func)(void *) = NULL;
+	size_t i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <trace filename> <command> [<arg>]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(t_arg->argv[1], commands[i].name)) {
+			func = commands[i].func;
+			break;
+		}
+	}
+	if (!func || func == thread_fs_trace)
+		die("invalid traced command '%s'", t_arg->argv[1]);
+
+	if (trace_start())
+		die("Cannot start tracing");
+	trace_filename = t_arg->argv[0];
+	atexit(trace_dump_exit);
+
+	cmd_arg.argc = t_arg->argc - 2;
+	cmd_arg.argv = t_arg->argv + 2;
+	func(&cmd_arg);
+}
+
+/* File the calls recorded by the record command are written to */
+static const char *record_filename;
+
+void record_stop_exit(void)
+{
+	if (!record_stop())
+		fprintf(stderr, "Recorded calls to '%s'\n", record_filename);
+}
+
+/*
+ * Runs another command with the fs_* calls it makes recorded, for the replay
+ * command to make them again, and closes the recording once it exits, even if
+ * it fails.
+ */
+void thread_fs_record(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	void (*func)(void *) = NULL;
+	size_t i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <recording filename> <command> [<arg>]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(t_arg->argv[1], commands[i].name)) {
+			func = commands[i].func;
+			break;
+		}
+	}
+	if (!func || func == thread_fs_record)
+		die("invalid recorded command '%s'", t_arg->argv[1]);
+
+	if (record_start(t_arg->argv[0]))
+		die("Cannot start recording");
+	record_filename = t_arg->argv[0];
+	atexit(record_stop_exit);
+
+	cmd_arg.argc = t_arg->argc - 2;
+	cmd_arg.argv = t_arg->argv + 2;
+	func(&cmd_arg);
+}
+
+/* Maximum number of arguments of a batch command */
+#define BATCH_ARGS_MAX 16
+
+/*
+ * Runs the commands read from a manifest file, or from stdin, one per line
+ * without the diskname, on a disk mounted once. The output of each command is
+ * framed by a line '>>> <command line>' and a line '<<< <status>', status
+ * being 0 on success, 1 on failure.
+ */
+void thread_fs_batch(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, line[4096];
+	char *cmd_argv[BATCH_ARGS_MAX];
+	struct thread_arg cmd_arg;
+	FILE *input = stdin;
+	int failures = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<manifest filename>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1 && strcmp(t_arg->argv[1], "-")) {
+		input = fopen(t_arg->argv[1], "r");
+		if (!input)
+			die_perror("fopen");
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	while (fgets(line, sizeof(line), input) != NULL) {
+		void (*func)(void *) = NULL;
+		volatile int status = 1;
+		size_t i;
+
+		/* Skip blank lines and comments */
+		line[strcspn(line, "\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0' || line[0] == '#')
+			continue;
+
+		printf(">>> %s\n", line);
+
+		cmd_arg.argc = 0;
+		cmd_arg.argv = cmd_argv;
+		for (char *tok = strtok(line, " \t"); tok; tok = strtok(NULL, " \t")) {
+			if (cmd_arg.argc < BATCH_ARGS_MAX)
+				cmd_argv[cmd_arg.argc++] = tok;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(commands); i++) {
+			if (!strcmp(cmd_argv[0], commands[i].name)) {
+				func = commands[i].func;
+				break;
+			}
+		}
+
+		/* Commands that mount on their own cannot be batched */
+		if (!func || func == thread_fs_batch || func == thread_fs_script ||
+			func == thread_fs_stripe || func == thread_fs_trace ||
+			func == thread_fs_replay || func == thread_fs_record)
+			test_fs_error("invalid batch command '%s'", cmd_argv[0]);
+		else {
+			/* The diskname takes the place of the command name */
+			cmd_argv[0] = diskname;
+			batch_diskname = diskname;
+			if (!setjmp(batch_env)) {
+				func(&cmd_arg);
+				status = 0;
+			}
+			batch_diskname = NULL;
+
+			/* Close files left open by a failed command */
+			for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+				fs_close(fd);
+		}
+
+		fflush(stdout);
+		printf("<<< %d\n", status);
+		failures += status;
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (input != stdin)
+		fclose(input);
+
+	if (failures)
+		exit(1);
+}
+
 void usage(char *program)
 {
 	size_t i;
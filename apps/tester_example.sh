@@ -1,7 +1,7 @@
 #!/bin/sh
 
 # make fresh virtual disk
-./fs_make.x disk.fs 4096
+./fs_mkfs.x disk.fs 4096
 
 # get fs_info from reference lib
 ./fs_ref.x info disk.fs >ref.stdout 2>ref.stderr
@@ -1,144 +1,721 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "trace.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
-
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Whether the disk is open read-only */
+	int readonly;
+	/* Shared mapping of the whole disk image, if open read-only */
+	void *map;
+	size_t map_size;
+	/* Blocks from 'base' on are striped in units of 'unit' blocks
+	   round-robin over the 'stripes' images of 'members', the first one
+	   being 'fd' (no striping if 'stripes' is below 2) */
+	size_t base;
+	size_t unit;
+	int stripes;
+	int members[DISK_STRIPE_MAX];
+	/* I/O counters */
+	struct disk_stats stats;
+	/* Reads and writes of each of the first 'heat_count' blocks, one pair
+	   per block, if counted */
+	unsigned *heat;
+	size_t heat_count;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Currently open default virtual disk (none by default) */
+static struct disk *disk;
 
-int block_disk_open(const char *diskname)
+/* Opens @diskname for reading and writing, or read-only if @readonly */
+static struct disk *disk_open_mode(const char *diskname, int readonly)
 {
 	int fd;
 	struct stat st;
+	void *map = NULL;
+	struct disk *d;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
-		return -1;
-	}
-
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+		return NULL;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	if ((fd = open(diskname, readonly ? O_RDONLY : O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	/* Readers share the image's pages through the page cache */
+	if (readonly && st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return NULL;
+		}
+	}
 
-	return 0;
+	if (!(d = malloc(sizeof(*d)))) {
+		perror("malloc");
+		if (map)
+			munmap(map, st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	memset(d, 0, sizeof(*d));
+	d->fd = fd;
+	d->bcount = st.st_size / BLOCK_SIZE;
+	d->readonly = readonly;
+	d->map = map;
+	d->map_size = st.st_size;
+
+	return d;
 }
 
-int block_disk_close(void)
+struct disk *disk_open(const char *diskname)
+{
+	return disk_open_mode(diskname, 0);
+}
+
+struct disk *disk_open_ro(const char *diskname)
+{
+	return disk_open_mode(diskname, 1);
+}
+
+struct disk *disk_create(const char *diskname, size_t count)
+{
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return NULL;
+	}
+
+	if ((fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return NULL;
+	}
+
+	/* The image is a hole until its blocks are written */
+	if (ftruncate(fd, count * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	return disk_open(diskname);
+}
+
+int disk_close(struct disk *d)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
-
-	disk.fd = INVALID_FD;
+	if (d->map)
+		munmap(d->map, d->map_size);
+	for (int member = 1; member < d->stripes; member++)
+		close(d->members[member]);
+	close(d->fd);
+	free(d->heat);
+	free(d);
 
 	return 0;
 }
 
-int block_disk_count(void)
+int disk_count(struct disk *d)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return d->bcount;
 }
 
-int block_write(size_t block, const void *buf)
+/* Checks that blocks @block to @block + @count - 1 of @d can be accessed */
+static int disk_check(struct disk *d, size_t block, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= d->bcount || count > d->bcount - block) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block + count - 1, d->bcount);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Number of blocks of the striped region of @d held by image @member */
+static size_t disk_share(struct disk *d, int member)
+{
+	size_t blocks = d->bcount - d->base;
+	size_t stripes = blocks / d->unit, rest = blocks % d->unit;
+	size_t share = stripes / d->stripes * d->unit;
+
+	if ((size_t)member < stripes % d->stripes)
+		share += d->unit;
+	else if ((size_t)member == stripes % d->stripes)
+		share += rest;
+
+	return member == 0 ? d->base + share : share;
+}
+
+/* Finds the image of @d holding block @block, sets @fd to it and @run to the
+   number of blocks stored contiguously in it from there, and returns the
+   index of the block in that image */
+static size_t disk_locate(struct disk *d, size_t block, int *fd, size_t *run)
+{
+	if (d->stripes < 2 || block < d->base) {
+		*fd = d->fd;
+		*run = (d->stripes < 2 ? d->bcount : d->base) - block;
+		return block;
+	}
+
+	size_t data = block - d->base, stripe = data / d->unit;
+	int member = stripe % d->stripes;
+	size_t index = stripe / d->stripes * d->unit + data % d->unit;
+
+	*fd = d->members[member];
+	*run = d->unit - data % d->unit;
+	return member == 0 ? d->base + index : index;
+}
+
+/* Counts a read or write request of @d over blocks @block to @block + @count
+   - 1 */
+static void disk_account(struct disk *d, size_t block, size_t count,
+			 int writing)
+{
+	if (writing) {
+		d->stats.writes++;
+		d->stats.blocks_written += count;
+	} else {
+		d->stats.reads++;
+		d->stats.blocks_read += count;
+	}
+
+	if (d->heat) {
+		for (size_t i = block; i < block + count && i < d->heat_count; i++)
+			d->heat[2 * i + writing]++;
+	}
+}
+
+/* Reads or writes @count blocks of image @fd from block @index on */
+static int disk_io(int fd, size_t index, size_t count, void *buf, int writing)
+{
+	size_t done = 0, size = count * BLOCK_SIZE;
+	ssize_t ret;
+
+	while (done < size) {
+		if (writing)
+			ret = pwrite(fd, (char *)buf + done, size - done,
+				     index * BLOCK_SIZE + done);
+		else
+			ret = pread(fd, (char *)buf + done, size - done,
+				    index * BLOCK_SIZE + done);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror(writing ? "pwrite" : "pread");
+			else
+				block_error("unexpected end of disk");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+/* Reads or writes blocks @block to @block + @count - 1 of @d, one request per
+   run of blocks stored contiguously in one image */
+static int disk_range(struct disk *d, size_t block, size_t count, void *buf,
+		      int writing)
+{
+	size_t done, run, index;
+	int fd;
+
+	if (disk_check(d, block, count))
+		return -1;
+
+	disk_account(d, block, count, writing);
+
+	/* Runs spanning several images are read in parallel, by first letting
+	   each image read its runs ahead */
+	if (!writing && d->stripes > 1 && block + count > d->base &&
+	    count > d->unit) {
+		for (done = 0; done < count; done += run) {
+			index = disk_locate(d, block + done, &fd, &run);
+			if (run > count - done)
+				run = count - done;
+			posix_fadvise(fd, index * BLOCK_SIZE, run * BLOCK_SIZE,
+				      POSIX_FADV_WILLNEED);
+		}
+	}
+
+	for (done = 0; done < count; done += run) {
+		index = disk_locate(d, block + done, &fd, &run);
+		if (run > count - done)
+			run = count - done;
+		if (disk_io(fd, index, run, (char *)buf + done * BLOCK_SIZE,
+			    writing))
+			return -1;
+	}
+
+	return 0;
+}
+
+int disk_write_range(struct disk *d, size_t block, size_t count,
+		     const void *buf)
+{
+	TRACE_BLOCK(block, count);
+
+	if (d && d->readonly) {
+		block_error("disk is open read-only");
+		return -1;
+	}
+
+	/* Perform the actual write into the disk images, at the offset of the
+	 * specified block number */
+	return disk_range(d, block, count, (void *)buf, 1);
+}
+
+int disk_read_range(struct disk *d, size_t block, size_t count, void *buf)
+{
+	TRACE_BLOCK(block, count);
+
+	if (disk_check(d, block, count))
+		return -1;
+
+	/* Copy straight from the shared mapping of read-only disks */
+	if (d->map && (d->stripes < 2 || block + count <= d->base)) {
+		disk_account(d, block, count, 0);
+		memcpy(buf, (char *)d->map + block * BLOCK_SIZE,
+		       count * BLOCK_SIZE);
+		return 0;
+	}
+
+	/* Perform the actual read from the disk images, at the offset of the
+	 * specified block number */
+	return disk_range(d, block, count, buf, 0);
+}
+
+int disk_write(struct disk *d, size_t block, const void *buf)
+{
+	return disk_write_range(d, block, 1, buf);
+}
+
+int disk_read(struct disk *d, size_t block, void *buf)
+{
+	return disk_read_range(d, block, 1, buf);
+}
+
+const void *disk_map(struct disk *d, size_t block)
+{
+	if (disk_check(d, block, 1) || !d->map ||
+	    (d->stripes > 1 && block >= d->base))
+		return NULL;
+
+	return (char *)d->map + block * BLOCK_SIZE;
+}
+
+/* Whether a kernel-side copy failed with @err for lack of support for the
+   files involved, rather than for an error a buffered copy would also hit */
+static int disk_unsupported(int err)
+{
+	return err == EXDEV || err == EINVAL || err == ENOSYS ||
+		err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Copies @size bytes between image @image at byte @pos and host file @fd at
+   its current position, to @fd if @receiving is 0 and from it otherwise.
+   Returns the number of bytes copied, which is short at the end of @fd */
+static ssize_t disk_copy(int image, off_t pos, size_t size, int fd,
+			 int receiving)
+{
+	char buf[16 * BLOCK_SIZE];
+	size_t done = 0;
+	int kernel = 1, piped = 1;
+	ssize_t ret;
+
+	while (done < size) {
+		off_t off = pos + done;
+		size_t len = size - done;
+
+		/* Kernel-side copies first: copy_file_range() between files,
+		   sendfile() to any output and splice() from pipes, then
+		   buffered copies for whatever they do not support */
+		ret = -1;
+		errno = EINVAL;
+		if (kernel)
+			ret = receiving ?
+				copy_file_range(fd, NULL, image, &off, len, 0) :
+				copy_file_range(image, &off, fd, NULL, len, 0);
+		if (ret < 0 && disk_unsupported(errno)) {
+			kernel = 0;
+			if (piped)
+				ret = receiving ?
+					splice(fd, NULL, image, &off, len, 0) :
+					sendfile(fd, image, &off, len);
+		}
+		if (ret < 0 && disk_unsupported(errno)) {
+			piped = 0;
+			if (len > sizeof(buf))
+				len = sizeof(buf);
+			if (receiving) {
+				ret = read(fd, buf, len);
+				if (ret > 0 && pwrite(image, buf, ret, off) != ret)
+					ret = -1;
+			} else {
+				ret = pread(image, buf, len, off);
+				for (ssize_t out = 0, n; ret > 0 && out < ret; out += n)
+					if ((n = write(fd, buf + out, ret - out)) <= 0)
+						ret = -1;
+			}
+		}
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror(receiving ? "disk_receive" : "disk_send");
+			return done ? (ssize_t)done : -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+/* Copies @size bytes from byte @offset of block @block of @d on, between @d
+   and host file @fd */
+static ssize_t disk_transfer(struct disk *d, size_t block, size_t offset,
+			     size_t size, int fd, int receiving)
+{
+	size_t blocks = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t done = 0, run, index;
+	int image;
+
+	if (disk_check(d, block, blocks))
+		return -1;
+
+	if (receiving && d->readonly) {
+		block_error("disk is open read-only");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	disk_account(d, block, blocks, receiving);
+
+	/* Each run of blocks stored contiguously in an image is copied at
+	   once */
+	while (done < size) {
+		size_t at = offset + done;
+		index = disk_locate(d, block + at / BLOCK_SIZE, &image, &run);
+
+		size_t len = run * BLOCK_SIZE - at % BLOCK_SIZE;
+		if (len > size - done)
+			len = size - done;
+
+		ssize_t ret = disk_copy(image, index * BLOCK_SIZE + at % BLOCK_SIZE,
+					len, fd, receiving);
+		if (ret < 0)
+			return done ? (ssize_t)done : -1;
+		done += ret;
+		if ((size_t)ret < len)
+			break;
+	}
+
+	return done;
+}
+
+ssize_t disk_send(struct disk *d, size_t block, size_t offset, size_t size,
+		  int fd)
+{
+	return disk_transfer(d, block, offset, size, fd, 0);
+}
+
+ssize_t disk_receive(struct disk *d, size_t block, size_t offset, size_t size,
+		     int fd)
+{
+	return disk_transfer(d, block, offset, size, fd, 1);
+}
+
+int disk_stats(struct disk *d, struct disk_stats *stats)
+{
+	if (!d || !stats)
+		return -1;
+
+	*stats = d->stats;
+	return 0;
+}
+
+int disk_stats_reset(struct disk *d)
+{
+	if (!d)
+		return -1;
+
+	memset(&d->stats, 0, sizeof(d->stats));
+	return 0;
+}
+
+int disk_heatmap(struct disk *d, int enable)
+{
+	if (!d)
+		return -1;
+
+	free(d->heat);
+	d->heat = NULL;
+	d->heat_count = 0;
+	if (!enable)
+		return 0;
+
+	if (!(d->heat = calloc(d->bcount, 2 * sizeof(*d->heat)))) {
+		perror("calloc");
 		return -1;
 	}
+	d->heat_count = d->bcount;
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	return 0;
+}
+
+int disk_heat(struct disk *d, size_t block, unsigned *reads, unsigned *writes)
+{
+	if (!d || !d->heat || block >= d->heat_count)
 		return -1;
+
+	*reads = d->heat[2 * block];
+	*writes = d->heat[2 * block + 1];
+	return 0;
+}
+
+int disk_discard(struct disk *d, size_t block, size_t count)
+{
+	size_t done, run, index;
+	int fd;
+
+	if (disk_check(d, block, count))
+		return -1;
+
+	if (d->readonly) {
+		block_error("disk is open read-only");
+		return -1;
+	}
+
+	for (done = 0; done < count; done += run) {
+		index = disk_locate(d, block + done, &fd, &run);
+		if (run > count - done)
+			run = count - done;
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      index * BLOCK_SIZE, run * BLOCK_SIZE)) {
+			/* Hosts without holes simply keep the blocks */
+			if (errno == EOPNOTSUPP)
+				return 0;
+			perror("fallocate");
+			return -1;
+		}
 	}
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+int disk_resize(struct disk *d, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (d->readonly || d->stripes > 1) {
+		block_error("disk cannot be resized");
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	/* Blocks added are holes, which take no space until written */
+	if (ftruncate(d->fd, count * BLOCK_SIZE)) {
+		perror("ftruncate");
 		return -1;
 	}
+	d->bcount = count;
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	/* Blocks added are counted from zero, those removed are forgotten */
+	if (d->heat && count != d->heat_count) {
+		unsigned *heat = realloc(d->heat, count * 2 * sizeof(*heat));
+		if (heat) {
+			if (count > d->heat_count)
+				memset(heat + 2 * d->heat_count, 0,
+				       (count - d->heat_count) * 2 *
+				       sizeof(*heat));
+			d->heat = heat;
+			d->heat_count = count;
+		}
+	}
+
+	return 0;
+}
+
+int disk_stripe(struct disk *d, const char **members, int count, size_t base,
+		size_t unit, size_t blocks, int create)
+{
+	int flags, member, opened;
+	struct stat st;
+
+	if (!d || d->stripes > 1 || count < 1 || count >= DISK_STRIPE_MAX ||
+	    unit == 0 || base > d->bcount) {
+		block_error("invalid striping");
 		return -1;
 	}
 
+	if (create && d->readonly) {
+		block_error("disk is open read-only");
+		return -1;
+	}
+
+	flags = d->readonly ? O_RDONLY : O_RDWR;
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+
+	d->members[0] = d->fd;
+	for (opened = 0; opened < count; opened++) {
+		d->members[opened + 1] = open(members[opened], flags, 0644);
+		if (d->members[opened + 1] < 0) {
+			perror("open");
+			goto error;
+		}
+	}
+
+	d->stripes = count + 1;
+	d->base = base;
+	d->unit = unit;
+	d->bcount = base + blocks;
+
+	/* Every image holds its share of the striped blocks, the first one
+	   being resized last so that it is left as is on failure */
+	for (member = d->stripes - 1; member >= 0; member--) {
+		off_t size = disk_share(d, member) * BLOCK_SIZE;
+		if (create && ftruncate(d->members[member], size)) {
+			perror("ftruncate");
+			goto error;
+		}
+		if (fstat(d->members[member], &st)) {
+			perror("fstat");
+			goto error;
+		}
+		if (st.st_size < size) {
+			block_error("image %d holds %zu blocks out of %zu", member,
+				    st.st_size / BLOCK_SIZE, (size_t)size / BLOCK_SIZE);
+			goto error;
+		}
+	}
+
 	return 0;
+
+error:
+	while (opened-- > 0) {
+		close(d->members[opened + 1]);
+		if (create)
+			unlink(members[opened]);
+	}
+	d->stripes = 0;
+	d->bcount = d->map_size / BLOCK_SIZE;
+	return -1;
 }
 
+/* Default disk, used by the block_* calls */
+
+int block_disk_open(const char *diskname)
+{
+	if (disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	return (disk = disk_open(diskname)) ? 0 : -1;
+}
+
+int block_disk_open_ro(const char *diskname)
+{
+	if (disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	return (disk = disk_open_ro(diskname)) ? 0 : -1;
+}
+
+int block_disk_close(void)
+{
+	int ret = disk_close(disk);
+
+	disk = NULL;
+
+	return ret;
+}
+
+int block_disk_count(void)
+{
+	return disk_count(disk);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	return disk_write_range(disk, block, count, buf);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	return disk_read_range(disk, block, count, buf);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return disk_write(disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return disk_read(disk, block, buf);
+}
+
+const void *block_map(size_t block)
+{
+	return disk_map(disk, block);
+}
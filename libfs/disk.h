@@ -2,10 +2,14 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for ssize_t definition */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Maximum number of images a disk can be striped across */
+#define DISK_STRIPE_MAX 8
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +23,20 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_ro - Open virtual disk file read-only
+ * @diskname: Name of the virtual disk file
+ *
+ * Open virtual disk file @diskname read-only, and map it whole in memory with
+ * a shared mapping, so that processes reading the same disk share its pages.
+ * Blocks are read from the mapping by block_read() and block_map(), while
+ * block_write() fails.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_ro(const char *diskname);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -60,5 +78,312 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write
+ *
+ * Write the content of buffer @buf (@count times %BLOCK_SIZE bytes) to the
+ * virtual disk's blocks @block to @block + @count - 1, with a single request
+ * to the host whenever possible.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count times %BLOCK_SIZE bytes) into buffer @buf, with a single request to
+ * the host whenever possible.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_map - Get the mapping of a block
+ * @block: Index of the block
+ *
+ * Return: NULL if @block is out of bounds, or if the disk is not open
+ * read-only. Otherwise return the address of block @block in the shared
+ * mapping of the disk, which stays valid until the disk is closed.
+ */
+const void *block_map(size_t block);
+
+/**
+ * struct disk - Virtual disk handle
+ *
+ * Opaque handle on an open virtual disk file. Each handle has its own file
+ * descriptor and mapping, so that handles on different disks can be used from
+ * different threads at the same time. The block_* functions operate on a
+ * single default disk.
+ */
+struct disk;
+
+/**
+ * disk_open - Open virtual disk file as a handle
+ * @diskname: Name of the virtual disk file
+ *
+ * Return: NULL if @diskname is invalid or if the virtual disk file cannot be
+ * opened. Otherwise a new disk handle, to be closed with disk_close().
+ */
+struct disk *disk_open(const char *diskname);
+
+/**
+ * disk_open_ro - Open virtual disk file read-only as a handle
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as block_disk_open_ro(), but on a new handle.
+ *
+ * Return: NULL if @diskname is invalid or if the virtual disk file cannot be
+ * opened or mapped. Otherwise a new disk handle.
+ */
+struct disk *disk_open_ro(const char *diskname);
+
+/**
+ * disk_create - Create virtual disk file as a handle
+ * @diskname: Name of the virtual disk file
+ * @count: Number of blocks
+ *
+ * Create virtual disk file @diskname with @count blocks, replacing any file of
+ * that name. The blocks read as zeros, and take no space on the host until they
+ * are written.
+ *
+ * Return: NULL if @diskname is invalid or if the virtual disk file cannot be
+ * created. Otherwise a new disk handle on it.
+ */
+struct disk *disk_create(const char *diskname, size_t count);
+
+/**
+ * disk_close - Close virtual disk handle
+ * @d: Disk handle
+ *
+ * Return: -1 if @d is NULL. 0 otherwise, and @d is freed.
+ */
+int disk_close(struct disk *d);
+
+/**
+ * disk_count - Get block count of disk handle
+ * @d: Disk handle
+ *
+ * Return: -1 if @d is NULL, otherwise the number of blocks @d contains.
+ */
+int disk_count(struct disk *d);
+
+/**
+ * disk_write - Write a block to disk handle
+ * @d: Disk handle
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Return: Same as block_write().
+ */
+int disk_write(struct disk *d, size_t block, const void *buf);
+
+/**
+ * disk_read - Read a block from disk handle
+ * @d: Disk handle
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: Same as block_read().
+ */
+int disk_read(struct disk *d, size_t block, void *buf);
+
+/**
+ * disk_write_range - Write consecutive blocks to disk handle
+ * @d: Disk handle
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write
+ *
+ * Return: Same as block_write_range().
+ */
+int disk_write_range(struct disk *d, size_t block, size_t count,
+		     const void *buf);
+
+/**
+ * disk_read_range - Read consecutive blocks from disk handle
+ * @d: Disk handle
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Return: Same as block_read_range().
+ */
+int disk_read_range(struct disk *d, size_t block, size_t count, void *buf);
+
+/**
+ * disk_map - Get the mapping of a block of disk handle
+ * @d: Disk handle
+ * @block: Index of the block
+ *
+ * Return: Same as block_map().
+ */
+const void *disk_map(struct disk *d, size_t block);
+
+/**
+ * disk_send - Copy bytes of disk handle to a host file
+ * @d: Disk handle
+ * @block: Index of the block to start from
+ * @offset: Offset in block @block to start from, in bytes
+ * @size: Number of bytes to copy
+ * @fd: Host file descriptor, written at its current position
+ *
+ * Copy @size bytes of @d, starting at byte @offset of block @block, to host
+ * file @fd. The bytes are moved by the host kernel without going through the
+ * caller (copy_file_range(), or sendfile() when @fd is not a regular file),
+ * and through a buffer only if the host does not support it.
+ *
+ * Return: -1 if any of the blocks is out of bounds, or if nothing could be
+ * copied. Otherwise the number of bytes copied, less than @size if @fd stopped
+ * accepting them.
+ */
+ssize_t disk_send(struct disk *d, size_t block, size_t offset, size_t size,
+		  int fd);
+
+/**
+ * disk_receive - Copy bytes of a host file to disk handle
+ * @d: Disk handle
+ * @block: Index of the block to start from
+ * @offset: Offset in block @block to start from, in bytes
+ * @size: Number of bytes to copy
+ * @fd: Host file descriptor, read from its current position
+ *
+ * Same as disk_send(), the other way round: copy_file_range() is used from
+ * regular files, and splice() from pipes.
+ *
+ * Return: -1 if any of the blocks is out of bounds, if @d is open read-only,
+ * or if nothing could be copied. Otherwise the number of bytes copied, less
+ * than @size if the end of @fd was reached.
+ */
+ssize_t disk_receive(struct disk *d, size_t block, size_t offset, size_t size,
+		     int fd);
+
+/**
+ * struct disk_stats - I/O counters of disk handle
+ * @reads: Number of read requests
+ * @writes: Number of write requests
+ * @blocks_read: Number of blocks read
+ * @blocks_written: Number of blocks written
+ *
+ * Blocks copied to or from host files by disk_send() and disk_receive() count
+ * as read or written, partial blocks included.
+ */
+struct disk_stats {
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long blocks_read;
+	unsigned long long blocks_written;
+};
+
+/**
+ * disk_stats - Get I/O counters of disk handle
+ * @d: Disk handle
+ * @stats: Counters to fill
+ *
+ * Fill @stats with the counters of @d since it was opened, or since they were
+ * last reset with disk_stats_reset().
+ *
+ * Return: -1 if @d or @stats is NULL. 0 otherwise.
+ */
+int disk_stats(struct disk *d, struct disk_stats *stats);
+
+/**
+ * disk_stats_reset - Reset I/O counters of disk handle
+ * @d: Disk handle
+ *
+ * Return: -1 if @d is NULL. 0 otherwise.
+ */
+int disk_stats_reset(struct disk *d);
+
+/**
+ * disk_heatmap - Count accesses to each block of disk handle
+ * @d: Disk handle
+ * @enable: Whether to count
+ *
+ * Start counting the reads and writes of each block of @d, from zero, or stop
+ * counting if @enable is 0. Requests count once for each block they cover,
+ * partial blocks of disk_send() and disk_receive() included.
+ *
+ * Return: -1 if @d is NULL, or if the counters cannot be allocated. 0
+ * otherwise.
+ */
+int disk_heatmap(struct disk *d, int enable);
+
+/**
+ * disk_heat - Get access counts of a block of disk handle
+ * @d: Disk handle
+ * @block: Index of the block
+ * @reads: Set to the number of reads of @block
+ * @writes: Set to the number of writes of @block
+ *
+ * Return: -1 if @d is not counting accesses, or if @block is out of bounds. 0
+ * otherwise.
+ */
+int disk_heat(struct disk *d, size_t block, unsigned *reads, unsigned *writes);
+
+/**
+ * disk_discard - Release blocks of disk handle
+ * @d: Disk handle
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Punch a hole in the virtual disk file(s) of @d over blocks @block to @block
+ * + @count - 1, which then read as zeros and take no space on the host until
+ * they are written again. Hosts that do not support holes keep the blocks.
+ *
+ * Return: -1 if any of the blocks is out of bounds, if @d is open read-only,
+ * or if the blocks cannot be released. 0 otherwise.
+ */
+int disk_discard(struct disk *d, size_t block, size_t count);
+
+/**
+ * disk_resize - Resize disk handle
+ * @d: Disk handle
+ * @count: New number of blocks
+ *
+ * Resize the virtual disk file of @d to @count blocks. Blocks added read as
+ * zeros, and take no space on the host until they are written.
+ *
+ * Return: -1 if @d is NULL, open read-only or striped, or if the virtual disk
+ * file cannot be resized. 0 otherwise.
+ */
+int disk_resize(struct disk *d, size_t count);
+
+/**
+ * disk_stripe - Stripe disk handle across member images
+ * @d: Disk handle
+ * @members: Names of the member virtual disk files
+ * @count: Number of member virtual disk files
+ * @base: Index of the first striped block
+ * @unit: Number of consecutive blocks stored in each image (stripe unit)
+ * @blocks: Number of striped blocks
+ * @create: Whether to create the member images
+ *
+ * Spread blocks @base to @base + @blocks - 1 of @d round-robin, in units of
+ * @unit blocks, across the image @d was opened on and the @count images of
+ * @members, which are opened in the same mode as @d. Blocks below @base stay
+ * in the first image, ahead of its share of the striped blocks. Reads of
+ * consecutive blocks spanning several images are issued to all of them before
+ * waiting for any. If @create is not 0, the member images are created and
+ * every image is resized to hold its share; otherwise they must already hold
+ * it.
+ *
+ * Return: -1 if @d is NULL or already striped, if the striping is invalid, or
+ * if any image cannot be opened, created or is too small. 0 otherwise, @d then
+ * counting @base + @blocks blocks.
+ */
+int disk_stripe(struct disk *d, const char **members, int count, size_t base,
+		size_t unit, size_t blocks, int create);
+
 #endif /* _DISK_H */
 
@@ -1,17 +1,72 @@
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
+#include "record.h"
+#include "trace.h"
 
 
 #define NUM_ENTRIES_FAT_BLOCK 2048
 #define FAT_EOC 0xFFFF
 
+/* Directory buckets probed past the home bucket before growing */
+#define DIR_PROBE_LIMIT 4
+
+/* Number of subdirectories kept in the directory cache. This is a soft limit:
+   the cache grows past it while every cached subdirectory has cached children
+   or open files, as the ancestors of a deep path all stay cached. */
+#define DCACHE_MAX_COUNT 64
+
+/* Root directory entry flags */
+#define ENTRY_DIR 0x01
+#define ENTRY_PACKED 0x02
+#define ENTRY_COMPRESSED 0x04
+
+/* Files up to PACK_MAX_SIZE bytes share pack blocks, split in units of
+   PACK_UNIT_SIZE bytes whose first one holds the bitmap of used units */
+#define PACK_MAX_SIZE 1024
+#define PACK_UNIT_SIZE 64
+#define PACK_UNITS (BLOCK_SIZE / PACK_UNIT_SIZE)
+
+/* Buckets of the in-memory content index, and entries of its on-disk copy
+   held by each block */
+#define DEDUP_BUCKETS 4096
+#define DEDUP_PAIRS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(struct dedup_pair)))
+
+/* Superblock feature flags */
+#define FEATURE_DEDUP 0x01
+#define FEATURE_PACK 0x02
+
+/* Regions of data blocks whose free blocks are counted by the superblock */
+#define FREE_REGIONS 128
+
+/* Blocks moved by each request when the FAT grows over data blocks */
+#define GROW_MOVE_BLOCKS 256
+
+/* Length of the names of the images a file system is striped across,
+   recorded by the superblock */
+#define STRIPE_NAME_LEN 256
+
+/* Shared data blocks recorded by each reference table block */
+#define REF_PAIRS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(struct ref_pair)))
+
+/* Compressed files are split in chunks of CHUNK_SIZE bytes compressed on
+   their own, found through a chain of map blocks of CHUNK_MAP_COUNT entries.
+   Chunks that do not compress to fewer blocks are stored as is (CHUNK_RAW). */
+#define CHUNK_SIZE (4 * BLOCK_SIZE)
+#define CHUNK_MAP_COUNT ((int)(BLOCK_SIZE / sizeof(struct chunk_map)))
+#define CHUNK_RAW 0x8000
+
 
 /* Superblock data structure */
 struct __attribute__((__packed__)) superblock{
@@ -21,7 +76,32 @@ struct __attribute__((__packed__)) superblock{
 	uint16_t 	data_block_index;
 	uint16_t 	total_data_blocks;
 	uint8_t 	fat_blocks;
-	uint8_t		padding[4079];
+	/* Root directory extension (zero on single-block directories) */
+	uint16_t	rdir_ext_index;
+	uint16_t	rdir_ext_count;
+	uint16_t	rdir_max_probe;
+	/* Chain of blocks shared by small files */
+	uint16_t	pack_index;
+	uint16_t	pack_count;
+	/* Chain of blocks recording shared data blocks */
+	uint16_t	ref_index;
+	uint16_t	ref_count;
+	/* Optional features and chain of the block content index */
+	uint8_t		features;
+	uint16_t	dedup_index;
+	uint16_t	dedup_count;
+	/* Free space summary, valid if 'free_check' matches the checksum of
+	   the FAT and root directory block (zero on images without one) */
+	uint16_t	free_blocks;
+	uint32_t	free_entries;
+	uint32_t	free_check;
+	uint16_t	free_regions[FREE_REGIONS];
+	/* Images the data blocks are striped across in units of 'stripe_unit'
+	   blocks, along with this one (zero on images that are not striped) */
+	uint8_t		stripe_count;
+	uint16_t	stripe_unit;
+	char		stripe_names[FS_STRIPE_MAX_COUNT - 1][STRIPE_NAME_LEN];
+	uint8_t		padding[1999];
 
 };
 
@@ -35,419 +115,4246 @@ struct __attribute__((__packed__)) root_directory_entry{
 	uint8_t  	filename[FS_FILENAME_LEN];
 	uint32_t 	file_size;
 	uint16_t 	first_data_block_index;
-	uint8_t 	padding[10];
+	uint8_t		flags;
+	uint16_t	dir_max_probe;
+	uint16_t	pack_offset;
+	uint8_t 	padding[5];
+};
+
+/* Reference table data structure: extra references held on a data block */
+struct __attribute__((__packed__)) ref_pair{
+	uint16_t	index;
+	uint16_t	count;
+};
+
+/* Content index data structure: hash of a file data block's content */
+struct __attribute__((__packed__)) dedup_pair{
+	uint16_t	index;
+	uint16_t	reserved;
+	uint32_t	hash;
+};
+
+/* Chunk map data structure: first data block and stored size of a chunk of
+   a compressed file (no block if the chunk was never written) */
+struct __attribute__((__packed__)) chunk_map{
+	uint16_t	index;
+	uint16_t	size;
+};
+
+/* In-memory directory: a chain of blocks, each one a bucket of
+   FS_FILE_MAX_COUNT entries. Loaded subdirectories stay cached in a tree
+   below the root directory so that path resolution does not re-read them. */
+struct directory{
+	char name[FS_FILENAME_LEN];
+	int block_count;
+	uint16_t *blocks;
+	struct root_directory_entry *entries;
+	uint16_t max_probe;
+	bool dirty;
+	int open_count;
+	unsigned long last_use;
+	struct directory *parent;
+	struct directory *children;
+	struct directory *next;
+};
+
+/* In-memory copy of the pack block chain and of each block's bitmap */
+struct pack_region{
+	bool loaded;
+	int count;
+	uint16_t *blocks;
+	uint64_t *used;
+};
+
+/* Extra references to data blocks shared by cloned files, beyond the one
+   held by the chain that first allocated them */
+struct ref_table{
+	uint16_t *counts;
+	int shared;
+	int block_count;
+	uint16_t *blocks;
+};
+
+/* Hash of the content of every indexed file data block, chained by bucket,
+   along with statistics of the current mount */
+struct dedup_index{
+	uint32_t *hashes;
+	uint16_t *next;
+	uint16_t *heads;
+	int count;
+	int block_count;
+	uint16_t *blocks;
+	int saved;
+	long long overhead;
+};
+
+/* Last map block of a compressed file accessed (none if 'index' is 0) and
+   last chunk restored, known by the first map block of its file (none if
+   'first' is 0), along with compression statistics of the current mount */
+struct chunk_cache{
+	uint16_t index;
+	struct chunk_map map[CHUNK_MAP_COUNT];
+	uint16_t first;
+	size_t number;
+	size_t length;
+	uint8_t data[CHUNK_SIZE];
+	long long logical;
+	long long stored;
+	long long compress_time;
+	long long restored;
+	long long decompress_time;
 };
 
 struct file_descriptor{
 	int offset;
 	struct root_directory_entry *file;
+	struct directory *dir;
+	bool written;
+	// Whether blocks were reserved past the end of the file
+	bool reserved;
 	//int file_descriptor;	
 };
 
-struct superblock sb;
-struct fat_block *fat;
-struct root_directory_entry rd[FS_FILE_MAX_COUNT];
-struct file_descriptor fdTable[FS_OPEN_MAX_COUNT];
+/* Mounted file system instance. Every instance owns its disk handle and all
+   of its state, so that instances can be used from different threads. */
+struct fs{
+	struct disk *disk;
+	struct superblock sb;
+	struct fat_block *fat;
+	/* Superblock, FAT and root directory block as read at mount time, the
+	   FAT being used in place */
+	void *meta;
+	struct directory rd;
+	struct pack_region pack;
+	struct ref_table refs;
+	struct dedup_index dedup;
+	struct chunk_cache chunks;
+	struct file_descriptor fdTable[FS_OPEN_MAX_COUNT];
+	/* Whether the file system is mounted read-only, its metadata then
+	   being used straight from the shared mapping of the disk */
+	bool readonly;
+	/* Whether the metadata could not be read back after a failed growth,
+	   the instance then only being unmounted */
+	bool failed;
+	/* Number of cached subdirectories and use clock for eviction */
+	int dcache_count;
+	unsigned long dcache_clock;
+	/* Run of data blocks freed but not yet released to the host */
+	uint16_t discard_first;
+	uint16_t discard_count;
+	/* Statistics since mount or the last reset, the disk counters being
+	   kept by the disk handle */
+	struct fs_stats stats;
+};
 
-int mounted = 0;
+/* Instance used by the fs_* calls */
+struct fs *fs_default;
 
-/* Phase 1 */
+/* Statistics */
 
-int fs_format_check(void)
+/* Returns the time of the monotonic clock in nanoseconds. */
+uint64_t stats_now(void)
 {
-	char sig[8] = {'E', 'C', 'S', '1', '5', '0', 'F', 'S'};
-	for (int index = 0; index < 8; index++)
-		if (sb.signature[index] != sig[index]){
-			perror("incorrect signature");
-			return -1;
-		}
+	struct timespec now;
 
-	int total_amt_blocks = 1 + sb.fat_blocks + 1 + sb.total_data_blocks;
-	if (total_amt_blocks != block_disk_count()){
-		perror("incorrect total amount of blocks");
-		return -1;
-	}
-		
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-/* Initalize all file descriptor *file pointers to NULL. */
-void fdtable_init(void)
+/* Records a call of operation 'op' started at 'start', which returned 'ret'
+   after moving 'bytes' bytes. */
+void stats_record(struct fs *fs, enum fs_stats_op op, uint64_t start, int ret,
+size_t bytes)
 {
-	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
-		fdTable[fd].file = NULL;
+	if (!fs || fs->failed)
+		return;
+
+	struct fs_op_stats *stats = &fs->stats.ops[op];
+	uint64_t time = stats_now() - start;
+	int bucket = 0;
+
+	while (bucket < FS_STATS_BUCKETS - 1 && time >> (bucket + 1))
+		bucket++;
+
+	stats->calls++;
+	stats->errors += ret == -1;
+	stats->bytes += bytes;
+	stats->time_ns += time;
+	stats->latency[bucket]++;
 }
 
-int fs_mount(const char *diskname)
+int fsh_stats(struct fs *fs, struct fs_stats *stats)
 {
-	// Open Virtual Disk
-	if (block_disk_open(diskname) == -1)
-		return -1;
-
-	// Read Metadata - Superblock
-	if (block_read(0, &sb) == -1)
-		return -1;
-	
-	// Read Metadata - File Allocation Table
-	fat = malloc(sizeof(struct fat_block) * sb.fat_blocks);
-	for (int index = 1; index <= sb.fat_blocks; index++)
-		if (block_read(index, &fat[index-1]) == -1)
-			return -1;
+	TRACE_PATH(NULL);
 
-	// Read Metadata - Root Directory
-	if (block_read(sb.fat_blocks+1 , &rd) == -1)
-		return -1;
+	struct disk_stats disk;
 
-	// Check for Proper Format 
-	if (fs_format_check() == -1)
+	// No FS currently mounted
+	if (!fs || fs->failed || !stats || disk_stats(fs->disk, &disk) == -1)
 		return -1;
 
-	fdtable_init();
-
-	mounted = 1;
+	*stats = fs->stats;
+	stats->disk_reads = disk.reads;
+	stats->disk_writes = disk.writes;
+	stats->blocks_read = disk.blocks_read;
+	stats->blocks_written = disk.blocks_written;
 
 	return 0;
 }
 
-int fs_umount(void)
+int fsh_stats_reset(struct fs *fs)
 {
-	// Write Metadata to Disk - Superblock
-	if (block_write(0, &sb) == -1)
+	TRACE_PATH(NULL);
+
+	// No FS currently mounted
+	if (!fs || fs->failed)
 		return -1;
 
-	// Write Metadata to Disk - File Allocation Table
-	for (int index = 1; index <= sb.fat_blocks; index++)
-		if (block_write(index, &fat[index-1]) == -1)
-			return -1;
+	memset(&fs->stats, 0, sizeof(fs->stats));
+	return disk_stats_reset(fs->disk);
+}
 
-	// Write Metadata to Disk - Root Directory
-	if (block_write(sb.fat_blocks+1, &rd) == -1)
-		return -1;
-	
-	// Check if FS not mounted or disk cannot be closed
-	if ( !mounted || block_disk_close() == -1)
-		return -1;
+/* Phase 1 */
 
-	// Check if FDs are still open
-	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++){
-		if (fdTable[fd].file != NULL)
+int fs_format_check(struct fs *fs)
+{
+	char sig[8] = {'E', 'C', 'S', '1', '5', '0', 'F', 'S'};
+	for (int index = 0; index < 8; index++)
+		if (fs->sb.signature[index] != sig[index]){
+			perror("incorrect signature");
 			return -1;
-	}
-
+		}
 
-	mounted = 0;
+	int total_amt_blocks = 1 + fs->sb.fat_blocks + 1 + fs->sb.total_data_blocks;
+	if (total_amt_blocks != disk_count(fs->disk)){
+		perror("incorrect total amount of blocks");
+		return -1;
+	}
 
+	if (fs->sb.fat_blocks == 0 ||
+	fs->sb.fat_blocks * NUM_ENTRIES_FAT_BLOCK < fs->sb.total_data_blocks ||
+	fs->sb.root_dir_index != fs->sb.fat_blocks + 1 ||
+	fs->sb.data_block_index != fs->sb.fat_blocks + 2){
+		perror("incorrect metadata layout");
+		return -1;
+	}
+		
 	return 0;
 }
 
-/* Returns sum of free entries in File Allocation Tree. */
-int fat_free(void)
+/* Returns the number of FAT blocks of a disk of 'total' blocks formatted with
+   as few FAT blocks as its data blocks need. */
+int meta_fat_blocks(int total)
 {
-	int count = 0;
+	for (int fatBlocks = 1; fatBlocks < total - 2; fatBlocks++)
+		if (fatBlocks * NUM_ENTRIES_FAT_BLOCK >= total - 2 - fatBlocks)
+			return fatBlocks;
 
-	int block_count = 0;
-	for (uint8_t fatIndex = 0; fatIndex < sb.fat_blocks; fatIndex++){
-		for (int entryIndex = 0; entryIndex < NUM_ENTRIES_FAT_BLOCK; entryIndex++){
-			
-			// Ignores extra unused FAT blocks
-			if (block_count >= sb.total_data_blocks)
-				break;
-			
-			if (fat[fatIndex].fat_entries[entryIndex] == 0)
-				count ++;
+	return 1;
+}
 
-			block_count++;
-		}
+/* Reads the superblock, the 'fat_blocks' FAT blocks and the root directory
+   block with a single read into one block-aligned allocation. */
+int meta_load(struct fs *fs, int fat_blocks)
+{
+	free(fs->meta);
+	fs->meta = NULL;
 
+	if (posix_memalign(&fs->meta, BLOCK_SIZE, BLOCK_SIZE * (fat_blocks + 2)) != 0){
+		fs->meta = NULL;
+		return -1;
 	}
-	return count;
+
+	return disk_read_range(fs->disk, 0, fat_blocks + 2, fs->meta);
 }
 
-/* Returns either sum of free entries in root directory or first free entry
-   depending on value of bool 'total'. */
-int rdir_free(bool sum)
+/* Initalize all file descriptor *file pointers to NULL. */
+void fdtable_init(struct fs *fs)
 {
-	int count = 0;
-
-	for (int entry = 0; entry < FS_FILE_MAX_COUNT; entry++)
-		if (rd[entry].filename[0] == '\0'){
-			if (sum == false)
-				return entry;
-			count++;
-		}	
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		fs->fdTable[fd].file = NULL;
+}
 
-	if (sum == false)
-		return -1;	
-	
-	return count;
+/* Reads data block 'index' into 'buf'. */
+int data_read(struct fs *fs, uint16_t index, void *buf)
+{
+	return disk_read(fs->disk, fs->sb.data_block_index + index, buf);
 }
 
-int fs_info(void)
+/* Reads 'count' consecutive data blocks from 'index' on into 'buf'. */
+int data_read_range(struct fs *fs, uint16_t index, size_t count, void *buf)
 {
-	if (block_disk_count() == -1)
-		return -1;
+	return disk_read_range(fs->disk, fs->sb.data_block_index + index, count,
+	buf);
+}
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", sb.total_blocks);
-	printf("fat_blk_count=%d\n", sb.fat_blocks);
-	printf("rdir_blk=%d\n", sb.fat_blocks + 1);
-	printf("data_blk=%d\n", sb.fat_blocks + 2);
-	printf("data_blk_count=%d\n", sb.total_data_blocks);
-	printf("fat_free_ratio=%d/%d\n", fat_free(), sb.total_data_blocks);
-	printf("rdir_free_ratio=%d/%d\n", rdir_free(true), FS_FILE_MAX_COUNT);
+/* Releases the run of freed data blocks to the host, punching a hole in the
+   disk so that they take no space until written again. */
+void discard_flush(struct fs *fs)
+{
+	if (fs->discard_count)
+		disk_discard(fs->disk, fs->sb.data_block_index + fs->discard_first,
+		fs->discard_count);
+	fs->discard_count = 0;
+}
 
-	return 0;
+/* Whether data block 'index' is in the run of freed data blocks. */
+bool discard_pending(struct fs *fs, uint16_t index)
+{
+	return index >= fs->discard_first &&
+	index - fs->discard_first < fs->discard_count;
 }
 
-/* Phase 2 */
+/* Whether any of the 'count' data blocks from 'index' on is in the run of
+   freed data blocks. */
+bool discard_overlaps(struct fs *fs, uint16_t index, size_t count)
+{
+	return fs->discard_count && index < fs->discard_first + fs->discard_count &&
+	fs->discard_first < index + count;
+}
 
-/* Searches for entry in root directory with specific 'filename'. */
-int rdir_search(const char *filename)
+/* Writes 'buf' to data block 'index'. */
+int data_write(struct fs *fs, uint16_t index, const void *buf)
 {
-	for (int entry = 0; entry < FS_FILE_MAX_COUNT; entry++)
-		if (strcmp((const char *)rd[entry].filename, filename) == 0)
-			return entry;	
+	// Blocks reused before their run is released must not lose this write
+	if (discard_pending(fs, index))
+		discard_flush(fs);
 
-	return -1;
+	return disk_write(fs->disk, fs->sb.data_block_index + index, buf);
 }
 
-int fs_create(const char *filename)
+/* Writes 'count' consecutive data blocks from 'index' on from 'buf'. */
+int data_write_range(struct fs *fs, uint16_t index, size_t count,
+const void *buf)
 {
-	// No FS currently mounted
-	if (!mounted)
-		return -1;
+	if (discard_overlaps(fs, index, count))
+		discard_flush(fs);
 
+	return disk_write_range(fs->disk, fs->sb.data_block_index + index, count,
+	buf);
+}
 
-	// File name @filename is invalid
-	if (strlen(filename) == 0 || strcmp(filename,"\0") == 0)
-		return -1;
-	
-	// File named @filename already exists
-	if (rdir_search(filename) != -1)
-		return -1;
-	
-	// String @filename is too long (strlen does not include '\0')
-	if (strlen(filename) >= FS_FILENAME_LEN)
-		return -1;
+/* Copies 'count' consecutive data blocks from 'index' on from host file
+   'host_fd', returning the number of bytes copied. */
+ssize_t data_receive(struct fs *fs, uint16_t index, size_t count, int host_fd)
+{
+	if (discard_overlaps(fs, index, count))
+		discard_flush(fs);
 
-	// Filename is not NULL-terminated
-	if (filename[strlen(filename)] != '\0')
-		return -1;
+	return disk_receive(fs->disk, fs->sb.data_block_index + index, 0,
+	count * BLOCK_SIZE, host_fd);
+}
 
-	// Root directory file limit reached, also setting index if not
-	int index;
-	if ((index = rdir_free(false)) == -1)
-		return -1;
+/* Returns FAT entry of data block 'index'. */
+uint16_t fat_get(struct fs *fs, uint16_t index)
+{
+	return fs->fat[index / NUM_ENTRIES_FAT_BLOCK].fat_entries[index % NUM_ENTRIES_FAT_BLOCK];
+}
 
-	memcpy(rd[index].filename, filename, FS_FILENAME_LEN);
+/* Returns the free space region of data block 'index'. */
+int free_region(struct fs *fs, uint16_t index)
+{
+	return index / ((fs->sb.total_data_blocks + FREE_REGIONS - 1) / FREE_REGIONS);
+}
+
+/* Sets FAT entry of data block 'index' to 'content'. */
+void fat_set(struct fs *fs, uint16_t index, uint16_t content)
+{
+	// Keep the free space summary up to date
+	if ((fat_get(fs, index) == 0) != (content == 0)){
+		int delta = content == 0 ? 1 : -1;
+		fs->sb.free_blocks += delta;
+		fs->sb.free_regions[free_region(fs, index)] += delta;
+	}
 
-	rd[index].file_size = 0;
-	rd[index].first_data_block_index = FAT_EOC;
+	// Freed blocks are released to the host by runs of consecutive ones,
+	// the run being released before any of its blocks is used again
+	if (content == 0 && fat_get(fs, index) != 0){
+		if (!fs->discard_count ||
+		index != fs->discard_first + fs->discard_count){
+			discard_flush(fs);
+			fs->discard_first = index;
+		}
+		fs->discard_count++;
+	} else if (content != 0 && discard_pending(fs, index))
+		discard_flush(fs);
 
-	return 0;	
+	fs->fat[index / NUM_ENTRIES_FAT_BLOCK].fat_entries[index % NUM_ENTRIES_FAT_BLOCK] = content;
 }
 
-int fdtable_search(const char *filename){
-	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
-		if(fdTable[fd].file != NULL && 
-		strcmp((const char *)fdTable[fd].file->filename, filename) == 0)
-			return fd;
+/* Returns index of a free data block, marking it as end of chain. */
+int allocate_block(struct fs *fs)
+{
+	int size = (fs->sb.total_data_blocks + FREE_REGIONS - 1) / FREE_REGIONS;
+
+	// First fit, skipping regions without free blocks
+	for (int region = 0; region < FREE_REGIONS; region++){
+		if (fs->sb.free_regions[region] == 0)
+			continue;
+		for (int index = region ? region * size : 1;
+		index < (region + 1) * size && index < fs->sb.total_data_blocks; index++)
+			if (fat_get(fs, index) == 0){
+				fat_set(fs, index, FAT_EOC);
+				return index;
+			}
+	}
 
 	return -1;
 }
 
-int fs_delete(const char *filename)
+/* Returns index of the first run of 'count' free data blocks, or -1 if there
+   is none. */
+int free_run(struct fs *fs, int count)
 {
-	int rdirIndex;
-
-	// No FS currently mounted
-	if (!mounted)
-		return -1;
-	
-	// File name @filename is invalid
-	if (strlen(filename) == 0 || strcmp(filename,"\0") == 0)
-		return -1;
+	int length = 0;
 
-	// Filename is not NULL-terminated
-	if (filename[strlen(filename)] != '\0')
-		return -1;
+	for (int index = 1; index < fs->sb.total_data_blocks; index++){
+		length = fat_get(fs, index) == 0 ? length + 1 : 0;
+		if (length == count)
+			return index - count + 1;
+	}
 
-	// File does not exist, also setting rdirIndex if not
-	if ((rdirIndex = rdir_search(filename)) == -1)
-		return -1;
+	return -1;
+}
 
-	// File currently open
-	if (fdtable_search(filename) != -1)
-		return -1;
+/* Returns sum of free entries in File Allocation Tree. */
+int fat_free(struct fs *fs)
+{
+	return fs->sb.free_blocks;
+}
 
-	// Delete entries in FAT blocks
-	uint16_t blockNum, index, content;
-	content = rd[rdirIndex].first_data_block_index;
-	while (content != FAT_EOC){
-		blockNum = content / FS_FILE_MAX_COUNT;
-		index = content % NUM_ENTRIES_FAT_BLOCK;
+/* Checksum of the FAT and of root directory block 'root', which ties the
+   free space summary to the metadata it was computed from. */
+uint32_t free_checksum(struct fs *fs, const void *root)
+{
+	uint64_t hash = 14695981039346656037ull, word;
 
-		content = fat[blockNum].fat_entries[index];
-		fat[blockNum].fat_entries[index] = 0;
+	for (size_t byte = 0; byte < (size_t)fs->sb.fat_blocks * BLOCK_SIZE;
+	byte += sizeof(word)){
+		memcpy(&word, (uint8_t *)fs->fat + byte, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	for (size_t byte = 0; byte < BLOCK_SIZE; byte += sizeof(word)){
+		memcpy(&word, (const uint8_t *)root + byte, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
 	}
 
-	rd[rdirIndex].filename[0] = '\0';
-	rd[rdirIndex].file_size = 0;
-	rd[rdirIndex].first_data_block_index = FAT_EOC;
+	return (uint32_t)(hash ^ hash >> 32) | 1;
+}
 
-	return 0;
+/* Returns sum of free entries in directory 'dir'. */
+int dir_free(struct directory *dir)
+{
+	int count = 0;
+
+	for (int entry = 0; entry < dir->block_count * FS_FILE_MAX_COUNT; entry++)
+		if (dir->entries[entry].filename[0] == '\0')
+			count++;
+	
+	return count;
 }
 
-int fs_ls(void)
+/* Recounts the free space summary from the FAT and the root directory. */
+void free_rebuild(struct fs *fs)
 {
-	// No FS currently mounted
-	if (!mounted)
-		return -1;
-		
-	printf("FS Ls:\n");
+	fs->sb.free_blocks = 0;
+	memset(fs->sb.free_regions, 0, sizeof(fs->sb.free_regions));
 
-	for (int entry = 0; entry < FS_FILE_MAX_COUNT; entry++)
-		if(rd[entry].filename[0] != '\0')
-			printf("file: %s, size: %d, data_blk: %d\n", rd[entry].filename,
-			rd[entry].file_size, 
-			rd[entry].first_data_block_index);
+	for (int index = 0; index < fs->sb.total_data_blocks; index++)
+		if (fat_get(fs, index) == 0){
+			fs->sb.free_blocks++;
+			fs->sb.free_regions[free_region(fs, index)]++;
+		}
 
-	return 0;
+	fs->sb.free_entries = dir_free(&fs->rd);
 }
 
-/* Phase 3 */
-
-/* Searches for free entry in fd table. */
-int fdtable_free(void)
+/* Returns whether the free space summary read from the superblock describes
+   the metadata read along with it. */
+bool free_valid(struct fs *fs, const void *root)
 {
-	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
-		if(fdTable[fd].file == NULL)
-			return fd;
+	int sum = 0;
 
-	return -1;
+	for (int region = 0; region < FREE_REGIONS; region++)
+		sum += fs->sb.free_regions[region];
+
+	return fs->sb.free_check != 0 && sum == fs->sb.free_blocks &&
+	fs->sb.free_blocks <= fs->sb.total_data_blocks &&
+	fs->sb.free_entries <= (uint32_t)fs->rd.block_count * FS_FILE_MAX_COUNT &&
+	fs->sb.free_check == free_checksum(fs, root);
 }
 
-int fs_open(const char *filename)
+/* Reads 'block_count' directory blocks following the FAT chain that starts
+   at data block 'content', after the 'first' blocks already known and
+   loaded by the caller. */
+int dir_load(struct fs *fs, struct directory *dir, int first, uint16_t content)
 {
-	// No FS currently mounted
-	if (!mounted)
+	dir->entries = malloc(BLOCK_SIZE * dir->block_count);
+	if (!dir->entries)
 		return -1;
 
-	int fdNum, rdirIndex;
+	for (int block = first; block < dir->block_count; block++){
+		if (content == FAT_EOC || content >= fs->sb.total_data_blocks){
+			perror("broken directory chain");
+			return -1;
+		}
+		dir->blocks[block] = fs->sb.data_block_index + content;
+		content = fat_get(fs, content);
+	}
 
-	// No more than 32 open file descriptors
-	if ((fdNum = fdtable_free()) == -1)
-		return -1;
+	for (int block = first; block < dir->block_count; block++)
+		if (disk_read(fs->disk, dir->blocks[block],
+		&dir->entries[block * FS_FILE_MAX_COUNT]) == -1)
+			return -1;
 
-	// File name @filename is invalid
-	if (strlen(filename) == 0 || strcmp(filename,"\0") == 0)
+	return 0;
+}
+
+/* Loads the root directory block and its extension chain into memory. */
+int rdir_load(struct fs *fs)
+{
+	memset(&fs->rd, 0, sizeof(struct directory));
+	fs->rd.block_count = 1 + fs->sb.rdir_ext_count;
+	fs->rd.max_probe = fs->sb.rdir_max_probe;
+	fs->rd.blocks = malloc(sizeof(uint16_t) * fs->rd.block_count);
+	if (!fs->rd.blocks)
 		return -1;
 
-	// Check File Exists
-	if ((rdirIndex = rdir_search(filename)) == -1)
+	fs->rd.blocks[0] = fs->sb.root_dir_index;
+
+	if (dir_load(fs, &fs->rd, 1, fs->sb.rdir_ext_count ? fs->sb.rdir_ext_index : FAT_EOC) == -1)
 		return -1;
 
-	fdTable[fdNum].offset = 0;
-	fdTable[fdNum].file = &rd[rdirIndex];
+	// The first block was read along with the rest of the metadata
+	memcpy(fs->rd.entries,
+	(uint8_t *)fs->meta + BLOCK_SIZE * fs->sb.root_dir_index,
+	BLOCK_SIZE);
 
-	return fdNum;
+	return 0;
 }
 
-int fd_is_valid(int fd)
+/* Writes every block of 'dir' back to disk if it was modified. */
+int dir_store(struct fs *fs, struct directory *dir)
 {
-	if (fd >= FS_OPEN_MAX_COUNT || fd < 0 || fdTable[fd].file == NULL)
+	if (!dir->dirty)
 		return 0;
-	return 1;
-	
-}
 
-int fs_close(int fd)
-{
-	// No FS currently mounted OR fd invalid
-	if (!mounted || !fd_is_valid(fd))
-		return -1;
+	for (int block = 0; block < dir->block_count; block++)
+		if (disk_write(fs->disk, dir->blocks[block],
+		&dir->entries[block * FS_FILE_MAX_COUNT]) == -1)
+			return -1;
 
-	fdTable[fd].file = NULL;
+	dir->dirty = false;
 
 	return 0;
 }
 
-int fs_stat(int fd)
+/* Writes back and frees 'dir' along with all of its cached subdirectories. */
+int dir_release(struct fs *fs, struct directory *dir)
 {
-	// No FS currently mounted OR fd invalid
-	if (!mounted || !fd_is_valid(fd))
-		return -1;
+	int ret = 0;
 
-	return fdTable[fd].file->file_size;
-}
+	while (dir->children){
+		struct directory *child = dir->children;
+		dir->children = child->next;
+		if (dir_release(fs, child) == -1)
+			ret = -1;
+	}
 
-int fs_lseek(int fd, size_t offset)
-{
-	// No FS currently mounted OR fd invalid
-	if (!mounted || !fd_is_valid(fd))
-		return -1;
+	if (dir_store(fs, dir) == -1)
+		ret = -1;
 
-	// Check if @offset is larger than the current file size
-	if (offset > fdTable[fd].file->file_size)
-		return -1; 
+	free(dir->blocks);
+	free(dir->entries);
+	dir->blocks = NULL;
+	dir->entries = NULL;
+	dir->block_count = 0;
 
-	fdTable[fd].offset = offset;
+	if (dir != &fs->rd){
+		free(dir);
+		fs->dcache_count--;
+	}
 
-	return 0;
+	return ret;
 }
 
+/* Small-file packing */
 
-/* Phase 4 */
-int index_with_offset(void)
+/* Loads the chain of pack blocks and their unit bitmaps, the first time
+   packed files need space allocated or freed. */
+int pack_load(struct fs *fs)
 {
+	uint8_t block[BLOCK_SIZE];
+	uint16_t content = fs->sb.pack_count ? fs->sb.pack_index : FAT_EOC;
+
+	if (fs->pack.loaded)
+		return 0;
+
+	fs->pack.blocks = malloc(sizeof(uint16_t) * (fs->sb.pack_count + 1));
+	fs->pack.used = malloc(sizeof(uint64_t) * (fs->sb.pack_count + 1));
+	if (!fs->pack.blocks || !fs->pack.used)
+		return -1;
+
+	for (fs->pack.count = 0; fs->pack.count < fs->sb.pack_count; fs->pack.count++){
+		if (content == FAT_EOC || content >= fs->sb.total_data_blocks){
+			perror("broken pack chain");
+			return -1;
+		}
+		if (data_read(fs, content, block) == -1)
+			return -1;
+		fs->pack.blocks[fs->pack.count] = content;
+		memcpy(&fs->pack.used[fs->pack.count], block, sizeof(uint64_t));
+		content = fat_get(fs, content);
+	}
+
+	fs->pack.loaded = true;
+
 	return 0;
 }
 
-int allocate_block(void)
+void pack_release(struct fs *fs)
 {
-	return 0;
+	free(fs->pack.blocks);
+	free(fs->pack.used);
+	memset(&fs->pack, 0, sizeof(struct pack_region));
 }
 
-int fs_write(int fd, void *buf, size_t count)
+/* Returns position of data block 'index' in the pack chain. */
+int pack_search(struct fs *fs, uint16_t index)
 {
-	// No FS currently mounted || fd invalid || buf is NULL
-	if (!mounted || !fd_is_valid(fd) || buf == NULL)
-		return -1;
-
-	
+	for (int position = 0; position < fs->pack.count; position++)
+		if (fs->pack.blocks[position] == index)
+			return position;
 
+	return -1;
+}
 
-	// temp code - just to compile
-	if (fd && buf && count)
-		return 0;
-	return 0;	
+/* Units spanned by a packed file of 'size' bytes. */
+int pack_units(size_t size)
+{
+	return size ? (size + PACK_UNIT_SIZE - 1) / PACK_UNIT_SIZE : 1;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/* Reserves 'units' contiguous units, appending a pack block to the chain if
+   none has room. Sets 'index' and 'offset' to where they start. */
+int pack_alloc(struct fs *fs, int units, uint16_t *index, uint16_t *offset)
 {
-	// No FS currently mounted || fd invalid || buf is NULL
-	if (!mounted || !fd_is_valid(fd) || buf == NULL)
+	uint64_t mask = (1ULL << units) - 1;
+
+	if (pack_load(fs) == -1)
 		return -1;
 
+	for (int position = 0; position < fs->pack.count; position++)
+		for (int unit = 1; unit + units <= PACK_UNITS; unit++)
+			if ((fs->pack.used[position] & (mask << unit)) == 0){
+				fs->pack.used[position] |= mask << unit;
+				*index = fs->pack.blocks[position];
+				*offset = unit * PACK_UNIT_SIZE;
+				return 0;
+			}
 
-	/* Dummy code, not really sure what I'm doing yet lol */
-	uint16_t blockNum, index, content;
-	int rdirIndex = fdTable[fd].file->first_data_block_index;
-	content = rd[rdirIndex].first_data_block_index;
-	while (content != FAT_EOC){
-		blockNum = content / FS_FILE_MAX_COUNT;
-		index = content % NUM_ENTRIES_FAT_BLOCK;
+	int alloc = allocate_block(fs);
+	if (alloc == -1)
+		return -1;
+
+	uint16_t *blocks = realloc(fs->pack.blocks, sizeof(uint16_t) * (fs->pack.count + 1));
+	uint64_t *used = realloc(fs->pack.used, sizeof(uint64_t) * (fs->pack.count + 1));
+	if (blocks)
+		fs->pack.blocks = blocks;
+	if (used)
+		fs->pack.used = used;
+	if (!blocks || !used){
+		fat_set(fs, alloc, 0);
+		return -1;
+	}
+
+	if (fs->pack.count == 0)
+		fs->sb.pack_index = alloc;
+	else
+		fat_set(fs, fs->pack.blocks[fs->pack.count - 1], alloc);
+	fs->pack.blocks[fs->pack.count] = alloc;
+	fs->pack.used[fs->pack.count] = 1 | mask << 1;
+	fs->pack.count++;
+	fs->sb.pack_count = fs->pack.count;
+
+	*index = alloc;
+	*offset = PACK_UNIT_SIZE;
+
+	return 0;
+}
+
+/* Releases the units of 'file', giving the pack block back to the data
+   region once it holds no file at all. The header of the block is written
+   through 'block' when the caller already holds its content. */
+int pack_free(struct fs *fs, struct root_directory_entry *file, uint8_t *block)
+{
+	uint8_t bounce[BLOCK_SIZE];
+	int position, units = pack_units(file->file_size);
+	uint64_t mask = (1ULL << units) - 1;
+
+	if (pack_load(fs) == -1 ||
+	(position = pack_search(fs, file->first_data_block_index)) == -1)
+		return -1;
+
+	fs->pack.used[position] &= ~(mask << (file->pack_offset / PACK_UNIT_SIZE));
+
+	// Only the header left, unlink block from the pack chain
+	if (fs->pack.used[position] == 1){
+		uint16_t next = fat_get(fs, fs->pack.blocks[position]);
+		if (position == 0)
+			fs->sb.pack_index = next == FAT_EOC ? 0 : next;
+		else
+			fat_set(fs, fs->pack.blocks[position - 1], next);
+		fat_set(fs, fs->pack.blocks[position], 0);
+
+		fs->pack.count--;
+		memmove(&fs->pack.blocks[position],
+		&fs->pack.blocks[position + 1],
+		sizeof(uint16_t) * (fs->pack.count - position));
+		memmove(&fs->pack.used[position], &fs->pack.used[position + 1],
+		sizeof(uint64_t) * (fs->pack.count - position));
+		fs->sb.pack_count = fs->pack.count;
+		return 0;
+	}
+
+	if (block){
+		memcpy(block, &fs->pack.used[position], sizeof(uint64_t));
+		return 0;
+	}
+
+	uint16_t index = fs->sb.data_block_index + fs->pack.blocks[position];
+	if (disk_read(fs->disk, index, bounce) == -1)
+		return -1;
+	memcpy(bounce, &fs->pack.used[position], sizeof(uint64_t));
+
+	return disk_write(fs->disk, index, bounce);
+}
+
+/* Writes to a file small enough to stay packed, moving it to a larger run of
+   units when it outgrows its own. */
+size_t pack_write(struct fs *fs, struct root_directory_entry *file,
+size_t offset, const uint8_t *data, size_t count)
+{
+	uint8_t block[BLOCK_SIZE], old[BLOCK_SIZE];
+	size_t size = file->file_size;
+	bool packed = file->flags & ENTRY_PACKED;
+	uint16_t index = file->first_data_block_index;
+	uint16_t pack_offset = file->pack_offset;
+
+	if (pack_load(fs) == -1)
+		return 0;
+
+	if (offset + count > size)
+		size = offset + count;
+
+	// Move to a new run of units, carrying the current content along
+	if (!packed || pack_units(size) > pack_units(file->file_size)){
+		if (pack_alloc(fs, pack_units(size), &index,
+		&pack_offset) == -1)
+			return 0;
+
+		if (data_read(fs, index, block) == -1)
+			return 0;
+
+		if (packed){
+			if (index == file->first_data_block_index)
+				memcpy(old, block, BLOCK_SIZE);
+			else if (data_read(fs, file->first_data_block_index, old) == -1)
+				return 0;
+
+			memcpy(block + pack_offset, old + file->pack_offset,
+			file->file_size);
+			pack_free(fs, file,
+			index == file->first_data_block_index ?
+			block : NULL);
+		}
+	} else if (data_read(fs, index, block) == -1)
+		return 0;
+
+	// The in-memory bitmap is authoritative for the block header
+	memcpy(block, &fs->pack.used[pack_search(fs, index)], sizeof(uint64_t));
+	memcpy(block + pack_offset + offset, data, count);
+	if (data_write(fs, index, block) == -1)
+		return 0;
+
+	file->flags |= ENTRY_PACKED;
+	file->first_data_block_index = index;
+	file->pack_offset = pack_offset;
+	file->file_size = size;
+
+	return count;
+}
+
+/* Moves a packed file that outgrows PACK_MAX_SIZE into a block of its own. */
+int pack_unpack(struct fs *fs, struct root_directory_entry *file)
+{
+	uint8_t block[BLOCK_SIZE];
+	int alloc;
+
+	if ((alloc = allocate_block(fs)) == -1)
+		return -1;
+
+	if (data_read(fs, file->first_data_block_index, block) == -1)
+		goto error;
+	memmove(block, block + file->pack_offset, file->file_size);
+	if (data_write(fs, alloc, block) == -1)
+		goto error;
+
+	if (pack_free(fs, file, NULL) == -1)
+		goto error;
+
+	file->flags &= ~ENTRY_PACKED;
+	file->first_data_block_index = alloc;
+	file->pack_offset = 0;
+
+	return 0;
+
+error:
+	fat_set(fs, alloc, 0);
+	return -1;
+}
+
+/* Block content index */
+
+/* Hash of the content of a block, never 0 so that 0 means not indexed. */
+uint32_t dedup_hash(const void *buf)
+{
+	const uint8_t *bytes = buf;
+	uint64_t hash = 14695981039346656037ULL, word;
+
+	// Word at a time, @buf may come unaligned from the caller of fs_write()
+	for (size_t offset = 0; offset < BLOCK_SIZE; offset += sizeof(word)){
+		memcpy(&word, bytes + offset, sizeof(word));
+		hash ^= word;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= hash >> 32;
+
+	return (uint32_t)hash ? (uint32_t)hash : 1;
+}
+
+/* Removes data block 'index' from the content index. */
+void dedup_forget(struct fs *fs, uint16_t index)
+{
+	if (!fs->dedup.hashes || !fs->dedup.hashes[index])
+		return;
+
+	uint16_t *link = &fs->dedup.heads[fs->dedup.hashes[index] % DEDUP_BUCKETS];
+	while (*link != index)
+		link = &fs->dedup.next[*link];
+	*link = fs->dedup.next[index];
+
+	fs->dedup.hashes[index] = 0;
+	fs->dedup.count--;
+}
+
+/* Records 'hash' as the content of file data block 'index'. */
+void dedup_insert(struct fs *fs, uint16_t index, uint32_t hash)
+{
+	if (!fs->dedup.hashes)
+		return;
+
+	dedup_forget(fs, index);
+
+	fs->dedup.hashes[index] = hash;
+	fs->dedup.next[index] = fs->dedup.heads[hash % DEDUP_BUCKETS];
+	fs->dedup.heads[hash % DEDUP_BUCKETS] = index;
+	fs->dedup.count++;
+}
+
+/* Allocates an empty content index. */
+int dedup_alloc(struct fs *fs)
+{
+	fs->dedup.hashes = calloc(fs->sb.total_data_blocks, sizeof(uint32_t));
+	fs->dedup.next = calloc(fs->sb.total_data_blocks, sizeof(uint16_t));
+	fs->dedup.heads = calloc(DEDUP_BUCKETS, sizeof(uint16_t));
+	fs->dedup.blocks = malloc(sizeof(uint16_t) * (fs->sb.dedup_count + 1));
+	if (!fs->dedup.hashes || !fs->dedup.next || !fs->dedup.heads ||
+	!fs->dedup.blocks)
+		return -1;
+
+	return 0;
+}
+
+/* Loads the content index when the file system is in deduplication mode. */
+int dedup_load(struct fs *fs)
+{
+	struct dedup_pair pairs[DEDUP_PAIRS_PER_BLOCK];
+	uint16_t content = fs->sb.dedup_index;
+
+	memset(&fs->dedup, 0, sizeof(struct dedup_index));
+	if (!(fs->sb.features & FEATURE_DEDUP) && fs->sb.dedup_count == 0)
+		return 0;
+
+	if (dedup_alloc(fs) == -1)
+		return -1;
+
+	for (fs->dedup.block_count = 0; fs->dedup.block_count < fs->sb.dedup_count;
+	fs->dedup.block_count++){
+		if (content == FAT_EOC || content >= fs->sb.total_data_blocks){
+			perror("broken content index chain");
+			return -1;
+		}
+		if (data_read(fs, content, pairs) == -1)
+			return -1;
+		fs->dedup.blocks[fs->dedup.block_count] = content;
+
+		for (int pair = 0; pair < DEDUP_PAIRS_PER_BLOCK; pair++)
+			if (pairs[pair].index && pairs[pair].index < fs->sb.total_data_blocks)
+				dedup_insert(fs, pairs[pair].index, pairs[pair].hash);
+
+		content = fat_get(fs, content);
+	}
+
+	return 0;
+}
+
+/* Writes the content index back, growing or shrinking its chain of blocks.
+   The index only speeds deduplication up, so entries that do not fit on a
+   full disk are dropped. */
+int dedup_store(struct fs *fs)
+{
+	struct dedup_pair pairs[DEDUP_PAIRS_PER_BLOCK];
+	int needed = 0, index = 1;
+
+	if (!fs->dedup.hashes)
+		return 0;
+
+	if (fs->sb.features & FEATURE_DEDUP)
+		needed = (fs->dedup.count + DEDUP_PAIRS_PER_BLOCK - 1) /
+		DEDUP_PAIRS_PER_BLOCK;
+
+	while (fs->dedup.block_count < needed){
+		uint16_t *blocks = realloc(fs->dedup.blocks,
+		sizeof(uint16_t) * (fs->dedup.block_count + 1));
+		int alloc = allocate_block(fs);
+		if (blocks)
+			fs->dedup.blocks = blocks;
+		if (!blocks || alloc == -1){
+			if (alloc != -1)
+				fat_set(fs, alloc, 0);
+			break;
+		}
+
+		if (fs->dedup.block_count == 0)
+			fs->sb.dedup_index = alloc;
+		else
+			fat_set(fs,
+			fs->dedup.blocks[fs->dedup.block_count - 1], alloc);
+		fs->dedup.blocks[fs->dedup.block_count++] = alloc;
+	}
+
+	// Unused blocks go back to the data region
+	if (needed < fs->dedup.block_count){
+		if (needed == 0)
+			fs->sb.dedup_index = 0;
+		else
+			fat_set(fs, fs->dedup.blocks[needed - 1], FAT_EOC);
+		for (int block = needed; block < fs->dedup.block_count; block++)
+			fat_set(fs, fs->dedup.blocks[block], 0);
+		fs->dedup.block_count = needed;
+	}
+	fs->sb.dedup_count = fs->dedup.block_count;
+
+	for (int block = 0; block < fs->dedup.block_count; block++){
+		memset(pairs, 0, BLOCK_SIZE);
+		for (int pair = 0; pair < DEDUP_PAIRS_PER_BLOCK &&
+		index < fs->sb.total_data_blocks; index++)
+			if (fs->dedup.hashes[index]){
+				pairs[pair].index = index;
+				pairs[pair].hash = fs->dedup.hashes[index];
+				pair++;
+			}
+
+		if (data_write(fs, fs->dedup.blocks[block], pairs) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+void dedup_release(struct fs *fs)
+{
+	free(fs->dedup.hashes);
+	free(fs->dedup.next);
+	free(fs->dedup.heads);
+	free(fs->dedup.blocks);
+	memset(&fs->dedup, 0, sizeof(struct dedup_index));
+}
+
+/* Block reference counts */
+
+/* Loads the table of data blocks shared by cloned files. */
+int ref_load(struct fs *fs)
+{
+	struct ref_pair pairs[REF_PAIRS_PER_BLOCK];
+	uint16_t content = fs->sb.ref_index;
+
+	memset(&fs->refs, 0, sizeof(struct ref_table));
+	if (fs->sb.ref_count == 0)
+		return 0;
+
+	fs->refs.counts = calloc(fs->sb.total_data_blocks, sizeof(uint16_t));
+	fs->refs.blocks = malloc(sizeof(uint16_t) * fs->sb.ref_count);
+	if (!fs->refs.counts || !fs->refs.blocks)
+		return -1;
+
+	for (fs->refs.block_count = 0; fs->refs.block_count < fs->sb.ref_count;
+	fs->refs.block_count++){
+		if (content == FAT_EOC || content >= fs->sb.total_data_blocks){
+			perror("broken reference table chain");
+			return -1;
+		}
+		if (data_read(fs, content, pairs) == -1)
+			return -1;
+		fs->refs.blocks[fs->refs.block_count] = content;
+
+		for (int pair = 0; pair < REF_PAIRS_PER_BLOCK; pair++){
+			if (pairs[pair].index == 0)
+				break;
+			if (pairs[pair].index >= fs->sb.total_data_blocks)
+				continue;
+			fs->refs.counts[pairs[pair].index] = pairs[pair].count;
+			fs->refs.shared++;
+		}
+
+		content = fat_get(fs, content);
+	}
+
+	return 0;
+}
+
+/* Writes the reference table back, releasing the blocks it no longer
+   needs. */
+int ref_store(struct fs *fs)
+{
+	struct ref_pair pairs[REF_PAIRS_PER_BLOCK];
+	int needed = (fs->refs.shared + REF_PAIRS_PER_BLOCK - 1) / REF_PAIRS_PER_BLOCK;
+	int index = 1;
+
+	if (!fs->refs.counts)
+		return 0;
+
+	// Unused blocks go back to the data region
+	if (needed < fs->refs.block_count){
+		if (needed == 0)
+			fs->sb.ref_index = 0;
+		else
+			fat_set(fs, fs->refs.blocks[needed - 1], FAT_EOC);
+		for (int block = needed; block < fs->refs.block_count; block++)
+			fat_set(fs, fs->refs.blocks[block], 0);
+		fs->refs.block_count = needed;
+	}
+	fs->sb.ref_count = fs->refs.block_count;
+
+	for (int block = 0; block < fs->refs.block_count; block++){
+		memset(pairs, 0, BLOCK_SIZE);
+		for (int pair = 0; pair < REF_PAIRS_PER_BLOCK &&
+		index < fs->sb.total_data_blocks; index++)
+			if (fs->refs.counts[index]){
+				pairs[pair].index = index;
+				pairs[pair].count = fs->refs.counts[index];
+				pair++;
+			}
+
+		if (data_write(fs, fs->refs.blocks[block], pairs) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+void ref_release(struct fs *fs)
+{
+	free(fs->refs.counts);
+	free(fs->refs.blocks);
+	memset(&fs->refs, 0, sizeof(struct ref_table));
+}
+
+/* Makes room in the reference table for 'extra' more shared blocks. */
+int ref_reserve(struct fs *fs, int extra)
+{
+	if (!fs->refs.counts &&
+	!(fs->refs.counts = calloc(fs->sb.total_data_blocks, sizeof(uint16_t))))
+		return -1;
+
+	while (fs->refs.shared + extra > fs->refs.block_count * REF_PAIRS_PER_BLOCK){
+		uint16_t *blocks = realloc(fs->refs.blocks,
+		sizeof(uint16_t) * (fs->refs.block_count + 1));
+		if (!blocks)
+			return -1;
+		fs->refs.blocks = blocks;
+
+		int alloc = allocate_block(fs);
+		if (alloc == -1)
+			return -1;
+
+		if (fs->refs.block_count == 0)
+			fs->sb.ref_index = alloc;
+		else
+			fat_set(fs, fs->refs.blocks[fs->refs.block_count - 1],
+			alloc);
+		fs->refs.blocks[fs->refs.block_count++] = alloc;
+		fs->sb.ref_count = fs->refs.block_count;
+	}
+
+	return 0;
+}
+
+/* Adds a reference to data block 'index'. */
+void ref_get(struct fs *fs, uint16_t index)
+{
+	if (fs->refs.counts[index]++ == 0)
+		fs->refs.shared++;
+}
+
+/* Drops a reference to data block 'index', returning true if it was the
+   last one and the block can be freed. */
+bool ref_put(struct fs *fs, uint16_t index)
+{
+	if (!fs->refs.counts || fs->refs.counts[index] == 0)
+		return true;
+
+	if (--fs->refs.counts[index] == 0)
+		fs->refs.shared--;
+
+	return false;
+}
+
+/* Copies the blocks of 'file' shared with a clone, from the first one up to
+   chain position 'last', so that they can be modified. Blocks beyond 'last'
+   keep being shared. */
+int ref_unshare(struct fs *fs, struct root_directory_entry *file, size_t last)
+{
+	uint8_t block[BLOCK_SIZE];
+	uint16_t prev = FAT_EOC, index = file->first_data_block_index;
+	size_t position = 0;
+
+	if (!fs->refs.counts)
+		return 0;
+
+	// Skip blocks only referenced by this file
+	while (index != FAT_EOC && position <= last &&
+	fs->refs.counts[index] == 0){
+		prev = index;
+		index = fat_get(fs, index);
+		position++;
+	}
+	if (index == FAT_EOC || position > last)
+		return 0;
+
+	// Every block of the prefix is copied, as FAT links cannot diverge
+	int needed = 0;
+	for (uint16_t next = index; next != FAT_EOC && position + needed <= last;
+	next = fat_get(fs, next))
+		needed++;
+	if (fat_free(fs) < needed || ref_reserve(fs, 1) == -1)
+		return -1;
+
+	ref_put(fs, index);
+	while (index != FAT_EOC && position <= last){
+		uint16_t copy = allocate_block(fs);
+		if (data_read(fs, index, block) == -1 ||
+		data_write(fs, copy, block) == -1)
+			return -1;
+
+		if (prev == FAT_EOC)
+			file->first_data_block_index = copy;
+		else
+			fat_set(fs, prev, copy);
+		if (fs->dedup.hashes && fs->dedup.hashes[index])
+			dedup_insert(fs, copy, fs->dedup.hashes[index]);
+
+		prev = copy;
+		index = fat_get(fs, index);
+		position++;
+	}
+
+	// The copied prefix rejoins the rest of the shared chain
+	if (index != FAT_EOC){
+		fat_set(fs, prev, index);
+		ref_get(fs, index);
+	}
+
+	return 0;
+}
+
+/* Block deduplication */
+
+/* Nanoseconds elapsed since 'start'. */
+long long dedup_elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000LL +
+	(now.tv_nsec - start->tv_nsec);
+}
+
+/* Replaces the last blocks of the chain of 'file' by identical indexed
+   blocks, returning the number of blocks freed. A FAT block has a single
+   successor, so a block can only be shared along with the rest of its chain
+   and chains are matched from their last block backwards. */
+int dedup_chain(struct fs *fs, struct root_directory_entry *file)
+{
+	uint8_t block[BLOCK_SIZE], other[BLOCK_SIZE];
+	uint16_t *chain;
+	int length = 0, saved = 0;
+
+	if (!fs->dedup.hashes ||
+	file->flags & (ENTRY_DIR | ENTRY_PACKED | ENTRY_COMPRESSED))
+		return 0;
+
+	for (uint16_t index = file->first_data_block_index; index != FAT_EOC;
+	index = fat_get(fs, index))
+		length++;
+	if (length == 0 || !(chain = malloc(sizeof(uint16_t) * length)))
+		return 0;
+
+	length = 0;
+	for (uint16_t index = file->first_data_block_index; index != FAT_EOC;
+	index = fat_get(fs, index))
+		chain[length++] = index;
+
+	for (int position = length - 1; position >= 0; position--){
+		uint16_t index = chain[position];
+		uint16_t next = position + 1 < length ? chain[position + 1] : FAT_EOC;
+		uint16_t match = 0;
+
+		// Already shared, yet the blocks before it may still match
+		if (fs->refs.counts && fs->refs.counts[index])
+			continue;
+
+		if (!fs->dedup.hashes[index] ||
+		data_read(fs, index, block) == -1)
+			break;
+
+		for (uint16_t other_index = fs->dedup.heads[fs->dedup.hashes[index] %
+		DEDUP_BUCKETS]; other_index; other_index = fs->dedup.next[other_index]){
+			if (other_index == index ||
+			fs->dedup.hashes[other_index] != fs->dedup.hashes[index] ||
+			fat_get(fs, other_index) != next)
+				continue;
+			if (data_read(fs, other_index, other) == -1)
+				break;
+			if (memcmp(block, other, BLOCK_SIZE) == 0){
+				match = other_index;
+				break;
+			}
+		}
+
+		if (!match || ref_reserve(fs, 1) == -1)
+			break;
+
+		// Point the previous block at the match, then drop this copy
+		if (position == 0)
+			file->first_data_block_index = match;
+		else
+			fat_set(fs, chain[position - 1], match);
+		ref_get(fs, match);
+		if (next != FAT_EOC)
+			ref_put(fs, next);
+		dedup_forget(fs, index);
+		fat_set(fs, index, 0);
+
+		chain[position] = match;
+		saved++;
+	}
+
+	free(chain);
+	fs->dedup.saved += saved;
+
+	return saved;
+}
+
+/* Compressed files */
+
+/* Frees a chain of blocks that is never shared, such as chunks of
+   compressed files. */
+void chunk_free(struct fs *fs, uint16_t index)
+{
+	uint16_t next;
+
+	while (index != FAT_EOC){
+		next = fat_get(fs, index);
+		fat_set(fs, index, 0);
+		index = next;
+	}
+}
+
+/* Returns map entry of chunk 'chunk' of compressed file 'file', bringing its
+   map block in the cache and, if 'extend' is true, extending the map chain
+   with empty blocks as needed. Returns NULL on failure. */
+struct chunk_map *map_load(struct fs *fs, struct root_directory_entry *file,
+size_t chunk, bool extend)
+{
+	uint16_t index = FAT_EOC, next;
+	int alloc;
+
+	for (size_t hop = 0; hop <= chunk / CHUNK_MAP_COUNT; hop++){
+		next = index == FAT_EOC ? file->first_data_block_index : fat_get(fs, index);
+
+		if (next == FAT_EOC){
+			if (!extend || (alloc = allocate_block(fs)) == -1)
+				return NULL;
+			memset(fs->chunks.map, 0, BLOCK_SIZE);
+			fs->chunks.index = alloc;
+			if (data_write(fs, alloc, fs->chunks.map) == -1){
+				fat_set(fs, alloc, 0);
+				fs->chunks.index = 0;
+				return NULL;
+			}
+			if (index == FAT_EOC)
+				file->first_data_block_index = alloc;
+			else
+				fat_set(fs, index, alloc);
+			next = alloc;
+		}
+
+		index = next;
+	}
+
+	if (fs->chunks.index != index){
+		fs->chunks.index = 0;
+		if (data_read(fs, index, fs->chunks.map) == -1)
+			return NULL;
+		fs->chunks.index = index;
+	}
+
+	return &fs->chunks.map[chunk % CHUNK_MAP_COUNT];
+}
+
+/* Fills 'chunk' with the 'length' bytes of the chunk described by 'entry'. */
+int chunk_load(struct fs *fs, struct chunk_map entry, uint8_t *chunk,
+size_t length)
+{
+	uint8_t stored[CHUNK_SIZE], bounce[BLOCK_SIZE];
+	size_t size = entry.size & ~CHUNK_RAW;
+	uint8_t *target = entry.size & CHUNK_RAW ? chunk : stored;
+	uint16_t index = entry.index;
+	struct timespec start;
+	int restored;
+
+	// Chunk never written
+	if (entry.index == 0){
+		memset(chunk, 0, length);
+		return 0;
+	}
+
+	if (size > CHUNK_SIZE || (entry.size & CHUNK_RAW && size > length))
+		return -1;
+
+	for (size_t position = 0; position < size; position += BLOCK_SIZE){
+		if (index == FAT_EOC)
+			return -1;
+		if (size - position >= BLOCK_SIZE){
+			if (data_read(fs, index, target + position) == -1)
+				return -1;
+		} else {
+			if (data_read(fs, index, bounce) == -1)
+				return -1;
+			memcpy(target + position, bounce, size - position);
+		}
+		index = fat_get(fs, index);
+	}
+
+	if (entry.size & CHUNK_RAW){
+		memset(chunk + size, 0, length - size);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((restored = lz_decompress(stored, size, chunk, length)) == -1)
+		return -1;
+	fs->chunks.decompress_time += dedup_elapsed(&start);
+	fs->chunks.restored += restored;
+
+	memset(chunk + restored, 0, length - restored);
+
+	return 0;
+}
+
+/* Compresses the 'length' bytes of 'chunk' into the blocks of the chunk
+   described by 'entry', reusing its blocks. Blocks are all allocated before
+   any is written so that the chunk is left untouched if the disk is full. */
+int chunk_store(struct fs *fs, struct chunk_map *entry, const uint8_t *chunk,
+size_t length)
+{
+	uint8_t stored[CHUNK_SIZE], bounce[BLOCK_SIZE];
+	const uint8_t *content = stored;
+	struct timespec start;
+	size_t size;
+	uint16_t raw = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size = lz_compress(chunk, length, stored, sizeof(stored));
+	fs->chunks.compress_time += dedup_elapsed(&start);
+
+	// Chunks that would not save a block are kept as is
+	if (size == 0 ||
+	(size + BLOCK_SIZE - 1) / BLOCK_SIZE >= (length + BLOCK_SIZE - 1) / BLOCK_SIZE){
+		content = chunk;
+		size = length;
+		raw = CHUNK_RAW;
+	}
+	fs->chunks.logical += length;
+	fs->chunks.stored += size;
+
+	// Extend the chunk's chain up to the number of blocks needed
+	int needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE, count = 0;
+	uint16_t first = entry->index ? entry->index : FAT_EOC, last = FAT_EOC;
+	for (uint16_t index = first; index != FAT_EOC && count < needed;
+	index = fat_get(fs, index)){
+		last = index;
+		count++;
+	}
+
+	uint16_t extension = FAT_EOC, tail = FAT_EOC;
+	for (; count < needed; count++){
+		int alloc = allocate_block(fs);
+		if (alloc == -1){
+			chunk_free(fs, extension);
+			return -1;
+		}
+		if (extension == FAT_EOC)
+			extension = alloc;
+		else
+			fat_set(fs, tail, alloc);
+		tail = alloc;
+	}
+	if (extension != FAT_EOC){
+		if (last == FAT_EOC)
+			first = extension;
+		else
+			fat_set(fs, last, extension);
+	}
+
+	// Write the chunk, then free the blocks it no longer needs
+	uint16_t index = first;
+	for (size_t position = 0; position < size; position += BLOCK_SIZE){
+		const uint8_t *block = content + position;
+		if (size - position < BLOCK_SIZE){
+			memset(bounce, 0, BLOCK_SIZE);
+			memcpy(bounce, content + position, size - position);
+			block = bounce;
+		}
+		if (data_write(fs, index, block) == -1)
+			return -1;
+		last = index;
+		index = fat_get(fs, index);
+	}
+	chunk_free(fs, index);
+	fat_set(fs, last, FAT_EOC);
+
+	entry->index = first;
+	entry->size = size | raw;
+
+	return 0;
+}
+
+/* Frees the map blocks of compressed file 'file' and every chunk they
+   reference. */
+void compress_free(struct fs *fs, struct root_directory_entry *file)
+{
+	struct chunk_map map[CHUNK_MAP_COUNT];
+	uint16_t index = file->first_data_block_index, next;
+
+	while (index != FAT_EOC){
+		if (data_read(fs, index, map) == 0)
+			for (int entry = 0; entry < CHUNK_MAP_COUNT; entry++)
+				if (map[entry].index)
+					chunk_free(fs, map[entry].index);
+
+		next = fat_get(fs, index);
+		fat_set(fs, index, 0);
+		index = next;
+	}
+
+	fs->chunks.index = 0;
+	fs->chunks.first = 0;
+}
+
+/* Returns whether chunk 'number' of 'file', 'length' bytes long, is the
+   chunk held by the cache. */
+bool chunk_cached(struct fs *fs, struct root_directory_entry *file,
+size_t number, size_t length)
+{
+	return fs->chunks.first && fs->chunks.first == file->first_data_block_index &&
+	fs->chunks.number == number && fs->chunks.length == length;
+}
+
+/* Reads 'count' bytes at 'offset' of compressed file 'file' into 'data',
+   decompressing only the chunks they cover, and returns the number of bytes
+   actually read. */
+size_t compress_read(struct fs *fs, struct root_directory_entry *file,
+size_t offset, uint8_t *data, size_t count)
+{
+	size_t read = 0;
+
+	while (read < count){
+		size_t number = (offset + read) / CHUNK_SIZE;
+		size_t chunkOffset = (offset + read) % CHUNK_SIZE;
+		size_t length = file->file_size - number * CHUNK_SIZE;
+		if (length > CHUNK_SIZE)
+			length = CHUNK_SIZE;
+		size_t step = length - chunkOffset;
+		if (step > count - read)
+			step = count - read;
+
+		// Whole chunks are restored straight into @data, others through
+		// the cache so that following reads of the chunk are served by it
+		if (chunk_cached(fs, file, number, length))
+			fs->stats.chunk_hits++;
+		else {
+			fs->stats.chunk_misses++;
+			struct chunk_map *entry = map_load(fs, file, number,
+			false);
+			if (!entry)
+				break;
+
+			if (chunkOffset == 0 && step == length){
+				if (chunk_load(fs, *entry, data + read, length) == -1)
+					break;
+				read += step;
+				continue;
+			}
+
+			fs->chunks.first = 0;
+			if (chunk_load(fs, *entry, fs->chunks.data,
+			length) == -1)
+				break;
+			fs->chunks.first = file->first_data_block_index;
+			fs->chunks.number = number;
+			fs->chunks.length = length;
+		}
+		memcpy(data + read, fs->chunks.data + chunkOffset, step);
+
+		read += step;
+	}
+
+	return read;
+}
+
+/* Writes 'count' bytes of 'data' at 'offset' of compressed file 'file',
+   recompressing every chunk they cover, and returns the number of bytes
+   actually written. */
+size_t compress_write(struct fs *fs, struct root_directory_entry *file,
+size_t offset, const uint8_t *data, size_t count)
+{
+	size_t written = 0;
+
+	while (written < count){
+		size_t number = (offset + written) / CHUNK_SIZE;
+		size_t chunkStart = number * CHUNK_SIZE;
+		size_t chunkOffset = offset + written - chunkStart;
+		size_t step = CHUNK_SIZE - chunkOffset;
+		if (step > count - written)
+			step = count - written;
+
+		// Chunk length before and after the write
+		size_t previous = 0, length = chunkOffset + step;
+		if (file->file_size > chunkStart)
+			previous = file->file_size - chunkStart;
+		if (previous > CHUNK_SIZE)
+			previous = CHUNK_SIZE;
+		if (length < previous)
+			length = previous;
+
+		struct chunk_map *entry = map_load(fs, file, number, true);
+		if (!entry)
+			break;
+
+		// Chunks entirely overwritten or already cached need not be
+		// restored first
+		if ((chunkOffset != 0 || step < previous) &&
+		!chunk_cached(fs, file, number, previous)){
+			fs->chunks.first = 0;
+			if (chunk_load(fs, *entry, fs->chunks.data,
+			length) == -1)
+				break;
+		}
+		memcpy(fs->chunks.data + chunkOffset, data + written, step);
+
+		// The cache holds the new chunk once it is stored
+		fs->chunks.first = 0;
+		if (chunk_store(fs, entry, fs->chunks.data, length) == -1 ||
+		data_write(fs, fs->chunks.index, fs->chunks.map) == -1)
+			break;
+		fs->chunks.first = file->first_data_block_index;
+		fs->chunks.number = number;
+		fs->chunks.length = length;
+
+		written += step;
+		if (offset + written > file->file_size)
+			file->file_size = offset + written;
+	}
+
+	return written;
+}
+
+/* Opens the images the data blocks of the file system on 'diskname' are
+   striped across, creating them if 'create' is true. Their names are
+   relative to the directory of 'diskname' unless they are absolute. */
+int stripe_open(struct fs *fs, const char *diskname, bool create)
+{
+	char paths[FS_STRIPE_MAX_COUNT - 1][PATH_MAX];
+	const char *members[FS_STRIPE_MAX_COUNT - 1];
+	const char *slash = strrchr(diskname, '/');
+	int dirLength = slash ? slash - diskname + 1 : 0;
+	int count = fs->sb.stripe_count - 1;
+
+	if (count < 1 || count >= FS_STRIPE_MAX_COUNT || fs->sb.stripe_unit == 0)
+		return -1;
+
+	for (int member = 0; member < count; member++){
+		const char *name = fs->sb.stripe_names[member];
+		if (!memchr(name, '\0', STRIPE_NAME_LEN) || name[0] == '\0')
+			return -1;
+		if (snprintf(paths[member], PATH_MAX, "%.*s%s",
+		name[0] == '/' ? 0 : dirLength, diskname, name) >= PATH_MAX)
+			return -1;
+		members[member] = paths[member];
+	}
+
+	return disk_stripe(fs->disk, members, count, fs->sb.data_block_index,
+	fs->sb.stripe_unit, fs->sb.total_data_blocks, create);
+}
+
+/* Releases an instance whose mount failed after opening its disk, along with
+   whatever metadata was loaded before the failure. */
+struct fs *mount_fail(struct fs *fs)
+{
+	fs->rd.dirty = false;
+	dir_release(fs, &fs->rd);
+	pack_release(fs);
+	ref_release(fs);
+	dedup_release(fs);
+	if (!fs->readonly)
+		free(fs->meta);
+	// Closes the striped images as well
+	disk_close(fs->disk);
+	free(fs);
+	return NULL;
+}
+
+/* Loads the metadata of the file system whose superblock is in 'sb', 'meta'
+   holding it along with the first 'fatBlocks' FAT blocks. */
+int mount_load(struct fs *fs, int fatBlocks)
+{
+	// Check for Proper Format before loading anything else
+	if (fs_format_check(fs) == -1 ||
+	(!fs->readonly && fs->sb.fat_blocks != fatBlocks &&
+	meta_load(fs, fs->sb.fat_blocks) == -1))
+		return -1;
+	fs->fat = (struct fat_block *)((uint8_t *)fs->meta + BLOCK_SIZE);
+
+	// Read Metadata - Root Directory
+	if (rdir_load(fs) == -1)
+		return -1;
+
+	// Read Metadata - Shared Block References
+	if (ref_load(fs) == -1)
+		return -1;
+
+	// Read Metadata - Block Content Index
+	if (dedup_load(fs) == -1)
+		return -1;
+
+	// Free Space Summary - Recounted if missing or out of date
+	if (!free_valid(fs,
+	(uint8_t *)fs->meta + BLOCK_SIZE * fs->sb.root_dir_index))
+		free_rebuild(fs);
+
+	fdtable_init(fs);
+
+	return 0;
+}
+
+/* Writes back all metadata of a read-write file system, then releases it. */
+int mount_store(struct fs *fs)
+{
+	// Write Metadata to Disk - Directories, root last since its probe
+	// distance lives in the superblock
+	fs->rd.dirty = true;
+	uint8_t *root = (uint8_t *)fs->meta + BLOCK_SIZE * fs->sb.root_dir_index;
+	memcpy(root, fs->rd.entries, BLOCK_SIZE);
+	if (dir_release(fs, &fs->rd) == -1)
+		return -1;
+	fs->sb.rdir_max_probe = fs->rd.max_probe;
+
+	// Write Metadata to Disk - Block Content Index
+	if (dedup_store(fs) == -1)
+		return -1;
+
+	// Write Metadata to Disk - Shared Block References
+	if (ref_store(fs) == -1)
+		return -1;
+
+	// Write Metadata to Disk - Superblock and File Allocation Table, in
+	// one write from the mount-time buffer that holds the FAT, along with
+	// the checksum that validates the free space summary
+	discard_flush(fs);
+	fs->sb.free_check = free_checksum(fs, root);
+	memcpy(fs->meta, &fs->sb, BLOCK_SIZE);
+	if (disk_write_range(fs->disk, 0, 1 + fs->sb.fat_blocks, fs->meta) == -1)
+		return -1;
+
+	pack_release(fs);
+	ref_release(fs);
+	dedup_release(fs);
+	free(fs->meta);
+	fs->meta = NULL;
+	fs->fat = NULL;
+
+	return 0;
+}
+
+/* Mounts 'diskname', read-only if 'ro' is true, as a new instance. */
+struct fs *mount_disk(const char *diskname, bool ro)
+{
+	struct fs *fs = calloc(1, sizeof(struct fs));
+	if (!fs){
+		perror("calloc");
+		return NULL;
+	}
+
+	// Open Virtual Disk
+	fs->disk = ro ? disk_open_ro(diskname) : disk_open(diskname);
+	if (!fs->disk){
+		free(fs);
+		return NULL;
+	}
+	fs->readonly = ro;
+
+	// Read Metadata - Superblock, File Allocation Table and Root Directory
+	// in one read, sized after the disk for images with a minimal FAT. They
+	// are not read at all on read-only disks, which are mapped whole.
+	int fatBlocks = meta_fat_blocks(disk_count(fs->disk));
+	if (ro)
+		fs->meta = (void *)disk_map(fs->disk, 0);
+	else if (meta_load(fs, fatBlocks) == -1)
+		fs->meta = NULL;
+	if (!fs->meta)
+		return mount_fail(fs);
+	memcpy(&fs->sb, fs->meta, BLOCK_SIZE);
+
+	// Open Striped Images - Data blocks spread across several disks
+	if (fs->sb.stripe_count > 1 && stripe_open(fs, diskname, false) == -1)
+		return mount_fail(fs);
+
+	if (mount_load(fs, fatBlocks) == -1)
+		return mount_fail(fs);
+
+	return fs;
+}
+
+struct fs *fsh_mount(const char *diskname)
+{
+	TRACE_PATH(diskname);
+	return mount_disk(diskname, false);
+}
+
+struct fs *fsh_mount_ro(const char *diskname)
+{
+	TRACE_PATH(diskname);
+	return mount_disk(diskname, true);
+}
+
+int fsh_umount(struct fs *fs)
+{
+	TRACE_PATH(NULL);
+
+	// Check if FS not mounted
+	if (!fs)
+		return -1;
+
+	// Nothing is left to write back after a failed growth
+	if (fs->failed){
+		disk_close(fs->disk);
+		free(fs);
+		return 0;
+	}
+
+	// Check if FDs are still open
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++){
+		if (fs->fdTable[fd].file != NULL)
+			return -1;
+	}
+
+	// Nothing is written back to read-only disks
+	if (fs->readonly){
+		fs->rd.dirty = false;
+		dir_release(fs, &fs->rd);
+		disk_close(fs->disk);
+		pack_release(fs);
+		ref_release(fs);
+		dedup_release(fs);
+		free(fs);
+		return 0;
+	}
+
+	if (mount_store(fs) == -1)
+		return -1;
+
+	// Check if disk cannot be closed
+	if (disk_close(fs->disk) == -1)
+		return -1;
+
+	free(fs);
+
+	return 0;
+}
+
+int fsh_info(struct fs *fs)
+{
+	TRACE_PATH(NULL);
+
+	// No FS currently mounted
+	if (!fs || fs->failed)
+		return -1;
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%d\n", fs->sb.total_blocks);
+	printf("fat_blk_count=%d\n", fs->sb.fat_blocks);
+	printf("rdir_blk=%d\n", fs->sb.fat_blocks + 1);
+	printf("data_blk=%d\n", fs->sb.fat_blocks + 2);
+	printf("data_blk_count=%d\n", fs->sb.total_data_blocks);
+	printf("fat_free_ratio=%d/%d\n", fat_free(fs),
+	fs->sb.total_data_blocks);
+	printf("rdir_free_ratio=%d/%d\n", fs->sb.free_entries,
+	fs->rd.block_count * FS_FILE_MAX_COUNT);
+
+	// Images the data blocks are striped across
+	if (fs->sb.stripe_count > 1)
+		printf("stripe_count=%d\nstripe_unit=%d\n", fs->sb.stripe_count,
+		fs->sb.stripe_unit);
+
+	// Deduplication statistics of the current mount
+	if (fs->sb.features & FEATURE_DEDUP){
+		printf("dedup_blk_count=%d\n", fs->dedup.count);
+		printf("dedup_saved_bytes=%d\n", fs->dedup.saved * BLOCK_SIZE);
+		printf("dedup_overhead_us=%lld\n", fs->dedup.overhead / 1000);
+	}
+
+	// Compression statistics of the current mount
+	if (fs->chunks.logical)
+		printf("compress_ratio=%lld.%02lld\ncompress_mbps=%lld\n",
+		fs->chunks.logical / fs->chunks.stored, fs->chunks.logical * 100 / fs->chunks.stored % 100,
+		fs->chunks.logical * 1000 / (fs->chunks.compress_time + 1));
+	if (fs->chunks.restored)
+		printf("decompress_mbps=%lld\n",
+		fs->chunks.restored * 1000 / (fs->chunks.decompress_time + 1));
+
+	return 0;
+}
+
+/* Phase 2 */
+
+/* FNV-1a hash of 'filename', used to place entries in directory buckets. */
+uint32_t dir_hash(const char *filename)
+{
+	uint32_t hash = 2166136261u;
+
+	for (const char *c = filename; *c != '\0'; c++){
+		hash ^= (uint8_t)*c;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Searches for entry in directory 'dir' with specific 'filename'. Only the
+   home bucket and the buckets an insertion may have probed are scanned. */
+int dir_search(struct directory *dir, const char *filename)
+{
+	int home = dir_hash(filename) % dir->block_count;
+
+	for (int probe = 0; probe <= dir->max_probe && probe < dir->block_count;
+	probe++){
+		int bucket = (home + probe) % dir->block_count;
+		for (int slot = 0; slot < FS_FILE_MAX_COUNT; slot++){
+			int entry = bucket * FS_FILE_MAX_COUNT + slot;
+			if (strcmp((const char *)dir->entries[entry].filename, filename) == 0)
+				return entry;
+		}
+	}
+
+	return -1;
+}
+
+/* Returns first free entry reachable from the home bucket of 'filename'
+   within 'limit' probes, recording the probe distance used. */
+int dir_place(struct root_directory_entry *entries, int block_count,
+uint16_t *max_probe, const char *filename, int limit)
+{
+	int home = dir_hash(filename) % block_count;
+
+	for (int probe = 0; probe <= limit && probe < block_count; probe++){
+		int bucket = (home + probe) % block_count;
+		for (int slot = 0; slot < FS_FILE_MAX_COUNT; slot++){
+			int entry = bucket * FS_FILE_MAX_COUNT + slot;
+			if (entries[entry].filename[0] == '\0'){
+				if (probe > *max_probe)
+					*max_probe = probe;
+				return entry;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/* Returns the entry describing subdirectory 'dir' in its parent. */
+struct root_directory_entry *dir_entry(struct directory *dir)
+{
+	return &dir->parent->entries[dir_search(dir->parent, dir->name)];
+}
+
+/* Doubles the number of buckets of 'dir' with blocks taken from the data
+   region, then rehashes every entry into its new home bucket. */
+int dir_grow(struct fs *fs, struct directory *dir)
+{
+	int old_count = dir->block_count;
+	int new_count = old_count * 2;
+
+	// Extension blocks come out of the data region
+	if (new_count - 1 > UINT16_MAX || fat_free(fs) < new_count - old_count)
+		return -1;
+
+	uint16_t *blocks = realloc(dir->blocks, sizeof(uint16_t) * new_count);
+	if (!blocks)
+		return -1;
+	dir->blocks = blocks;
+
+	struct root_directory_entry *entries = calloc(new_count, BLOCK_SIZE);
+	if (!entries)
+		return -1;
+
+	// Append new blocks to the chain, the root block itself is not in the FAT
+	uint16_t tail = FAT_EOC;
+	if (dir != &fs->rd || fs->sb.rdir_ext_count)
+		tail = dir->blocks[old_count - 1] - fs->sb.data_block_index;
+	for (int block = old_count; block < new_count; block++){
+		uint16_t index = allocate_block(fs);
+		if (tail == FAT_EOC)
+			fs->sb.rdir_ext_index = index;
+		else
+			fat_set(fs, tail, index);
+		dir->blocks[block] = fs->sb.data_block_index + index;
+		tail = index;
+	}
+	dir->max_probe = 0;
+
+	// Rehash entries, following any open file descriptors along
+	for (int entry = 0; entry < old_count * FS_FILE_MAX_COUNT; entry++){
+		if (dir->entries[entry].filename[0] == '\0')
+			continue;
+
+		int moved = dir_place(entries, new_count, &dir->max_probe,
+		(const char *)dir->entries[entry].filename, new_count);
+		entries[moved] = dir->entries[entry];
+
+		for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+			if (fs->fdTable[fd].file == &dir->entries[entry])
+				fs->fdTable[fd].file = &entries[moved];
+	}
+
+	free(dir->entries);
+	dir->entries = entries;
+	dir->block_count = new_count;
+	dir->dirty = true;
+
+	// Record new geometry with the superblock or the parent directory
+	if (dir == &fs->rd){
+		fs->sb.rdir_ext_count = new_count - 1;
+		fs->sb.free_entries += (new_count - old_count) * FS_FILE_MAX_COUNT;
+	} else {
+		struct root_directory_entry *self = dir_entry(dir);
+		self->file_size = new_count * BLOCK_SIZE;
+		self->dir_max_probe = dir->max_probe;
+		dir->parent->dirty = true;
+	}
+
+	return 0;
+}
+
+/* Evicts the least recently used cached subdirectory that has no cached
+   children nor open files, other than 'keep'. */
+int dcache_evict(struct fs *fs, struct directory *dir, struct directory *keep,
+struct directory **victim)
+{
+	for (struct directory *child = dir->children; child; child = child->next){
+		if (child->children)
+			dcache_evict(fs, child, keep, victim);
+		else if (child != keep && child->open_count == 0 &&
+		(!*victim || child->last_use < (*victim)->last_use))
+			*victim = child;
+	}
+
+	if (dir != &fs->rd)
+		return 0;
+
+	if (!*victim)
+		return -1;
+
+	// Unlink victim from its parent
+	struct directory **link = &(*victim)->parent->children;
+	while (*link != *victim)
+		link = &(*link)->next;
+	*link = (*victim)->next;
+
+	return dir_release(fs, *victim);
+}
+
+/* Returns subdirectory 'name' of 'parent', from the directory cache when it
+   was already resolved or by reading its blocks otherwise. */
+struct directory *dir_child(struct fs *fs, struct directory *parent,
+const char *name)
+{
+	for (struct directory *child = parent->children; child; child = child->next)
+		if (strcmp(child->name, name) == 0){
+			child->last_use = ++fs->dcache_clock;
+			fs->stats.dcache_hits++;
+			return child;
+		}
+
+	int index = dir_search(parent, name);
+	if (index == -1 || !(parent->entries[index].flags & ENTRY_DIR))
+		return NULL;
+
+	// Make room in the cache, which grows past its limit if nothing can go
+	struct directory *victim = NULL;
+	if (fs->dcache_count >= DCACHE_MAX_COUNT)
+		dcache_evict(fs, &fs->rd, parent, &victim);
+
+	struct directory *dir = calloc(1, sizeof(struct directory));
+	if (!dir)
+		return NULL;
+
+	strcpy(dir->name, name);
+	dir->block_count = parent->entries[index].file_size / BLOCK_SIZE;
+	dir->max_probe = parent->entries[index].dir_max_probe;
+	dir->blocks = malloc(sizeof(uint16_t) * dir->block_count);
+	if (!dir->blocks ||
+	dir_load(fs, dir, 0,
+	parent->entries[index].first_data_block_index) == -1){
+		free(dir->blocks);
+		free(dir->entries);
+		free(dir);
+		return NULL;
+	}
+
+	dir->parent = parent;
+	dir->next = parent->children;
+	parent->children = dir;
+	dir->last_use = ++fs->dcache_clock;
+	fs->dcache_count++;
+	fs->stats.dcache_misses++;
+
+	return dir;
+}
+
+/* Resolves every component of 'path' but the last one, returning the
+   directory that holds it and copying the last component into 'name'. */
+struct directory *path_resolve(struct fs *fs, const char *path, char *name)
+{
+	struct directory *dir = &fs->rd;
+	const char *component = path;
+
+	if (*component == FS_PATH_SEPARATOR)
+		component++;
+
+	while (1){
+		const char *end = strchr(component, FS_PATH_SEPARATOR);
+		size_t len = end ? (size_t)(end - component) : strlen(component);
+
+		// Empty component or String @filename is too long
+		if (len == 0 || len >= FS_FILENAME_LEN)
+			return NULL;
+
+		memcpy(name, component, len);
+		name[len] = '\0';
+
+		if (!end)
+			return dir;
+
+		if ((dir = dir_child(fs, dir, name)) == NULL)
+			return NULL;
+
+		component = end + 1;
+	}
+}
+
+/* Adds a new empty entry named 'name' to 'dir', growing it if needed. */
+struct root_directory_entry *dir_add(struct fs *fs, struct directory *dir,
+const char *name)
+{
+	// Directory full, growing it while there is space, also setting
+	// index once an entry is available
+	int index;
+	while ((index = dir_place(dir->entries, dir->block_count, &dir->max_probe,
+	name, DIR_PROBE_LIMIT)) == -1)
+		if (dir_grow(fs, dir) == -1)
+			return NULL;
+
+	struct root_directory_entry *entry = &dir->entries[index];
+	memset(entry, 0, sizeof(struct root_directory_entry));
+	memcpy(entry->filename, name, strlen(name));
+
+	entry->file_size = 0;
+	entry->first_data_block_index = FAT_EOC;
+	dir->dirty = true;
+	if (dir == &fs->rd)
+		fs->sb.free_entries--;
+
+	// Probe distance of subdirectories lives in their parent entry, kept up
+	// to date for dir_search() once the directory is read back
+	if (dir != &fs->rd){
+		struct root_directory_entry *self = dir_entry(dir);
+		if (self->dir_max_probe < dir->max_probe){
+			self->dir_max_probe = dir->max_probe;
+			dir->parent->dirty = true;
+		}
+	}
+
+	return entry;
+}
+
+/* fsh_create() without its statistics. */
+int file_create(struct fs *fs, const char *filename)
+{
+	struct directory *dir;
+	char name[FS_FILENAME_LEN];
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+
+	// File name @filename is invalid
+	if (strlen(filename) == 0 || strcmp(filename,"\0") == 0)
+		return -1;
+
+	// Parent directory does not exist or @filename is too long
+	if ((dir = path_resolve(fs, filename, name)) == NULL)
+		return -1;
+	
+	// File named @filename already exists
+	if (dir_search(dir, name) != -1)
+		return -1;
+
+	// Directory full and no space left to grow it
+	if (dir_add(fs, dir, name) == NULL)
+		return -1;
+
+	return 0;	
+}
+
+int fsh_create(struct fs *fs, const char *filename)
+{
+	TRACE_PATH(filename);
+
+	uint64_t start = stats_now();
+	int ret = file_create(fs, filename);
+
+	stats_record(fs, FS_STATS_CREATE, start, ret, 0);
+	return ret;
+}
+
+int fsh_mkdir(struct fs *fs, const char *dirname)
+{
+	TRACE_PATH(dirname);
+
+	struct directory *dir;
+	struct root_directory_entry *entry;
+	char name[FS_FILENAME_LEN];
+	uint8_t empty[BLOCK_SIZE] = {0};
+	int index;
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+
+	// Directory name @dirname is invalid
+	if (strlen(dirname) == 0 || strcmp(dirname,"\0") == 0)
+		return -1;
+
+	// Parent directory does not exist or @dirname is too long
+	if ((dir = path_resolve(fs, dirname, name)) == NULL)
+		return -1;
+
+	// Entry named @dirname already exists
+	if (dir_search(dir, name) != -1)
+		return -1;
+
+	// A directory starts with a single empty bucket
+	if ((index = allocate_block(fs)) == -1)
+		return -1;
+	if (data_write(fs, index, empty) == -1 ||
+	(entry = dir_add(fs, dir, name)) == NULL){
+		fat_set(fs, index, 0);
+		return -1;
+	}
+
+	entry->flags = ENTRY_DIR;
+	entry->file_size = BLOCK_SIZE;
+	entry->first_data_block_index = index;
+
+	return 0;
+}
+
+/* Frees the chain of data blocks starting at 'content', stopping at the
+   first block still shared with a clone. */
+void chain_free(struct fs *fs, uint16_t content)
+{
+	uint16_t index;
+
+	while (content != FAT_EOC && ref_put(fs, content)){
+		index = content;
+		dedup_forget(fs, index);
+
+		content = fat_get(fs, index);
+		fat_set(fs, index, 0);
+	}
+}
+
+/* Frees the blocks of 'file' past the end of its content, returning whether
+   any was. */
+bool chain_trim(struct fs *fs, struct root_directory_entry *file)
+{
+	size_t blocks = (file->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint16_t last, tail;
+
+	if (file->flags & (ENTRY_PACKED | ENTRY_COMPRESSED))
+		return false;
+
+	if (blocks == 0){
+		if (file->first_data_block_index == FAT_EOC)
+			return false;
+		chain_free(fs, file->first_data_block_index);
+		file->first_data_block_index = FAT_EOC;
+		return true;
+	}
+
+	last = file->first_data_block_index;
+	for (size_t hop = 1; hop < blocks && last != FAT_EOC; hop++)
+		last = fat_get(fs, last);
+	if (last == FAT_EOC || (tail = fat_get(fs, last)) == FAT_EOC)
+		return false;
+	fat_set(fs, last, FAT_EOC);
+	chain_free(fs, tail);
+
+	return true;
+}
+
+/* Clears entry 'entry' of 'dir' once its data blocks are freed. */
+void dir_remove(struct fs *fs, struct directory *dir,
+struct root_directory_entry *entry)
+{
+	if (entry->flags & ENTRY_PACKED)
+		pack_free(fs, entry, NULL);
+	else if (entry->flags & ENTRY_COMPRESSED)
+		compress_free(fs, entry);
+	else
+		chain_free(fs, entry->first_data_block_index);
+
+	entry->filename[0] = '\0';
+	entry->file_size = 0;
+	entry->first_data_block_index = FAT_EOC;
+	entry->flags = 0;
+	entry->dir_max_probe = 0;
+	entry->pack_offset = 0;
+	dir->dirty = true;
+	if (dir == &fs->rd)
+		fs->sb.free_entries++;
+}
+
+int fsh_rmdir(struct fs *fs, const char *dirname)
+{
+	TRACE_PATH(dirname);
+
+	struct directory *dir, *child;
+	char name[FS_FILENAME_LEN];
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+
+	// Directory name @dirname is invalid
+	if (strlen(dirname) == 0 || strcmp(dirname,"\0") == 0)
+		return -1;
+
+	// Directory does not exist
+	if ((dir = path_resolve(fs, dirname, name)) == NULL ||
+	(child = dir_child(fs, dir, name)) == NULL)
+		return -1;
+
+	// Directory not empty
+	if (dir_free(child) != child->block_count * FS_FILE_MAX_COUNT)
+		return -1;
+
+	// Drop it from the directory cache without writing it back
+	struct directory **link = &dir->children;
+	while (*link != child)
+		link = &(*link)->next;
+	*link = child->next;
+	child->dirty = false;
+	dir_release(fs, child);
+
+	dir_remove(fs, dir, &dir->entries[dir_search(dir, name)]);
+	discard_flush(fs);
+
+	return 0;
+}
+
+int fdtable_search(struct fs *fs, struct root_directory_entry *file){
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		if(fs->fdTable[fd].file == file)
+			return fd;
+
+	return -1;
+}
+
+/* fsh_delete() without its statistics. */
+int file_delete(struct fs *fs, const char *filename)
+{
+	struct directory *dir;
+	char name[FS_FILENAME_LEN];
+	int rdirIndex;
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+	
+	// File name @filename is invalid
+	if (strlen(filename) == 0 || strcmp(filename,"\0") == 0)
+		return -1;
+
+	// Filename is not NULL-terminated
+	if (filename[strlen(filename)] != '\0')
+		return -1;
+
+	// File does not exist, also setting rdirIndex if not
+	if ((dir = path_resolve(fs, filename, name)) == NULL ||
+	(rdirIndex = dir_search(dir, name)) == -1)
+		return -1;
+
+	// Directories are removed with fs_rmdir()
+	if (dir->entries[rdirIndex].flags & ENTRY_DIR)
+		return -1;
+
+	// File currently open
+	if (fdtable_search(fs, &dir->entries[rdirIndex]) != -1)
+		return -1;
+
+	// Delete entries in FAT blocks, releasing the data blocks to the host
+	dir_remove(fs, dir, &dir->entries[rdirIndex]);
+	discard_flush(fs);
+
+	return 0;
+}
+
+int fsh_delete(struct fs *fs, const char *filename)
+{
+	TRACE_PATH(filename);
+
+	uint64_t start = stats_now();
+	int ret = file_delete(fs, filename);
+
+	stats_record(fs, FS_STATS_DELETE, start, ret, 0);
+	return ret;
+}
+
+int fsh_clone(struct fs *fs, const char *src, const char *dst)
+{
+	TRACE_PATH(src);
+
+	struct directory *dir;
+	struct root_directory_entry source, *clone;
+	char name[FS_FILENAME_LEN];
+	uint8_t block[BLOCK_SIZE];
+	int rdirIndex;
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+
+	// File name @src or @dst is invalid
+	if (strlen(src) == 0 || strlen(dst) == 0)
+		return -1;
+
+	// Source file does not exist, also setting rdirIndex if not
+	if ((dir = path_resolve(fs, src, name)) == NULL ||
+	(rdirIndex = dir_search(dir, name)) == -1)
+		return -1;
+
+	// Directories and compressed files cannot be cloned
+	if (dir->entries[rdirIndex].flags & (ENTRY_DIR | ENTRY_COMPRESSED))
+		return -1;
+
+	// Keep a copy, adding the clone may move entries around
+	source = dir->entries[rdirIndex];
+
+	// Parent directory of @dst does not exist or @dst already exists
+	if ((dir = path_resolve(fs, dst, name)) == NULL || dir_search(dir, name) != -1)
+		return -1;
+
+	// Sharing the chain adds a reference to its first block
+	if (!(source.flags & ENTRY_PACKED) &&
+	source.first_data_block_index != FAT_EOC && ref_reserve(fs, 1) == -1)
+		return -1;
+
+	if ((clone = dir_add(fs, dir, name)) == NULL)
+		return -1;
+
+	// Packed files are small enough to simply be copied
+	if (source.flags & ENTRY_PACKED){
+		if (data_read(fs, source.first_data_block_index, block) == -1 ||
+		pack_write(fs, clone, 0, block + source.pack_offset,
+		source.file_size) != source.file_size){
+			dir_remove(fs, dir, clone);
+			return -1;
+		}
+		return 0;
+	}
+
+	clone->file_size = source.file_size;
+	clone->first_data_block_index = source.first_data_block_index;
+	if (clone->first_data_block_index != FAT_EOC)
+		ref_get(fs, clone->first_data_block_index);
+
+	return 0;
+}
+
+int fsh_lsdir(struct fs *fs, const char *dirname)
+{
+	TRACE_PATH(dirname);
+
+	struct directory *dir;
+	char name[FS_FILENAME_LEN];
+
+	// No FS currently mounted
+	if (!fs || fs->failed)
+		return -1;
+
+	// Root directory or subdirectory @dirname
+	dir = &fs->rd;
+	if (strcmp(dirname, "") != 0 && strcmp(dirname, "/") != 0)
+		if ((dir = path_resolve(fs, dirname, name)) == NULL ||
+		(dir = dir_child(fs, dir, name)) == NULL)
+			return -1;
+		
+	printf("FS Ls:\n");
+
+	for (int entry = 0; entry < dir->block_count * FS_FILE_MAX_COUNT; entry++)
+		if(dir->entries[entry].filename[0] != '\0')
+			printf("%s: %s, size: %d, data_blk: %d\n",
+			dir->entries[entry].flags & ENTRY_DIR ? "dir" : "file",
+			dir->entries[entry].filename,
+			dir->entries[entry].file_size, 
+			dir->entries[entry].first_data_block_index);
+
+	return 0;
+}
+
+int fsh_ls(struct fs *fs)
+{
+	TRACE_PATH(NULL);
+	return fsh_lsdir(fs, "/");
+}
+
+/* Phase 3 */
+
+/* Searches for free entry in fd table. */
+int fdtable_free(struct fs *fs)
+{
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		if(fs->fdTable[fd].file == NULL)
+			return fd;
+
+	return -1;
+}
+
+/* fsh_open() without its statistics. */
+int file_open(struct fs *fs, const char *filename)
+{
+	// No FS currently mounted
+	if (!fs || fs->failed)
+		return -1;
+
+	struct directory *dir;
+	char name[FS_FILENAME_LEN];
+	int fdNum, rdirIndex;
+
+	// No more than 32 open file descriptors
+	if ((fdNum = fdtable_free(fs)) == -1)
+		return -1;
+
+	// File name @filename is invalid
+	if (strlen(filename) == 0 || strcmp(filename,"\0") == 0)
+		return -1;
+
+	// Check File Exists
+	if ((dir = path_resolve(fs, filename, name)) == NULL ||
+	(rdirIndex = dir_search(dir, name)) == -1)
+		return -1;
+
+	// Directories cannot be opened
+	if (dir->entries[rdirIndex].flags & ENTRY_DIR)
+		return -1;
+
+	fs->fdTable[fdNum].offset = 0;
+	fs->fdTable[fdNum].written = false;
+	fs->fdTable[fdNum].reserved = false;
+	fs->fdTable[fdNum].file = &dir->entries[rdirIndex];
+	fs->fdTable[fdNum].dir = dir;
+	dir->open_count++;
+
+	return fdNum;
+}
+
+int fsh_open(struct fs *fs, const char *filename)
+{
+	TRACE_PATH(filename);
+
+	uint64_t start = stats_now();
+	int ret = file_open(fs, filename);
+
+	stats_record(fs, FS_STATS_OPEN, start, ret, 0);
+	return ret;
+}
+
+int fd_is_valid(struct fs *fs, int fd)
+{
+	if (fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fdTable[fd].file == NULL)
+		return 0;
+	return 1;
+	
+}
+
+size_t fd_offset(struct fs *fs, int fd)
+{
+	if (!fs || fs->failed || !fd_is_valid(fs, fd))
+		return 0;
+	return fs->fdTable[fd].offset;
+}
+
+int fsh_close(struct fs *fs, int fd)
+{
+	TRACE_FD(fs, fd, 0);
+
+	// No FS currently mounted OR fd invalid
+	if (!fs || fs->failed || !fd_is_valid(fs, fd))
+		return -1;
+
+	// Reserved blocks left unwritten are given back
+	if (fs->fdTable[fd].reserved && chain_trim(fs, fs->fdTable[fd].file))
+		fs->fdTable[fd].dir->dirty = true;
+
+	// Share identical blocks once the file is written in deduplication mode
+	if (fs->fdTable[fd].written && fs->sb.features & FEATURE_DEDUP){
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (dedup_chain(fs, fs->fdTable[fd].file))
+			fs->fdTable[fd].dir->dirty = true;
+		fs->dedup.overhead += dedup_elapsed(&start);
+	}
+
+	fs->fdTable[fd].dir->open_count--;
+	fs->fdTable[fd].file = NULL;
+	fs->fdTable[fd].dir = NULL;
+
+	return 0;
+}
+
+int fsh_stat(struct fs *fs, int fd)
+{
+	TRACE_FD(fs, fd, 0);
+
+	// No FS currently mounted OR fd invalid
+	if (!fs || fs->failed || !fd_is_valid(fs, fd))
+		return -1;
+
+	return fs->fdTable[fd].file->file_size;
+}
+
+int fsh_lseek(struct fs *fs, int fd, size_t offset)
+{
+	TRACE_FD(fs, fd, 0);
+
+	// No FS currently mounted OR fd invalid
+	if (!fs || fs->failed || !fd_is_valid(fs, fd))
+		return -1;
+
+	// Check if @offset is larger than the current file size
+	if (offset > fs->fdTable[fd].file->file_size)
+		return -1; 
+
+	fs->fdTable[fd].offset = offset;
+
+	return 0;
+}
+
+
+/* Phase 4 */
+
+/* Returns data block index holding byte 'offset' of 'file', or FAT_EOC if
+   the file's chain is not that long. */
+uint16_t index_with_offset(struct fs *fs, struct root_directory_entry *file,
+size_t offset)
+{
+	uint16_t index = file->first_data_block_index;
+
+	for (size_t hop = offset / BLOCK_SIZE; hop > 0 && index != FAT_EOC; hop--){
+		index = fat_get(fs, index);
+		fs->stats.fat_hops++;
+	}
+
+	return index;
+}
+
+/* Returns data block following 'index' in the chain of 'file' (its first
+   block if 'index' is FAT_EOC), extending the chain with a newly allocated
+   block when it ends. Returns FAT_EOC if the disk is full. */
+uint16_t chain_next(struct fs *fs, struct root_directory_entry *file,
+uint16_t index)
+{
+	uint16_t next;
+	int alloc;
+
+	if (index == FAT_EOC)
+		next = file->first_data_block_index;
+	else {
+		next = fat_get(fs, index);
+		fs->stats.fat_hops++;
+	}
+
+	if (next != FAT_EOC)
+		return next;
+
+	if ((alloc = allocate_block(fs)) == -1)
+		return FAT_EOC;
+
+	if (index == FAT_EOC)
+		file->first_data_block_index = alloc;
+	else
+		fat_set(fs, index, alloc);
+
+	return alloc;
+}
+
+/* Writes 'count' bytes of 'data' at 'offset' of 'file' through its chain of
+   data blocks, returning the number of bytes actually written. */
+size_t chain_write(struct fs *fs, struct root_directory_entry *file,
+size_t offset, const uint8_t *data, size_t count)
+{
+	size_t written = 0;
+	uint8_t bounce[BLOCK_SIZE];
+	struct timespec start;
+
+	// Blocks shared with a clone are copied before being modified
+	if (ref_unshare(fs, file, (offset + count - 1) / BLOCK_SIZE) == -1)
+		return 0;
+
+	// Walk to the block holding @offset, extending the chain if needed
+	uint16_t index = FAT_EOC;
+	for (size_t hop = 0; hop <= offset / BLOCK_SIZE; hop++)
+		if ((index = chain_next(fs, file, index)) == FAT_EOC)
+			break;
+
+	while (index != FAT_EOC){
+		size_t blockOffset = (offset + written) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - blockOffset;
+		if (chunk > count - written)
+			chunk = count - written;
+
+		// Whole blocks go straight to disk, partial ones are merged first
+		// with the current content or zeroes past the end of the file
+		const uint8_t *content = data + written;
+		if (chunk != BLOCK_SIZE){
+			if (offset + written - blockOffset >= file->file_size)
+				memset(bounce, 0, BLOCK_SIZE);
+			else if (data_read(fs, index, bounce) == -1)
+				break;
+			memcpy(bounce + blockOffset, data + written, chunk);
+			content = bounce;
+		}
+
+		// Whole blocks following each other on disk go in a single write,
+		// 'next' being the block that broke the run if any
+		size_t run = 1;
+		uint16_t next = FAT_EOC;
+		if (chunk == BLOCK_SIZE)
+			while (written + (run + 1) * BLOCK_SIZE <= count &&
+			(next = chain_next(fs, file, index + run - 1)) == index + run){
+				run++;
+				next = FAT_EOC;
+			}
+		if (data_write_range(fs, index, run, content) == -1)
+			break;
+
+		// Keep the content index up to date in deduplication mode
+		if (fs->dedup.hashes && fs->sb.features & FEATURE_DEDUP){
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (size_t block = 0; block < run; block++)
+				dedup_insert(fs, index + block,
+				dedup_hash(content + block * BLOCK_SIZE));
+			fs->dedup.overhead += dedup_elapsed(&start);
+		}
+
+		written += chunk + (run - 1) * BLOCK_SIZE;
+		if (written == count)
+			break;
+
+		index = next != FAT_EOC ? next : chain_next(fs, file, index + run - 1);
+	}
+
+	if (offset + written > file->file_size)
+		file->file_size = offset + written;
+
+	return written;
+}
+
+/* fsh_write() without its statistics. */
+int file_write(struct fs *fs, int fd, void *buf, size_t count)
+{
+	// No FS currently mounted || mounted read-only || fd invalid || buf is
+	// NULL
+	if (!fs || fs->failed || fs->readonly || !fd_is_valid(fs, fd) ||
+	buf == NULL)
+		return -1;
+
+	if (count == 0)
+		return 0;
+
+	struct root_directory_entry *file = fs->fdTable[fd].file;
+	size_t offset = fs->fdTable[fd].offset;
+	size_t written;
+
+	// Compressed files go through their chunks, small files share pack
+	// blocks until they outgrow PACK_MAX_SIZE if the file system packs them
+	if (file->flags & ENTRY_COMPRESSED)
+		written = compress_write(fs, file, offset, buf, count);
+	else if (offset + count <= PACK_MAX_SIZE &&
+	(file->flags & ENTRY_PACKED || (fs->sb.features & FEATURE_PACK &&
+	file->first_data_block_index == FAT_EOC)))
+		written = pack_write(fs, file, offset, buf, count);
+	else if (file->flags & ENTRY_PACKED && pack_unpack(fs, file) == -1)
+		written = 0;
+	else
+		written = chain_write(fs, file, offset, buf, count);
+
+	fs->fdTable[fd].offset += written;
+	fs->fdTable[fd].dir->dirty = true;
+	fs->fdTable[fd].written = true;
+
+	return written;
+}
+
+int fsh_write(struct fs *fs, int fd, void *buf, size_t count)
+{
+	TRACE_FD(fs, fd, count);
+
+	uint64_t start = stats_now();
+	int ret = file_write(fs, fd, buf, count);
+
+	stats_record(fs, FS_STATS_WRITE, start, ret, ret > 0 ? ret : 0);
+	return ret;
+}
+
+/* fsh_read() without its statistics. */
+int file_read(struct fs *fs, int fd, void *buf, size_t count)
+{
+	// No FS currently mounted || fd invalid || buf is NULL
+	if (!fs || fs->failed || !fd_is_valid(fs, fd) || buf == NULL)
+		return -1;
+
+	struct root_directory_entry *file = fs->fdTable[fd].file;
+	size_t offset = fs->fdTable[fd].offset;
+	size_t read = 0;
+	uint8_t *data = buf;
+	uint8_t bounce[BLOCK_SIZE];
+
+	// Never read past the end of the file
+	if (count > file->file_size - offset)
+		count = file->file_size - offset;
+
+	if (file->flags & ENTRY_COMPRESSED){
+		read = compress_read(fs, file, offset, data, count);
+		fs->fdTable[fd].offset += read;
+		return read;
+	}
+
+	// Packed files are read with a single block
+	if (file->flags & ENTRY_PACKED){
+		if (count == 0 || data_read(fs, file->first_data_block_index, bounce) == -1)
+			return 0;
+		memcpy(data, bounce + file->pack_offset + offset, count);
+		fs->fdTable[fd].offset += count;
+		return count;
+	}
+
+	uint16_t index = index_with_offset(fs, file, offset);
+	while (read < count && index != FAT_EOC){
+		size_t blockOffset = (offset + read) % BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - blockOffset;
+		if (chunk > count - read)
+			chunk = count - read;
+
+		// Whole blocks land straight in @buf, those that follow each other
+		// on disk with a single request, partial ones go through bounce
+		if (chunk == BLOCK_SIZE){
+			uint16_t last = index;
+			size_t run = 1;
+			while ((run + 1) * BLOCK_SIZE <= count - read &&
+			last + 1 < fs->sb.total_data_blocks &&
+			fat_get(fs, last) == last + 1){
+				last++;
+				run++;
+			}
+			if (data_read_range(fs, index, run, data + read) == -1)
+				break;
+			read += run * BLOCK_SIZE;
+			index = fat_get(fs, last);
+			continue;
+		} else {
+			if (data_read(fs, index, bounce) == -1)
+				break;
+			memcpy(data + read, bounce + blockOffset, chunk);
+		}
+
+		read += chunk;
+		index = fat_get(fs, index);
+	}
+
+	fs->fdTable[fd].offset += read;
+
+	return read;
+}
+
+int fsh_read(struct fs *fs, int fd, void *buf, size_t count)
+{
+	TRACE_FD(fs, fd, count);
+
+	uint64_t start = stats_now();
+	int ret = file_read(fs, fd, buf, count);
+
+	stats_record(fs, FS_STATS_READ, start, ret, ret > 0 ? ret : 0);
+	return ret;
+}
+
+int fsh_reserve(struct fs *fs, int fd, size_t size)
+{
+	TRACE_FD(fs, fd, size);
+
+	// No FS currently mounted, or mounted read-only || fd invalid
+	if (!fs || fs->failed || fs->readonly || !fd_is_valid(fs, fd))
+		return -1;
+
+	struct root_directory_entry *file = fs->fdTable[fd].file;
+	int blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// Only empty files without blocks are given some
+	if (file->flags & (ENTRY_PACKED | ENTRY_COMPRESSED) ||
+	file->first_data_block_index != FAT_EOC || file->file_size != 0)
+		return -1;
+
+	// Files small enough to be packed get no block of their own
+	if (size <= PACK_MAX_SIZE && fs->sb.features & FEATURE_PACK)
+		return 0;
+
+	if (size > (size_t)fat_free(fs) * BLOCK_SIZE)
+		return -1;
+
+	// The whole file in a single run of blocks if there is one, first fit
+	// otherwise
+	int start = free_run(fs, blocks);
+	uint16_t prev = FAT_EOC;
+	for (int block = 0; block < blocks; block++){
+		uint16_t index = start == -1 ? allocate_block(fs) : start + block;
+		fat_set(fs, index, FAT_EOC);
+
+		if (prev == FAT_EOC)
+			file->first_data_block_index = index;
+		else
+			fat_set(fs, prev, index);
+		prev = index;
+	}
+
+	fs->fdTable[fd].reserved = true;
+	fs->fdTable[fd].dir->dirty = true;
+
+	return 0;
+}
+
+int fsh_readdir(struct fs *fs, const char *dirname, int index,
+struct fs_dirent *dirent)
+{
+	TRACE_PATH(dirname);
+
+	struct directory *dir;
+	char name[FS_FILENAME_LEN];
+
+	// No FS currently mounted || dirname or dirent is NULL || index invalid
+	if (!fs || fs->failed || !dirname || !dirent || index < 0)
+		return -1;
+
+	// Root directory or subdirectory @dirname
+	dir = &fs->rd;
+	if (strcmp(dirname, "") != 0 && strcmp(dirname, "/") != 0)
+		if ((dir = path_resolve(fs, dirname, name)) == NULL ||
+		(dir = dir_child(fs, dir, name)) == NULL)
+			return -1;
+
+	for (; index < dir->block_count * FS_FILE_MAX_COUNT; index++){
+		struct root_directory_entry *entry = &dir->entries[index];
+		if (entry->filename[0] == '\0')
+			continue;
+
+		memcpy(dirent->name, entry->filename, FS_FILENAME_LEN);
+		dirent->size = entry->file_size;
+		dirent->dir = entry->flags & ENTRY_DIR ? 1 : 0;
+		return index + 1;
+	}
+
+	return 0;
+}
+
+/* Host transfers */
+
+/* Size of the buffer of the parts of host transfers that are copied */
+#define TRANSFER_BUFFER_SIZE (16 * BLOCK_SIZE)
+
+/* fsh_export_fd() without its statistics. */
+int file_export_fd(struct fs *fs, int fd, int host_fd)
+{
+	uint8_t buf[TRANSFER_BUFFER_SIZE];
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	// No FS currently mounted || fd invalid
+	if (!fs || fs->failed || !fd_is_valid(fs, fd) || host_fd < 0)
+		return -1;
+
+	struct root_directory_entry *file = fs->fdTable[fd].file;
+	size_t offset = fs->fdTable[fd].offset;
+
+	// Packed and compressed files have no extents, and are copied
+	if (file->flags & (ENTRY_PACKED | ENTRY_COMPRESSED)){
+		int count;
+		while ((count = file_read(fs, fd, buf, sizeof(buf))) > 0){
+			for (int out = 0; out < count; out += ret)
+				if ((ret = write(host_fd, buf + out, count - out)) <= 0)
+					return done ? (int)done : -1;
+			done += count;
+		}
+		return done;
+	}
+
+	// Each extent of the file, up to its end, in a single host request
+	uint16_t index = index_with_offset(fs, file, offset);
+	while (offset + done < file->file_size && index != FAT_EOC){
+		size_t at = offset + done;
+		size_t run = 1;
+		while (run * BLOCK_SIZE - at % BLOCK_SIZE < file->file_size - at &&
+		fat_get(fs, index + run - 1) == index + run)
+			run++;
+
+		size_t len = run * BLOCK_SIZE - at % BLOCK_SIZE;
+		if (len > file->file_size - at)
+			len = file->file_size - at;
+		ret = disk_send(fs->disk, fs->sb.data_block_index + index,
+		at % BLOCK_SIZE, len, host_fd);
+		if (ret > 0)
+			done += ret;
+		if (ret < (ssize_t)len)
+			break;
+
+		index = fat_get(fs, index + run - 1);
+	}
+
+	fs->fdTable[fd].offset += done;
+
+	return done || ret >= 0 ? (int)done : -1;
+}
+
+int fsh_export_fd(struct fs *fs, int fd, int host_fd)
+{
+	TRACE_FD(fs, fd, 0);
+
+	uint64_t start = stats_now();
+	int ret = file_export_fd(fs, fd, host_fd);
+
+	stats_record(fs, FS_STATS_READ, start, ret, ret > 0 ? ret : 0);
+	return ret;
+}
+
+/* fsh_import_fd() without its statistics. */
+int file_import_fd(struct fs *fs, int fd, int host_fd, size_t len)
+{
+	uint8_t buf[TRANSFER_BUFFER_SIZE];
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	// No FS currently mounted, or mounted read-only || fd invalid
+	if (!fs || fs->failed || fs->readonly || !fd_is_valid(fs, fd) ||
+	host_fd < 0)
+		return -1;
+
+	struct root_directory_entry *file = fs->fdTable[fd].file;
+
+	// Compressed files and indexed blocks need the content in memory
+	bool direct = !(file->flags & ENTRY_COMPRESSED) &&
+	!(fs->dedup.hashes && fs->sb.features & FEATURE_DEDUP);
+
+	while (done < len){
+		size_t at = fs->fdTable[fd].offset;
+		size_t blocks = (len - done) / BLOCK_SIZE;
+
+		// Partial blocks are merged through a buffer
+		if (!direct || at % BLOCK_SIZE || blocks == 0 ||
+		file->flags & ENTRY_PACKED){
+			size_t count = len - done;
+			if (count > sizeof(buf))
+				count = sizeof(buf);
+			if (direct && at % BLOCK_SIZE &&
+			count > BLOCK_SIZE - at % BLOCK_SIZE)
+				count = BLOCK_SIZE - at % BLOCK_SIZE;
+			if ((ret = read(host_fd, buf, count)) < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0 || (ret = file_write(fs, fd, buf, ret)) <= 0)
+				break;
+			done += ret;
+			continue;
+		}
+
+		// Whole blocks of plain files go from the host file to the disk
+		// without being copied, extent by extent
+		if (ref_unshare(fs, file, at / BLOCK_SIZE + blocks - 1) == -1)
+			break;
+
+		uint16_t index = FAT_EOC;
+		for (size_t hop = 0; hop <= at / BLOCK_SIZE; hop++)
+			if ((index = chain_next(fs, file, index)) == FAT_EOC)
+				break;
+		if (index == FAT_EOC)
+			break;
+
+		size_t run = 1;
+		while (run < blocks &&
+		chain_next(fs, file, index + run - 1) == index + run)
+			run++;
+
+		// Blocks allocated past the end of the host file are freed on close
+		fs->fdTable[fd].reserved = true;
+		if ((ret = data_receive(fs, index, run, host_fd)) <= 0)
+			break;
+
+		done += ret;
+		fs->fdTable[fd].offset += ret;
+		if (at + ret > file->file_size)
+			file->file_size = at + ret;
+		fs->fdTable[fd].dir->dirty = true;
+		fs->fdTable[fd].written = true;
+		if ((size_t)ret < run * BLOCK_SIZE)
+			break;
+	}
+
+	return done || ret >= 0 ? (int)done : -1;
+}
+
+int fsh_import_fd(struct fs *fs, int fd, int host_fd, size_t len)
+{
+	TRACE_FD(fs, fd, len);
+
+	uint64_t start = stats_now();
+	int ret = file_import_fd(fs, fd, host_fd, len);
+
+	stats_record(fs, FS_STATS_WRITE, start, ret, ret > 0 ? ret : 0);
+	return ret;
+}
+
+/* Deduplication */
+
+int fsh_dedup_mode(struct fs *fs, int enable)
+{
+	TRACE_PATH(NULL);
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+
+	if (!enable){
+		fs->sb.features &= ~FEATURE_DEDUP;
+		return 0;
+	}
+
+	if (!fs->dedup.hashes && dedup_alloc(fs) == -1){
+		dedup_release(fs);
+		return -1;
+	}
+	fs->sb.features |= FEATURE_DEDUP;
+
+	return 0;
+}
+
+/* Indexes the data blocks of every file below 'dir' when 'index' is true,
+   deduplicates their chains otherwise. */
+void dedup_dir(struct fs *fs, struct directory *dir, bool index)
+{
+	uint8_t block[BLOCK_SIZE];
+
+	for (int entry = 0; entry < dir->block_count * FS_FILE_MAX_COUNT; entry++){
+		struct root_directory_entry *file = &dir->entries[entry];
+		struct directory *child;
+
+		if (file->filename[0] == '\0' ||
+		file->flags & (ENTRY_PACKED | ENTRY_COMPRESSED))
+			continue;
+
+		if (file->flags & ENTRY_DIR){
+			if ((child = dir_child(fs, dir, (const char *)file->filename)))
+				dedup_dir(fs, child, index);
+			continue;
+		}
+
+		if (!index){
+			if (dedup_chain(fs, file))
+				dir->dirty = true;
+			continue;
+		}
+
+		for (uint16_t content = file->first_data_block_index;
+		content != FAT_EOC; content = fat_get(fs, content))
+			if (!fs->dedup.hashes[content] &&
+			data_read(fs, content, block) == 0)
+				dedup_insert(fs, content, dedup_hash(block));
+	}
+}
+
+int fsh_dedup(struct fs *fs)
+{
+	TRACE_PATH(NULL);
+
+	// No FS currently mounted, mounted read-only or not in deduplication
+	// mode
+	if (!fs || fs->failed || fs->readonly ||
+	!(fs->sb.features & FEATURE_DEDUP))
+		return -1;
+
+	int saved = fs->dedup.saved;
+
+	// Every block must be indexed before any chain can be matched
+	dedup_dir(fs, &fs->rd, true);
+	dedup_dir(fs, &fs->rd, false);
+
+	return (fs->dedup.saved - saved) * BLOCK_SIZE;
+}
+
+/* Compression */
+
+int fsh_compress(struct fs *fs, const char *filename, int enable)
+{
+	TRACE_PATH(filename);
+
+	struct directory *dir;
+	char name[FS_FILENAME_LEN];
+	int rdirIndex;
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+
+	// File does not exist, also setting rdirIndex if not
+	if ((dir = path_resolve(fs, filename, name)) == NULL ||
+	(rdirIndex = dir_search(dir, name)) == -1)
+		return -1;
+
+	// Only empty files can change layout
+	struct root_directory_entry *file = &dir->entries[rdirIndex];
+	if (file->flags & ENTRY_DIR || file->file_size != 0 ||
+	file->first_data_block_index != FAT_EOC)
+		return -1;
+
+	if (enable)
+		file->flags |= ENTRY_COMPRESSED;
+	else
+		file->flags &= ~ENTRY_COMPRESSED;
+	dir->dirty = true;
+
+	return 0;
+}
+
+/* Defragmentation */
+
+/* Files whose chains may be moved, and for each data block of those files
+   its predecessor in the chain (FAT_EOC for the first block) and owner */
+struct defrag{
+	struct root_directory_entry **files;
+	int file_count;
+	struct directory **dirs;
+	int dir_count;
+	uint16_t *pred;
+	struct root_directory_entry **owner;
+};
+
+/* Returns whether 'file' has a chain of data blocks that can be moved: its
+   blocks must not be shared, so that each one has a single predecessor. */
+bool defrag_movable(struct fs *fs, struct root_directory_entry *file)
+{
+	if (file->filename[0] == '\0' ||
+	file->flags & (ENTRY_DIR | ENTRY_PACKED | ENTRY_COMPRESSED))
+		return false;
+
+	for (uint16_t index = file->first_data_block_index; index != FAT_EOC;
+	index = fat_get(fs, index))
+		if (fs->refs.counts && fs->refs.counts[index])
+			return false;
+
+	return true;
+}
+
+/* Records the movable files below 'dir', or every file with a chain of data
+   blocks if 'all' is true, keeping every directory visited in the directory
+   cache until the end of defragmentation. */
+int defrag_collect(struct fs *fs, struct defrag *d, struct directory *dir,
+bool all)
+{
+	void *grown;
+
+	if (!(grown = realloc(d->dirs, sizeof(*d->dirs) * (d->dir_count + 1))))
+		return -1;
+	d->dirs = grown;
+	d->dirs[d->dir_count++] = dir;
+	dir->open_count++;
+
+	for (int entry = 0; entry < dir->block_count * FS_FILE_MAX_COUNT; entry++){
+		struct root_directory_entry *file = &dir->entries[entry];
+		struct directory *child;
+
+		if (file->filename[0] != '\0' && file->flags & ENTRY_DIR){
+			if ((child = dir_child(fs, dir, (const char *)file->filename)) &&
+			defrag_collect(fs, d, child, all) == -1)
+				return -1;
+			continue;
+		}
+
+		bool movable = defrag_movable(fs, file);
+		if (!movable && (!all || file->filename[0] == '\0' ||
+		file->flags & ENTRY_PACKED))
+			continue;
+
+		grown = realloc(d->files, sizeof(*d->files) * (d->file_count + 1));
+		if (!grown)
+			return -1;
+		d->files = grown;
+		d->files[d->file_count++] = file;
+		if (!movable)
+			continue;
+
+		uint16_t prev = FAT_EOC;
+		for (uint16_t index = file->first_data_block_index; index != FAT_EOC;
+		index = fat_get(fs, index)){
+			d->pred[index] = prev;
+			d->owner[index] = file;
+			prev = index;
+		}
+	}
+
+	return 0;
+}
+
+/* Makes whatever pointed to block 'from' as part of a chain point to 'to'. */
+void defrag_link(struct fs *fs, struct defrag *d, uint16_t from, uint16_t to)
+{
+	if (d->pred[from] == FAT_EOC)
+		d->owner[from]->first_data_block_index = to;
+	else
+		fat_set(fs, d->pred[from], to);
+}
+
+/* Moves the content and chain position of block 'src' to free block 'dst'. */
+int defrag_move(struct fs *fs, struct defrag *d, uint16_t src, uint16_t dst)
+{
+	uint8_t block[BLOCK_SIZE];
+	uint16_t next = fat_get(fs, src);
+
+	if (data_read(fs, src, block) == -1 ||
+	data_write(fs, dst, block) == -1)
+		return -1;
+
+	defrag_link(fs, d, src, dst);
+	fat_set(fs, dst, next);
+	fat_set(fs, src, 0);
+	if (next != FAT_EOC)
+		d->pred[next] = dst;
+
+	d->pred[dst] = d->pred[src];
+	d->owner[dst] = d->owner[src];
+	d->owner[src] = NULL;
+
+	if (fs->dedup.hashes && fs->dedup.hashes[src]){
+		dedup_insert(fs, dst, fs->dedup.hashes[src]);
+		dedup_forget(fs, src);
+	}
+
+	return 0;
+}
+
+/* Exchanges the content and chain positions of blocks 'a' and 'b', which
+   may belong to the same chain and even follow each other. */
+int defrag_swap(struct fs *fs, struct defrag *d, uint16_t a, uint16_t b)
+{
+	uint8_t blockA[BLOCK_SIZE], blockB[BLOCK_SIZE];
+	uint16_t nextA = fat_get(fs, a), nextB = fat_get(fs, b);
+	uint16_t predA = d->pred[a], predB = d->pred[b];
+	struct root_directory_entry *ownerA = d->owner[a];
+	uint32_t hashA = 0, hashB = 0;
+
+	if (data_read(fs, a, blockA) == -1 ||
+	data_read(fs, b, blockB) == -1 ||
+	data_write(fs, a, blockB) == -1 ||
+	data_write(fs, b, blockA) == -1)
+		return -1;
+
+	// Links between the two blocks follow them, other links are redirected
+	#define RENAME(x) ((x) == a ? b : (x) == b ? a : (x))
+	if (predA != b)
+		defrag_link(fs, d, a, b);
+	if (predB != a)
+		defrag_link(fs, d, b, a);
+	fat_set(fs, b, RENAME(nextA));
+	fat_set(fs, a, RENAME(nextB));
+	if (nextA != FAT_EOC && nextA != b)
+		d->pred[nextA] = b;
+	if (nextB != FAT_EOC && nextB != a)
+		d->pred[nextB] = a;
+	d->pred[b] = predA == FAT_EOC ? FAT_EOC : RENAME(predA);
+	d->pred[a] = predB == FAT_EOC ? FAT_EOC : RENAME(predB);
+	#undef RENAME
+
+	d->owner[a] = d->owner[b];
+	d->owner[b] = ownerA;
+
+	if (fs->dedup.hashes){
+		hashA = fs->dedup.hashes[a];
+		hashB = fs->dedup.hashes[b];
+		dedup_forget(fs, a);
+		dedup_forget(fs, b);
+		if (hashA)
+			dedup_insert(fs, b, hashA);
+		if (hashB)
+			dedup_insert(fs, a, hashB);
+	}
+
+	return 0;
+}
+
+/* Returns lowest block from 'cursor' starting a run of 'length' blocks that
+   are all free or movable, or -1 if there is none. */
+int defrag_target(struct fs *fs, struct defrag *d, int cursor, int length)
+{
+	int run = 0;
+
+	for (int index = cursor; index < fs->sb.total_data_blocks; index++){
+		if (fat_get(fs, index) != 0 && !d->owner[index])
+			run = 0;
+		else if (++run == length)
+			return index - length + 1;
+	}
+
+	return -1;
+}
+
+/* Moves the chain of 'file' to the 'length' blocks starting at 'target',
+   swapping out the blocks of other movable files found there, until
+   'budget' blocks are written if it is not 0. Returns the number of blocks
+   written. */
+int defrag_file(struct fs *fs, struct defrag *d,
+struct root_directory_entry *file, uint16_t *chain, int length, int target,
+int budget)
+{
+	int moved = 0;
+
+	for (int position = 0; position < length; position++){
+		uint16_t src = chain[position], dst = target + position;
+
+		if (src == dst)
+			continue;
+
+		if (budget && moved >= budget)
+			break;
+
+		if (fat_get(fs, dst) == 0){
+			if (defrag_move(fs, d, src, dst) == -1)
+				return -1;
+			moved++;
+		} else {
+			// The block found may hold a later part of the same file
+			bool same = d->owner[dst] == file;
+			if (defrag_swap(fs, d, src, dst) == -1)
+				return -1;
+			if (same)
+				for (int later = position + 1; later < length; later++)
+					if (chain[later] == dst){
+						chain[later] = src;
+						break;
+					}
+			moved += 2;
+		}
+		chain[position] = dst;
+	}
+
+	return moved;
+}
+
+int fsh_defrag(struct fs *fs, int budget)
+{
+	TRACE_PATH(NULL);
+
+	struct defrag d = {0};
+	uint16_t *chain = NULL;
+	int moved = 0, cursor = 1;
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+
+	d.pred = malloc(sizeof(uint16_t) * fs->sb.total_data_blocks);
+	d.owner = calloc(fs->sb.total_data_blocks, sizeof(*d.owner));
+	chain = malloc(sizeof(uint16_t) * fs->sb.total_data_blocks);
+	if (!d.pred || !d.owner || !chain || defrag_collect(fs, &d, &fs->rd, false) == -1)
+		moved = -1;
+
+	// Files are laid out one after the other from the start of the data
+	// blocks, so that free space ends up in one run after them
+	for (int file = 0; moved != -1 && file < d.file_count; file++){
+		struct root_directory_entry *entry = d.files[file];
+		int length = 0, target;
+
+		for (uint16_t index = entry->first_data_block_index;
+		index != FAT_EOC; index = fat_get(fs, index))
+			chain[length++] = index;
+		if (length == 0 || (target = defrag_target(fs, &d, cursor, length)) == -1)
+			continue;
+
+		// Stop once the budget is spent, the next call finds the blocks
+		// already moved in place and resumes from there
+		if (budget > 0 && moved >= budget)
+			break;
+
+		int written = defrag_file(fs, &d, entry, chain, length, target,
+		budget > 0 ? budget - moved : 0);
+		if (written == -1){
+			moved = -1;
+			break;
+		}
+		moved += written;
+		cursor = target + length;
+	}
+
+	for (int dir = 0; dir < d.dir_count; dir++){
+		d.dirs[dir]->open_count--;
+		if (moved > 0)
+			d.dirs[dir]->dirty = true;
+	}
+
+	free(d.files);
+	free(d.dirs);
+	free(d.pred);
+	free(d.owner);
+	free(chain);
+
+	return moved;
+}
+
+int fsh_fraginfo(struct fs *fs)
+{
+	TRACE_PATH(NULL);
+
+	int files = 0, extents = 0, blocks = 0;
+	int freeExtents = 0, freeBlocks = 0, freeLargest = 0, run = 0;
+	struct defrag d = {0};
+
+	// No FS currently mounted
+	if (!fs || fs->failed)
+		return -1;
+
+	d.pred = malloc(sizeof(uint16_t) * fs->sb.total_data_blocks);
+	d.owner = calloc(fs->sb.total_data_blocks, sizeof(*d.owner));
+	if (!d.pred || !d.owner || defrag_collect(fs, &d, &fs->rd, true) == -1){
+		files = -1;
+		goto out;
+	}
+
+	// Extents of file chains: runs of consecutive blocks
+	for (int file = 0; file < d.file_count; file++){
+		uint16_t index = d.files[file]->first_data_block_index;
+		if (index == FAT_EOC)
+			continue;
+		files++;
+		for (uint16_t prev = FAT_EOC; index != FAT_EOC;
+		prev = index, index = fat_get(fs, index)){
+			if (prev == FAT_EOC || index != prev + 1)
+				extents++;
+			blocks++;
+		}
+	}
+
+	// Extents of free space
+	for (int index = 1; index <= fs->sb.total_data_blocks; index++){
+		if (index < fs->sb.total_data_blocks &&
+		fat_get(fs, index) == 0){
+			if (run++ == 0)
+				freeExtents++;
+			freeBlocks++;
+			continue;
+		}
+		if (run > freeLargest)
+			freeLargest = run;
+		run = 0;
+	}
+
+	printf("FS Fragmentation:\n");
+	printf("file_count=%d\n", files);
+	printf("extent_count=%d\n", extents);
+	printf("extents_per_file=%d.%02d\n", files ? extents / files : 0,
+	files ? extents * 100 / files % 100 : 0);
+	printf("avg_run_length=%d.%02d\n", extents ? blocks / extents : 0,
+	extents ? blocks * 100 / extents % 100 : 0);
+	printf("free_extent_count=%d\n", freeExtents);
+	printf("free_largest_run=%d/%d\n", freeLargest, freeBlocks);
+
+out:
+	for (int dir = 0; dir < d.dir_count; dir++)
+		d.dirs[dir]->open_count--;
+	free(d.files);
+	free(d.dirs);
+	free(d.pred);
+	free(d.owner);
+
+	return files == -1 ? -1 : 0;
+}
+
+/* Heatmap */
+
+/* Number of hottest files listed by the heatmap report */
+#define HEATMAP_FILES 10
+
+/* Number of regions the data blocks are split in by the heatmap report */
+#define HEATMAP_REGIONS 8
+
+/* Cells of each row, and maximum number of rows, of the layout map */
+#define HEATMAP_WIDTH 64
+#define HEATMAP_ROWS 16
+
+/* Accesses to the blocks of a file, and how scattered they are */
+struct heat_file{
+	struct root_directory_entry *file;
+	unsigned long reads;
+	unsigned long writes;
+	int blocks;
+	int extents;
+	int span;
+};
+
+int fsh_heatmap_mode(struct fs *fs, int enable)
+{
+	TRACE_PATH(NULL);
+
+	// No FS currently mounted
+	if (!fs || fs->failed)
+		return -1;
+
+	return disk_heatmap(fs->disk, enable);
+}
+
+/* Sets 'reads' and 'writes' to the accesses to data block 'index', or to 0
+   if they are not counted. */
+void data_heat(struct fs *fs, int index, unsigned *reads, unsigned *writes)
+{
+	if (disk_heat(fs->disk, fs->sb.data_block_index + index, reads,
+	writes) == -1)
+		*reads = *writes = 0;
+}
+
+/* Orders files by decreasing accesses, then by decreasing extents. */
+int heat_compare(const void *a, const void *b)
+{
+	const struct heat_file *x = a, *y = b;
+	unsigned long xHeat = x->reads + x->writes, yHeat = y->reads + y->writes;
+
+	if (xHeat != yHeat)
+		return xHeat < yHeat ? 1 : -1;
+	return y->extents - x->extents;
+}
+
+int fsh_heatmap(struct fs *fs)
+{
+	TRACE_PATH(NULL);
+
+	struct defrag d = {0};
+	struct heat_file *heat = NULL;
+	unsigned long metaReads = 0, metaWrites = 0;
+	unsigned reads, writes;
+	int ret = 0, files = 0;
+
+	// No FS currently mounted
+	if (!fs || fs->failed)
+		return -1;
+
+	d.pred = malloc(sizeof(uint16_t) * fs->sb.total_data_blocks);
+	d.owner = calloc(fs->sb.total_data_blocks, sizeof(*d.owner));
+	if (!d.pred || !d.owner || defrag_collect(fs, &d, &fs->rd, true) == -1 ||
+	!(heat = calloc(d.file_count + 1, sizeof(*heat)))){
+		ret = -1;
+		goto out;
+	}
+
+	bool counting = disk_heat(fs->disk, 0, &reads, &writes) == 0;
+
+	// Superblock, FAT and root directory
+	for (int block = 0; counting && block < fs->sb.data_block_index; block++){
+		disk_heat(fs->disk, block, &reads, &writes);
+		metaReads += reads;
+		metaWrites += writes;
+	}
+
+	// Accesses to each file chain, and its extents and span
+	for (int file = 0; file < d.file_count; file++){
+		struct heat_file *h = &heat[files];
+		int low = INT_MAX, high = 0;
+
+		h->file = d.files[file];
+		for (uint16_t prev = FAT_EOC, index = h->file->first_data_block_index;
+		index != FAT_EOC; prev = index, index = fat_get(fs, index)){
+			if (prev == FAT_EOC || index != prev + 1)
+				h->extents++;
+			h->blocks++;
+			if (index < low)
+				low = index;
+			if (index > high)
+				high = index;
+			data_heat(fs, index, &reads, &writes);
+			h->reads += reads;
+			h->writes += writes;
+		}
+		if (h->blocks == 0)
+			continue;
+		h->span = high - low + 1;
+		files++;
+	}
+	qsort(heat, files, sizeof(*heat), heat_compare);
+
+	printf("FS Heatmap:\n");
+	printf("heat_counting=%d\n", counting);
+	printf("meta_reads=%lu\n", metaReads);
+	printf("meta_writes=%lu\n", metaWrites);
+	printf("file_count=%d\n", files);
+	for (int file = 0; file < files && file < HEATMAP_FILES; file++)
+		printf("file: %s, reads: %lu, writes: %lu, blk_count: %d, "
+		"extents: %d, span: %d\n", heat[file].file->filename,
+		heat[file].reads, heat[file].writes, heat[file].blocks,
+		heat[file].extents, heat[file].span);
+
+	// Regions of data blocks, in order
+	int total = fs->sb.total_data_blocks;
+	int regionSize = (total + HEATMAP_REGIONS - 1) / HEATMAP_REGIONS;
+	for (int first = 0; first < total; first += regionSize){
+		unsigned long regionReads = 0, regionWrites = 0;
+		int used = 0, last = first + regionSize;
+		if (last > total)
+			last = total;
+		for (int index = first; index < last; index++){
+			data_heat(fs, index, &reads, &writes);
+			regionReads += reads;
+			regionWrites += writes;
+			used += fat_get(fs, index) != 0;
+		}
+		printf("region: %d-%d, reads: %lu, writes: %lu, used: %d/%d\n",
+		first, last - 1, regionReads, regionWrites, used, last - first);
+	}
+
+	// Layout map: each cell covers 'perCell' data blocks, and shows '.' if
+	// they are all free, '#' if none was accessed, and otherwise the heat
+	// of the cell from 1 to 9 relative to the hottest one
+	int perCell = (total + HEATMAP_WIDTH * HEATMAP_ROWS - 1) /
+	(HEATMAP_WIDTH * HEATMAP_ROWS);
+	int cells = (total + perCell - 1) / perCell;
+	unsigned long *cellHeat = calloc(cells, sizeof(*cellHeat));
+	char *cellUsed = calloc(cells, 1);
+	unsigned long hottest = 0;
+	char row[HEATMAP_WIDTH + 1];
+
+	if (!cellHeat || !cellUsed){
+		free(cellHeat);
+		free(cellUsed);
+		ret = -1;
+		goto out;
+	}
+	for (int index = 0; index < total; index++){
+		data_heat(fs, index, &reads, &writes);
+		cellHeat[index / perCell] += reads + writes;
+		cellUsed[index / perCell] |= fat_get(fs, index) != 0;
+	}
+	for (int cell = 0; cell < cells; cell++)
+		if (cellHeat[cell] > hottest)
+			hottest = cellHeat[cell];
+
+	printf("map_blk_per_cell=%d\n", perCell);
+	for (int cell = 0; cell < cells; cell += HEATMAP_WIDTH){
+		int width = cells - cell < HEATMAP_WIDTH ? cells - cell : HEATMAP_WIDTH;
+		for (int i = 0; i < width; i++){
+			unsigned long h = cellHeat[cell + i];
+			if (!cellUsed[cell + i] && !h)
+				row[i] = '.';
+			else if (!h)
+				row[i] = '#';
+			else
+				row[i] = '1' + h * 8 / hottest;
+		}
+		row[width] = '\0';
+		printf("map: %s\n", row);
+	}
+	free(cellHeat);
+	free(cellUsed);
+
+out:
+	for (int dir = 0; dir < d.dir_count; dir++)
+		d.dirs[dir]->open_count--;
+	free(d.files);
+	free(d.dirs);
+	free(d.pred);
+	free(d.owner);
+	free(heat);
+
+	return ret;
+}
+
+/* Formatting */
+
+int fs_format(const char *diskname, int data_blocks,
+const struct fs_format_options *options)
+{
+	TRACE_PATH(diskname);
+
+	char sig[8] = {'E', 'C', 'S', '1', '5', '0', 'F', 'S'};
+	int fatBlocks = (data_blocks + NUM_ENTRIES_FAT_BLOCK - 1) /
+	NUM_ENTRIES_FAT_BLOCK;
+	struct fs *fs;
+
+	if (options && options->fat_blocks){
+		// Extra FAT blocks let the file system grow without moving blocks
+		if (options->fat_blocks < fatBlocks)
+			return -1;
+		fatBlocks = options->fat_blocks;
+	}
+
+	// Only sizes that the superblock can record
+	if (data_blocks < 1 || fatBlocks > UINT8_MAX ||
+	2 + fatBlocks + data_blocks > UINT16_MAX)
+		return -1;
+
+	if ((fs = calloc(1, sizeof(struct fs))) == NULL ||
+	(fs->meta = calloc(fatBlocks + 2, BLOCK_SIZE)) == NULL){
+		free(fs);
+		return -1;
+	}
+
+	memcpy(fs->sb.signature, sig, sizeof(sig));
+	fs->sb.total_blocks = 2 + fatBlocks + data_blocks;
+	fs->sb.fat_blocks = fatBlocks;
+	fs->sb.root_dir_index = fatBlocks + 1;
+	fs->sb.data_block_index = fatBlocks + 2;
+	fs->sb.total_data_blocks = data_blocks;
+	if (options && options->dedup)
+		fs->sb.features |= FEATURE_DEDUP;
+	if (options && options->pack)
+		fs->sb.features |= FEATURE_PACK;
+
+	// Data block 0 is never allocated
+	fs->fat = (struct fat_block *)((uint8_t *)fs->meta + BLOCK_SIZE);
+	fat_set(fs, 0, FAT_EOC);
+
+	// Free space summary, valid from the first mount on
+	uint8_t *root = (uint8_t *)fs->meta + BLOCK_SIZE * fs->sb.root_dir_index;
+	fs->rd.block_count = 1;
+	fs->rd.entries = (struct root_directory_entry *)root;
+	free_rebuild(fs);
+	fs->sb.free_check = free_checksum(fs, root);
+	memcpy(fs->meta, &fs->sb, BLOCK_SIZE);
+
+	// Superblock, FAT and root directory in one sequential write, data
+	// blocks being left as a hole
+	int ret = -1;
+	if ((fs->disk = disk_create(diskname, fs->sb.total_blocks)) != NULL){
+		ret = disk_write_range(fs->disk, 0, fatBlocks + 2, fs->meta);
+		disk_close(fs->disk);
+	}
+
+	free(fs->meta);
+	free(fs);
+
+	return ret;
+}
+
+/* Trimming */
+
+int fsh_trim(struct fs *fs)
+{
+	TRACE_PATH(NULL);
+
+	int released = 0, first = 0;
+
+	// No FS currently mounted, or mounted read-only
+	if (!fs || fs->failed || fs->readonly)
+		return -1;
+
+	// Release every run of free data blocks, including those freed before
+	// blocks were released on their own
+	discard_flush(fs);
+	for (int index = 1; index <= fs->sb.total_data_blocks; index++){
+		if (index < fs->sb.total_data_blocks && fat_get(fs, index) == 0){
+			if (!first)
+				first = index;
+			continue;
+		}
+		if (first){
+			if (disk_discard(fs->disk, fs->sb.data_block_index + first,
+			index - first) == -1)
+				return -1;
+			released += index - first;
+			first = 0;
+		}
+	}
+
+	return released;
+}
+
+/* Growth */
+
+/* Lays out the unmounted image, already resized, with 'dataBlocks' data
+   blocks after 'fatBlocks' FAT blocks. Data blocks keep their index: when the
+   FAT grows, the root directory and the data blocks up to the last one in use
+   all move past the new FAT blocks, and the rest of the image is left
+   unwritten. */
+int grow_image(struct fs *fs, int fatBlocks, int dataBlocks)
+{
+	int shift = fatBlocks - fs->sb.fat_blocks;
+	int last = 0;
+	uint16_t *entries = calloc(fatBlocks, BLOCK_SIZE);
+	uint8_t *moving = malloc(BLOCK_SIZE * GROW_MOVE_BLOCKS);
+
+	if (!entries || !moving ||
+	disk_read_range(fs->disk, 1, fs->sb.fat_blocks, entries) == -1)
+		goto error;
+
+	// Entries past the old data blocks are never used, but not necessarily
+	// cleared by the tool that made the image
+	for (int index = 1; index < fs->sb.fat_blocks * NUM_ENTRIES_FAT_BLOCK;
+	index++){
+		if (index >= fs->sb.total_data_blocks)
+			entries[index] = 0;
+		else if (entries[index])
+			last = index;
+	}
+
+	// Both ranges overlap, so blocks move from the last ones down
+	if (shift > 0){
+		int first = fs->sb.root_dir_index;
+		int end = fs->sb.data_block_index + last + 1;
+		while (end > first){
+			int count = end - first < GROW_MOVE_BLOCKS ?
+			end - first : GROW_MOVE_BLOCKS;
+			end -= count;
+			if (disk_read_range(fs->disk, end, count, moving) == -1 ||
+			disk_write_range(fs->disk, end + shift, count, moving) == -1)
+				goto error;
+		}
+	}
+
+	fs->sb.total_blocks = 2 + fatBlocks + dataBlocks;
+	fs->sb.fat_blocks = fatBlocks;
+	fs->sb.root_dir_index = fatBlocks + 1;
+	fs->sb.data_block_index = fatBlocks + 2;
+	fs->sb.total_data_blocks = dataBlocks;
+	if (disk_write_range(fs->disk, 1, fatBlocks, entries) == -1 ||
+	disk_write(fs->disk, 0, &fs->sb) == -1)
+		goto error;
+
+	free(entries);
+	free(moving);
+	return 0;
+
+error:
+	free(entries);
+	free(moving);
+	return -1;
+}
+
+/* Mounts the image again from its superblock after a growth from 'total'
+   blocks failed past the write back of the metadata, the instance being
+   marked as failed if even that is not possible. */
+int grow_fail(struct fs *fs, int total)
+{
+	// Forget the metadata left, as written back or half read
+	fs->rd.dirty = false;
+	dir_release(fs, &fs->rd);
+	pack_release(fs);
+	ref_release(fs);
+	dedup_release(fs);
+	fs->discard_count = 0;
+
+	// The superblock is written last, so the image is still laid out as it
+	// says, the blocks added being dropped unless it records them
+	if (disk_read(fs->disk, 0, &fs->sb) == 0 &&
+	(fs->sb.total_blocks == disk_count(fs->disk) ||
+	disk_resize(fs->disk, total) == 0) &&
+	meta_load(fs, fs->sb.fat_blocks) == 0 &&
+	mount_load(fs, fs->sb.fat_blocks) == 0){
+		free_rebuild(fs);
+		return -1;
+	}
+
+	// Nothing left to work with but the disk, closed at unmount
+	fs->rd.dirty = false;
+	dir_release(fs, &fs->rd);
+	pack_release(fs);
+	ref_release(fs);
+	dedup_release(fs);
+	free(fs->meta);
+	fs->meta = NULL;
+	fs->fat = NULL;
+	fs->failed = true;
+
+	return -1;
+}
+
+int fsh_grow(struct fs *fs, int data_blocks)
+{
+	TRACE_PATH(NULL);
+
+	// No FS currently mounted, mounted read-only, or striped
+	if (!fs || fs->failed || fs->readonly || fs->sb.stripe_count > 1)
+		return -1;
+
+	int fatBlocks = (data_blocks + NUM_ENTRIES_FAT_BLOCK - 1) /
+	NUM_ENTRIES_FAT_BLOCK;
+	if (fatBlocks < fs->sb.fat_blocks)
+		fatBlocks = fs->sb.fat_blocks;
+
+	// Only larger sizes that the superblock can record
+	if (data_blocks <= fs->sb.total_data_blocks || fatBlocks > UINT8_MAX ||
+	2 + fatBlocks + data_blocks > UINT16_MAX)
+		return -1;
+
+	// Open files point into the directories reloaded below
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		if (fs->fdTable[fd].file != NULL)
+			return -1;
+	bool moved = fatBlocks != fs->sb.fat_blocks;
+	int total = fs->sb.total_blocks;
+
+	// Make room first, so that a host short of space leaves the instance
+	// as it was
+	if (disk_resize(fs->disk, 2 + fatBlocks + data_blocks) == -1)
+		return -1;
+
+	// Write back all metadata, as when unmounting, so that the image is
+	// consistent on its own while it grows
+	if (mount_store(fs) == -1 ||
+	grow_image(fs, fatBlocks, data_blocks) == -1)
+		return grow_fail(fs, total);
+
+	// Read back metadata, the free space summary being laid out anew
+	if (meta_load(fs, fatBlocks) == -1)
+		return grow_fail(fs, total);
+	memcpy(&fs->sb, fs->meta, BLOCK_SIZE);
+	if (mount_load(fs, fatBlocks) == -1)
+		return grow_fail(fs, total);
+	free_rebuild(fs);
+
+	// Free blocks moved along with the others take space again
+	if (moved)
+		fsh_trim(fs);
+
+	return 0;
+}
+
+/* Striping */
+
+int fs_stripe(const char *diskname, const char **members, int count, int unit)
+{
+	TRACE_PATH(diskname);
+
+	struct fs *fs;
+
+	// Invalid number of images or stripe unit
+	if (count < 1 || count >= FS_STRIPE_MAX_COUNT || unit <= 0 ||
+	unit > UINT16_MAX)
+		return -1;
+
+	for (int member = 0; member < count; member++)
+		if (!members[member] || members[member][0] == '\0' ||
+		strlen(members[member]) >= STRIPE_NAME_LEN)
+			return -1;
+
+	if ((fs = fsh_mount(diskname)) == NULL)
+		return -1;
+
+	// Only file systems without data blocks in use yet can be striped,
+	// their blocks moving to other places
+	if (fs->sb.stripe_count > 1 ||
+	fat_free(fs) != fs->sb.total_data_blocks - 1){
+		fsh_umount(fs);
+		return -1;
+	}
 
-		content = fat[blockNum].fat_entries[index];
-		fat[blockNum].fat_entries[index] = 0;
+	fs->sb.stripe_count = count + 1;
+	fs->sb.stripe_unit = unit;
+	for (int member = 0; member < count; member++)
+		strcpy(fs->sb.stripe_names[member], members[member]);
+
+	if (stripe_open(fs, diskname, true) == -1){
+		memset(fs->sb.stripe_names, 0, sizeof(fs->sb.stripe_names));
+		fs->sb.stripe_count = 0;
+		fs->sb.stripe_unit = 0;
+		fsh_umount(fs);
+		return -1;
 	}
-	/* End */
 
+	return fsh_umount(fs);
+}
+
+/* Default instance */
+
+int fs_mount(const char *diskname)
+{
+	uint64_t start;
+
+	// Default instance already mounted
+	if (fs_default)
+		return -1;
+
+	start = record_begin();
+	fs_default = fsh_mount(diskname);
+	record_end(start, RECORD_MOUNT, diskname, -1, 0, fs_default ? 0 : -1);
+	return fs_default ? 0 : -1;
+}
+
+int fs_mount_ro(const char *diskname)
+{
+	uint64_t start;
+
+	// Default instance already mounted
+	if (fs_default)
+		return -1;
+
+	start = record_begin();
+	fs_default = fsh_mount_ro(diskname);
+	record_end(start, RECORD_MOUNT, diskname, -1, 0, fs_default ? 0 : -1);
+	return fs_default ? 0 : -1;
+}
+
+int fs_umount(void)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_umount(fs_default);
 
+	record_end(start, RECORD_UMOUNT, NULL, -1, 0, ret);
+	if (ret == -1)
+		return -1;
 
-	// temp code - just to compile
-	if (fd && buf && count)
-		return 0; 
+	fs_default = NULL;
 	return 0;
 }
 
+int fs_info(void)
+{
+	return fsh_info(fs_default);
+}
+
+int fs_create(const char *filename)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_create(fs_default, filename);
+
+	record_end(start, RECORD_CREATE, filename, -1, 0, ret);
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_delete(fs_default, filename);
+
+	record_end(start, RECORD_DELETE, filename, -1, 0, ret);
+	return ret;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	return fsh_clone(fs_default, src, dst);
+}
+
+int fs_ls(void)
+{
+	return fsh_ls(fs_default);
+}
+
+int fs_lsdir(const char *dirname)
+{
+	return fsh_lsdir(fs_default, dirname);
+}
+
+int fs_mkdir(const char *dirname)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_mkdir(fs_default, dirname);
+
+	record_end(start, RECORD_MKDIR, dirname, -1, 0, ret);
+	return ret;
+}
+
+int fs_rmdir(const char *dirname)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_rmdir(fs_default, dirname);
+
+	record_end(start, RECORD_RMDIR, dirname, -1, 0, ret);
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_open(fs_default, filename);
+
+	record_end(start, RECORD_OPEN, filename, -1, 0, ret);
+	return ret;
+}
+
+int fs_close(int fd)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_close(fs_default, fd);
+
+	record_end(start, RECORD_CLOSE, NULL, fd, 0, ret);
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	return fsh_stat(fs_default, fd);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_lseek(fs_default, fd, offset);
+
+	record_end(start, RECORD_SEEK, NULL, fd, offset, ret);
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_write(fs_default, fd, buf, count);
+
+	record_end(start, RECORD_WRITE, NULL, fd, count, ret);
+	return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_read(fs_default, fd, buf, count);
+
+	record_end(start, RECORD_READ, NULL, fd, count, ret);
+	return ret;
+}
+
+int fs_dedup_mode(int enable)
+{
+	return fsh_dedup_mode(fs_default, enable);
+}
+
+int fs_dedup(void)
+{
+	return fsh_dedup(fs_default);
+}
+
+int fs_compress(const char *filename, int enable)
+{
+	return fsh_compress(fs_default, filename, enable);
+}
+
+int fs_fraginfo(void)
+{
+	return fsh_fraginfo(fs_default);
+}
+
+int fs_defrag(int budget)
+{
+	return fsh_defrag(fs_default, budget);
+}
+
+int fs_grow(int data_blocks)
+{
+	return fsh_grow(fs_default, data_blocks);
+}
+
+int fs_trim(void)
+{
+	return fsh_trim(fs_default);
+}
+
+int fs_reserve(int fd, size_t size)
+{
+	return fsh_reserve(fs_default, fd, size);
+}
+
+int fs_readdir(const char *dirname, int index, struct fs_dirent *dirent)
+{
+	return fsh_readdir(fs_default, dirname, index, dirent);
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+	return fsh_stats(fs_default, stats);
+}
+
+int fs_stats_reset(void)
+{
+	return fsh_stats_reset(fs_default);
+}
+
+int fs_heatmap_mode(int enable)
+{
+	return fsh_heatmap_mode(fs_default, enable);
+}
+
+int fs_heatmap(void)
+{
+	return fsh_heatmap(fs_default);
+}
+
+int fs_export_fd(int fd, int host_fd)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_export_fd(fs_default, fd, host_fd);
+
+	// The rest of the file is read, whatever its size
+	record_end(start, RECORD_READ, NULL, fd, ret < 0 ? 0 : ret, ret);
+	return ret;
+}
+
+int fs_import_fd(int fd, int host_fd, size_t len)
+{
+	uint64_t start = record_begin();
+	int ret = fsh_import_fd(fs_default, fd, host_fd, len);
+
+	record_end(start, RECORD_WRITE, NULL, fd, len, ret);
+	return ret;
+}
@@ -2,16 +2,58 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Number of files held by each root directory block */
 #define FS_FILE_MAX_COUNT 128
 
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Separator between the directory names of a path */
+#define FS_PATH_SEPARATOR '/'
+
+/** Maximum number of images a file system can be striped across */
+#define FS_STRIPE_MAX_COUNT 8
+
+/**
+ * struct fs_format_options - Layout options of fs_format()
+ * @fat_blocks: Number of FAT blocks, 0 for just enough for the data blocks.
+ *              Extra FAT blocks let fs_grow() add data blocks without moving
+ *              any.
+ * @dedup: Whether the file system starts in deduplication mode
+ * @pack: Whether files of at most one kilobyte are packed together in shared
+ *        data blocks. Such files cannot be read by implementations that do not
+ *        know of packing.
+ */
+struct fs_format_options {
+	int fat_blocks;
+	int dedup;
+	int pack;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks
+ * @options: Layout options, or NULL for the defaults
+ *
+ * Create virtual disk file @diskname, replacing any file of that name, with an
+ * empty file system of @data_blocks data blocks. The superblock, FAT and root
+ * directory are written in one sequential write, and the data blocks are left
+ * as a hole that takes no space on the host until they are written. The same
+ * arguments always make the same image.
+ *
+ * Return: -1 if @data_blocks is 0 or too large for the file system, if
+ * @options asks for fewer FAT blocks than needed, or if virtual disk file
+ * @diskname cannot be created or written. 0 otherwise.
+ */
+int fs_format(const char *diskname, int data_blocks,
+	      const struct fs_format_options *options);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,6 +67,24 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_ro - Mount a file system read-only
+ * @diskname: Name of the virtual disk file
+ *
+ * Mount the file system contained in the virtual disk file @diskname without
+ * ever writing to it. The disk is opened read-only and mapped whole with a
+ * shared mapping, so that any number of processes can mount the same disk
+ * read-only at once and share its pages. Calls that would modify the file
+ * system (fs_create(), fs_mkdir(), fs_delete(), fs_rmdir(), fs_clone(),
+ * fs_write(), fs_compress(), fs_dedup_mode(), fs_dedup() and fs_defrag())
+ * fail, and fs_umount() writes nothing back. The disk must not be mounted
+ * read-write at the same time.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened or mapped, or if
+ * no valid file system can be located. 0 otherwise.
+ */
+int fs_mount_ro(const char *diskname);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -54,9 +114,19 @@ int fs_info(void);
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
  * character).
  *
+ * @filename can also be a path such as "tenant/2026/file", in which case the
+ * file is created in the existing subdirectory named by the leading
+ * components. The %FS_FILENAME_LEN limit then applies to each component.
+ *
+ * The root directory starts as a single block of %FS_FILE_MAX_COUNT entries.
+ * Once full, it is doubled with extension blocks taken from the data region
+ * and entries are rehashed across its blocks, so the number of files is only
+ * bounded by disk space.
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if a directory of its path does not exist, or if the directory is full and
+ * there is not enough space left on disk to grow it. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -65,7 +135,9 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system, or from the subdirectory named by its path. Directories are removed
+ * with fs_rmdir() instead. Data blocks no longer used by any file are released
+ * to the host, punching holes in the virtual disk file.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
@@ -73,6 +145,23 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same content as file @src, without
+ * copying its data: both files share the same data blocks, which are only
+ * copied once either file writes to them. Small packed files are copied
+ * right away instead. Both names follow the same rules as for fs_create().
+ *
+ * Return: -1 if no FS is currently mounted, or if @src or @dst is invalid, or
+ * if there is no file named @src, or if @src is a compressed file, or if a
+ * file named @dst already exists, or if there is no space left on disk. 0
+ * otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +171,44 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_lsdir - List files of a directory
+ * @dirname: Directory path
+ *
+ * List information about the files and subdirectories located in directory
+ * @dirname. An empty path or "/" designates the root directory.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is not an existing
+ * directory. 0 otherwise.
+ */
+int fs_lsdir(const char *dirname);
+
+/**
+ * fs_mkdir - Create a new directory
+ * @dirname: Directory path
+ *
+ * Create a new and empty directory named @dirname. Like files, directories are
+ * created inside the existing directory named by the leading components of
+ * their path. Subdirectories are stored in data blocks and grow the same way
+ * as the root directory.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if an
+ * entry named @dirname already exists, or if a component of @dirname is too
+ * long, or if there is no space left on disk. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @dirname: Directory path
+ *
+ * Remove the empty directory named @dirname.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if
+ * there is no directory named @dirname, or if it is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *dirname);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -94,6 +221,10 @@ int fs_ls(void);
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
  * simultaneously.
  *
+ * As with fs_create(), @filename may be a path into a subdirectory. Resolved
+ * directories are kept in a cache, so repeatedly opening files of the same
+ * directory does not read its blocks again.
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to open, or if there are already
  * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
@@ -155,6 +286,10 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * On file systems formatted with packing, files that never exceed one kilobyte
+ * are packed together in shared data blocks, and are moved to blocks of their
+ * own once they grow past it.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually written.
@@ -182,4 +317,398 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_dedup_mode - Enable or disable deduplication mode
+ * @enable: Whether deduplication should be enabled
+ *
+ * In deduplication mode, which is recorded in the file system, fs_write()
+ * hashes every block it writes into a content index kept in the image, and
+ * fs_close() makes the last blocks of a file that was written share identical
+ * blocks of other files. A FAT block has a single successor, so blocks are
+ * only shared along with the rest of their chain, matching files from their
+ * end. Shared blocks are copied again before being modified, as with
+ * fs_clone(). fs_info() reports the bytes saved and the time spent by the
+ * write path on deduplication.
+ *
+ * Return: -1 if no FS is currently mounted, or if the content index cannot be
+ * allocated. 0 otherwise.
+ */
+int fs_dedup_mode(int enable);
+
+/**
+ * fs_dedup - Deduplicate the whole file system
+ *
+ * Index the content of every file data block, including those written before
+ * deduplication mode was enabled, then deduplicate every file.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is not in deduplication
+ * mode. Otherwise return the number of bytes freed.
+ */
+int fs_dedup(void);
+
+/**
+ * fs_compress - Enable or disable compression of a file
+ * @filename: File name
+ * @enable: Whether the file should be compressed
+ *
+ * Mark empty file @filename so that its content is transparently compressed
+ * by fs_write() and decompressed by fs_read(). The content is split in chunks
+ * of 16 KiB compressed independently, so that reads and writes only process
+ * the chunks they cover, and chunks that do not compress are stored as is.
+ * Compressed files cannot be cloned nor deduplicated. fs_info() reports the
+ * compression ratio and throughput of the current mount.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named
+ * @filename, or if @filename is a directory, or if it is not empty. 0
+ * otherwise.
+ */
+int fs_compress(const char *filename, int enable);
+
+/**
+ * fs_fraginfo - Display fragmentation of the file system
+ *
+ * Display how scattered the data blocks of files are: the number of extents
+ * (runs of consecutive blocks) per file and their average length, as well as
+ * the number of runs of free blocks and the length of the largest one.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_fraginfo(void);
+
+/**
+ * fs_defrag - Defragment the file system
+ * @budget: Maximum number of blocks to write, or 0 for no limit
+ *
+ * Lay out the chains of data blocks of files one after the other from the
+ * start of the data blocks, so that each file is contiguous and free space
+ * coalesces after them. Blocks of other files found in the way are swapped
+ * out. Files whose blocks are shared, packed files and compressed files are
+ * left in place.
+ *
+ * Files are moved in directory order, and defragmentation stops once @budget
+ * blocks are written. Blocks already in place cost nothing, so calling
+ * fs_defrag() again resumes where the previous call stopped.
+ *
+ * Return: -1 if no FS is currently mounted, or if memory cannot be allocated,
+ * or in case of a disk error. Otherwise return the number of blocks written.
+ */
+int fs_defrag(int budget);
+
+/**
+ * fs_grow - Grow the file system
+ * @data_blocks: New number of data blocks
+ *
+ * Extend the virtual disk file of the currently mounted file system so that it
+ * holds @data_blocks data blocks, adding FAT blocks as needed. Every file is
+ * kept as is. Added blocks are not written, so growing only costs the blocks
+ * moved past new FAT blocks, up to the last data block in use.
+ *
+ * Return: -1 if no FS is currently mounted, if it is mounted read-only or
+ * striped, if there are still open file descriptors, if @data_blocks is not
+ * larger than the current number of data blocks or too large for the file
+ * system, or if the virtual disk file cannot be grown. 0 otherwise.
+ */
+int fs_grow(int data_blocks);
+
+/**
+ * fs_trim - Release free blocks to the host
+ *
+ * Release every free data block of the currently mounted file system to the
+ * host, so that it takes no space in the virtual disk file until it is used
+ * again. Data blocks freed by fs_delete() or by any other operation are
+ * released as they are freed already, so this is only needed for blocks freed
+ * by earlier versions or by other tools.
+ *
+ * Return: -1 if no FS is currently mounted, if it is mounted read-only, or if
+ * the blocks cannot be released. Otherwise return the number of free data
+ * blocks released.
+ */
+int fs_trim(void);
+
+/**
+ * fs_reserve - Reserve the blocks of a file
+ * @fd: File descriptor
+ * @size: Size the file is about to be written to
+ *
+ * Allocate the data blocks that the file of file descriptor @fd needs to hold
+ * @size bytes, in a single run of consecutive blocks if there is one, ahead
+ * of writing its content. The size of the file does not change, and the
+ * blocks left unwritten are freed when @fd is closed. On file systems formatted
+ * with packing, files small enough to be packed get no block.
+ *
+ * Return: -1 if no FS is currently mounted, or is mounted read-only, if @fd is
+ * invalid, if the file is not empty or is compressed, or if there are not
+ * enough free blocks. 0 otherwise.
+ */
+int fs_reserve(int fd, size_t size);
+
+/**
+ * struct fs_dirent - Directory entry read by fs_readdir()
+ * @name: Name of the entry
+ * @size: Size of the file, in bytes
+ * @dir: Whether the entry is a directory
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	int dir;
+};
+
+/**
+ * fs_readdir - Read a directory entry
+ * @dirname: Path of the directory, "" or "/" for the root directory
+ * @index: Position to read from, 0 for the first entry
+ * @dirent: Entry to fill
+ *
+ * Read the first entry of directory @dirname at or after position @index into
+ * @dirent. Every entry of a directory is read by starting at 0 and passing
+ * the value returned as @index of the next call, until 0 is returned.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is not a directory
+ * or @dirent is NULL. 0 if there is no entry left, otherwise the position to
+ * read the next entry from.
+ */
+int fs_readdir(const char *dirname, int index, struct fs_dirent *dirent);
+
+/**
+ * fs_export_fd - Copy a file to a host file
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor, written at its current position
+ *
+ * Copy the content of the file of file descriptor @fd, from its offset to its
+ * end, to host file @host_fd, which may be a regular file, a pipe or a
+ * socket. Each run of consecutive data blocks of the file is moved by the
+ * host kernel with a single request, without going through user-space
+ * buffers. Packed and compressed files are copied through a buffer. The file
+ * offset is moved past the bytes copied.
+ *
+ * Return: -1 if no FS is currently mounted, if @fd is invalid, or if nothing
+ * could be copied to @host_fd. Otherwise the number of bytes copied.
+ */
+int fs_export_fd(int fd, int host_fd);
+
+/**
+ * fs_import_fd - Copy a host file to a file
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor, read from its current position
+ * @len: Number of bytes to copy
+ *
+ * Write up to @len bytes read from host file @host_fd, which may be a regular
+ * file or a pipe, to the file of file descriptor @fd at its offset, like
+ * fs_write(). Whole data blocks are moved by the host kernel, a run of
+ * consecutive blocks at a time, and only partial blocks go through a buffer,
+ * as do the blocks of compressed files and those written in deduplication
+ * mode.
+ *
+ * Return: -1 if no FS is currently mounted, or is mounted read-only, if @fd is
+ * invalid, or if nothing could be read from @host_fd or written. Otherwise
+ * the number of bytes copied, less than @len if the end of @host_fd or of the
+ * disk was reached.
+ */
+int fs_import_fd(int fd, int host_fd, size_t len);
+
+/** Number of buckets of the latency histograms of &struct fs_op_stats */
+#define FS_STATS_BUCKETS 32
+
+/**
+ * enum fs_stats_op - Operations timed by fs_stats()
+ */
+enum fs_stats_op {
+	FS_STATS_READ,
+	FS_STATS_WRITE,
+	FS_STATS_OPEN,
+	FS_STATS_CREATE,
+	FS_STATS_DELETE,
+	FS_STATS_OP_COUNT
+};
+
+/**
+ * struct fs_op_stats - Statistics of an operation
+ * @calls: Number of calls
+ * @errors: Number of calls that returned -1
+ * @bytes: Number of bytes read or written
+ * @time_ns: Time spent in the calls, in nanoseconds
+ * @latency: Number of calls by latency, bucket i counting the calls that took
+ *           2^i to 2^(i+1) - 1 nanoseconds, and the last bucket any longer
+ *           call too
+ */
+struct fs_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t time_ns;
+	uint64_t latency[FS_STATS_BUCKETS];
+};
+
+/**
+ * struct fs_stats - Statistics of a mounted file system
+ * @ops: Statistics of each operation of &enum fs_stats_op
+ * @disk_reads: Number of read requests issued to the disk
+ * @disk_writes: Number of write requests issued to the disk
+ * @blocks_read: Number of blocks read from the disk
+ * @blocks_written: Number of blocks written to the disk
+ * @dcache_hits: Number of subdirectories found in the directory cache
+ * @dcache_misses: Number of subdirectories read from the disk
+ * @chunk_hits: Number of reads of compressed files served by the chunk cache
+ * @chunk_misses: Number of reads of compressed files that restored chunks
+ * @fat_hops: Number of FAT entries followed to reach offsets of files
+ */
+struct fs_stats {
+	struct fs_op_stats ops[FS_STATS_OP_COUNT];
+	uint64_t disk_reads;
+	uint64_t disk_writes;
+	uint64_t blocks_read;
+	uint64_t blocks_written;
+	uint64_t dcache_hits;
+	uint64_t dcache_misses;
+	uint64_t chunk_hits;
+	uint64_t chunk_misses;
+	uint64_t fat_hops;
+};
+
+/**
+ * fs_stats - Get statistics of the file system
+ * @stats: Statistics to fill
+ *
+ * Fill @stats with the statistics gathered since the file system was mounted,
+ * or since they were last reset with fs_stats_reset(). Every call of the
+ * operations of &enum fs_stats_op is timed, which costs two reads of the
+ * monotonic clock. Calls of fs_export_fd() and fs_import_fd() count as reads
+ * and writes.
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_stats_reset - Reset statistics of the file system
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_stats_reset(void);
+
+/**
+ * fs_heatmap_mode - Enable or disable counting accesses to each block
+ * @enable: Whether to count
+ *
+ * Start counting the reads and writes of each block of the disk, from zero,
+ * for fs_heatmap() to report, or stop counting if @enable is 0. Counting costs
+ * two counters per block of the disk in memory.
+ *
+ * Return: -1 if no FS is currently mounted, or if the counters cannot be
+ * allocated. 0 otherwise.
+ */
+int fs_heatmap_mode(int enable);
+
+/**
+ * fs_heatmap - Display accesses to the blocks of the file system
+ *
+ * Display the reads and writes counted since fs_heatmap_mode() was enabled:
+ * those of the superblock, FAT and root directory blocks, those of the hottest
+ * files, attributed through the FAT, along with how scattered their blocks are
+ * (number of extents and span of their chain), and those of each region of
+ * data blocks. A map of the data blocks follows, each character covering the
+ * same number of blocks: '.' if they are all free, '#' if none was accessed,
+ * and otherwise a digit from 1 to 9 giving their heat relative to the hottest
+ * ones. Without counting, files are listed by number of extents and the map
+ * shows the layout of the data blocks.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_heatmap(void);
+
+/**
+ * fs_stripe - Stripe a file system across several disks
+ * @diskname: Name of the virtual disk file
+ * @members: Names of the virtual disk files to create
+ * @count: Number of virtual disk files to create
+ * @unit: Number of consecutive data blocks stored on each disk (stripe unit)
+ *
+ * Spread the data blocks of the file system on virtual disk @diskname, which
+ * must not be mounted, round-robin in units of @unit blocks across @diskname
+ * and @count new virtual disk files @members, in the manner of RAID-0. The
+ * names of @members are relative to the directory of @diskname unless they are
+ * absolute, and are recorded in the superblock so that mounting @diskname
+ * opens them as well. Reads of consecutive blocks of a file spanning several
+ * disks are then served by all of them at once. @diskname only keeps its share
+ * of the data blocks, and must not be used without @members afterwards.
+ *
+ * Return: -1 if @count is 0 or makes more than %FS_STRIPE_MAX_COUNT disks, if
+ * @unit is invalid, if any name of @members is empty or too long, if @diskname
+ * cannot be mounted, is already striped or has data blocks in use, or if any of
+ * @members cannot be created. 0 otherwise.
+ */
+int fs_stripe(const char *diskname, const char **members, int count, int unit);
+
+/**
+ * struct fs - Mounted file system handle
+ *
+ * The fs_* functions above operate on a single default file system, mounted
+ * with fs_mount(). Any number of file systems can also be mounted at once as
+ * handles with fsh_mount(), each one with its own disk, open files and
+ * caches, and no state shared with the others, so that different handles can
+ * be used from different threads without locking. Each fsh_* function below
+ * behaves and returns like the fs_* function of the same name, on file system
+ * @fs, and fails if @fs is NULL.
+ */
+struct fs;
+
+/**
+ * fsh_mount - Mount a file system as a handle
+ * @diskname: Name of the virtual disk file
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. Otherwise a new handle on the file system, which
+ * stays valid until fsh_umount() succeeds on it.
+ */
+struct fs *fsh_mount(const char *diskname);
+
+/**
+ * fsh_mount_ro - Mount a file system read-only as a handle
+ * @diskname: Name of the virtual disk file
+ *
+ * Return: Same as fsh_mount(), the file system being mounted as with
+ * fs_mount_ro().
+ */
+struct fs *fsh_mount_ro(const char *diskname);
+
+/**
+ * fsh_umount - Unmount a file system handle
+ * @fs: File system handle
+ *
+ * Return: Same as fs_umount(). On success, @fs is freed.
+ */
+int fsh_umount(struct fs *fs);
+
+int fsh_info(struct fs *fs);
+int fsh_create(struct fs *fs, const char *filename);
+int fsh_delete(struct fs *fs, const char *filename);
+int fsh_clone(struct fs *fs, const char *src, const char *dst);
+int fsh_ls(struct fs *fs);
+int fsh_lsdir(struct fs *fs, const char *dirname);
+int fsh_mkdir(struct fs *fs, const char *dirname);
+int fsh_rmdir(struct fs *fs, const char *dirname);
+int fsh_open(struct fs *fs, const char *filename);
+int fsh_close(struct fs *fs, int fd);
+int fsh_stat(struct fs *fs, int fd);
+int fsh_lseek(struct fs *fs, int fd, size_t offset);
+int fsh_write(struct fs *fs, int fd, void *buf, size_t count);
+int fsh_read(struct fs *fs, int fd, void *buf, size_t count);
+int fsh_dedup_mode(struct fs *fs, int enable);
+int fsh_dedup(struct fs *fs);
+int fsh_compress(struct fs *fs, const char *filename, int enable);
+int fsh_fraginfo(struct fs *fs);
+int fsh_defrag(struct fs *fs, int budget);
+int fsh_grow(struct fs *fs, int data_blocks);
+int fsh_trim(struct fs *fs);
+int fsh_reserve(struct fs *fs, int fd, size_t size);
+int fsh_readdir(struct fs *fs, const char *dirname, int index,
+		struct fs_dirent *dirent);
+int fsh_export_fd(struct fs *fs, int fd, int host_fd);
+int fsh_import_fd(struct fs *fs, int fd, int host_fd, size_t len);
+int fsh_stats(struct fs *fs, struct fs_stats *stats);
+int fsh_stats_reset(struct fs *fs);
+int fsh_heatmap_mode(struct fs *fs, int enable);
+int fsh_heatmap(struct fs *fs);
+
 #endif /* _FS_H */
@@ -0,0 +1,553 @@
+/*
+ * Client side of the fsd protocol. Each fs_* function of fs.h sends its
+ * request to the fsd server of the disk instead of running it, so that
+ * programs linked with libfsc.a instead of libfs.a use the file system served.
+ * fs_mount() connects to the socket of the disk, or to the one named by
+ * environment variable FSD_SOCKET, and fs_umount() disconnects. The fsh_*
+ * functions are not provided.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fsd.h"
+#include "record.h"
+
+#define fsc_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Socket connected to the server, -1 if not mounted */
+static int fsc_sock = -1;
+
+/* Request being sent, its payload following its header */
+static uint8_t fsc_buf[sizeof(struct fsd_request) + FSD_IO_MAX];
+static uint8_t *const fsc_payload = fsc_buf + sizeof(struct fsd_request);
+
+static int fsc_send(const void *buf, size_t size)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		ssize_t ret = send(fsc_sock, (const uint8_t *)buf + pos,
+				   size - pos, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+	}
+
+	return 0;
+}
+
+static int fsc_receive(void *buf, size_t size)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		ssize_t ret = read(fsc_sock, (uint8_t *)buf + pos, size - pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+	}
+
+	return 0;
+}
+
+static void fsc_lost(void)
+{
+	fsc_error("connection to server lost");
+	close(fsc_sock);
+	fsc_sock = -1;
+}
+
+/* Sends request @op with @size bytes of payload already in fsc_payload */
+static int fsc_request(int op, int arg, size_t count, size_t size)
+{
+	struct fsd_request req = { size, op, 0, arg, count };
+
+	if (fsc_sock < 0)
+		return -1;
+
+	memcpy(fsc_buf, &req, sizeof(req));
+	if (fsc_send(fsc_buf, sizeof(req) + size)) {
+		fsc_lost();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Receives the reply to the oldest request sent, and returns its result. The
+ * reply's payload, up to @count bytes, is read into @buf, or printed if @buf
+ * is NULL.
+ */
+static int fsc_reply(size_t count, void *buf)
+{
+	struct fsd_reply reply;
+
+	if (fsc_sock < 0)
+		return -1;
+
+	if (fsc_receive(&reply, sizeof(reply)))
+		goto lost;
+
+	if (buf) {
+		if (reply.size > count || fsc_receive(buf, reply.size))
+			goto lost;
+	} else {
+		for (size_t pos = 0, len; pos < reply.size; pos += len) {
+			len = reply.size - pos;
+			if (len > FSD_IO_MAX)
+				len = FSD_IO_MAX;
+			if (fsc_receive(fsc_payload, len))
+				goto lost;
+			fwrite(fsc_payload, 1, len, stdout);
+		}
+	}
+
+	return reply.ret;
+
+lost:
+	fsc_lost();
+	return -1;
+}
+
+/* Sends request @op and returns the result, as fsc_request() and fsc_reply() */
+static int fsc_call(int op, int arg, size_t count, size_t size, void *buf)
+{
+	if (fsc_request(op, arg, count, size))
+		return -1;
+
+	return fsc_reply(count, buf);
+}
+
+/* Sends request @op on names @name1 and @name2 (if not NULL) */
+static int fsc_call_names(int op, int arg, const char *name1,
+			  const char *name2)
+{
+	size_t size = 0;
+
+	for (int i = 0; i < 2; i++) {
+		const char *name = i ? name2 : name1;
+		size_t len;
+
+		if (!name) {
+			if (!i)
+				return -1;
+			break;
+		}
+
+		len = strlen(name) + 1;
+		if (size + len > FSD_IO_MAX)
+			return -1;
+		memcpy(fsc_payload + size, name, len);
+		size += len;
+	}
+
+	return fsc_call(op, arg, 0, size, NULL);
+}
+
+static int fsc_mount(const char *diskname, int readonly)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *sockname = getenv(FSD_SOCKET_ENV);
+
+	if (fsc_sock >= 0 || !diskname)
+		return -1;
+
+	if (sockname)
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sockname);
+	else if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%s",
+			  diskname, FSD_SOCKET_SUFFIX) >=
+		 (int)sizeof(addr.sun_path))
+		return -1;
+
+	if ((fsc_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fsc_sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("connect");
+		close(fsc_sock);
+		fsc_sock = -1;
+		return -1;
+	}
+
+	if (fsc_call(FSD_MOUNT, readonly, 0, 0, NULL)) {
+		if (fsc_sock >= 0)
+			close(fsc_sock);
+		fsc_sock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int fs_format(const char *diskname, int data_blocks,
+	      const struct fs_format_options *options)
+{
+	(void)diskname;
+	(void)data_blocks;
+	(void)options;
+	fsc_error("not available through fsd");
+	return -1;
+}
+
+int fs_stripe(const char *diskname, const char **members, int count, int unit)
+{
+	(void)diskname;
+	(void)members;
+	(void)count;
+	(void)unit;
+	fsc_error("not available through fsd");
+	return -1;
+}
+
+int fs_mount(const char *diskname)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_mount(diskname, 0);
+
+	record_end(start, RECORD_MOUNT, diskname, -1, 0, ret);
+	return ret;
+}
+
+int fs_mount_ro(const char *diskname)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_mount(diskname, 1);
+
+	record_end(start, RECORD_MOUNT, diskname, -1, 0, ret);
+	return ret;
+}
+
+int fs_umount(void)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_call(FSD_UMOUNT, 0, 0, 0, NULL);
+
+	record_end(start, RECORD_UMOUNT, NULL, -1, 0, ret);
+	if (ret)
+		return -1;
+
+	close(fsc_sock);
+	fsc_sock = -1;
+	return 0;
+}
+
+int fs_info(void)
+{
+	return fsc_call(FSD_INFO, 0, 0, 0, NULL);
+}
+
+int fs_create(const char *filename)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_call_names(FSD_CREATE, 0, filename, NULL);
+
+	record_end(start, RECORD_CREATE, filename, -1, 0, ret);
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_call_names(FSD_DELETE, 0, filename, NULL);
+
+	record_end(start, RECORD_DELETE, filename, -1, 0, ret);
+	return ret;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	if (!dst)
+		return -1;
+	return fsc_call_names(FSD_CLONE, 0, src, dst);
+}
+
+int fs_ls(void)
+{
+	return fsc_call(FSD_LS, 0, 0, 0, NULL);
+}
+
+int fs_lsdir(const char *dirname)
+{
+	return fsc_call_names(FSD_LSDIR, 0, dirname, NULL);
+}
+
+int fs_mkdir(const char *dirname)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_call_names(FSD_MKDIR, 0, dirname, NULL);
+
+	record_end(start, RECORD_MKDIR, dirname, -1, 0, ret);
+	return ret;
+}
+
+int fs_rmdir(const char *dirname)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_call_names(FSD_RMDIR, 0, dirname, NULL);
+
+	record_end(start, RECORD_RMDIR, dirname, -1, 0, ret);
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_call_names(FSD_OPEN, 0, filename, NULL);
+
+	record_end(start, RECORD_OPEN, filename, -1, 0, ret);
+	return ret;
+}
+
+int fs_close(int fd)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_call(FSD_CLOSE, fd, 0, 0, NULL);
+
+	record_end(start, RECORD_CLOSE, NULL, fd, 0, ret);
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	return fsc_call(FSD_STAT, fd, 0, 0, NULL);
+}
+
+static int fsc_lseek(int fd, size_t offset)
+{
+	if (offset > UINT32_MAX)
+		return -1;
+	return fsc_call(FSD_LSEEK, fd, offset, 0, NULL);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_lseek(fd, offset);
+
+	record_end(start, RECORD_SEEK, NULL, fd, offset, ret);
+	return ret;
+}
+
+static int fsc_write(int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+
+	if (!buf)
+		return -1;
+
+	// Large writes are sent in several requests
+	do {
+		size_t size = count - done < FSD_IO_MAX ? count - done : FSD_IO_MAX;
+		int ret;
+
+		memcpy(fsc_payload, (uint8_t *)buf + done, size);
+		if ((ret = fsc_call(FSD_WRITE, fd, 0, size, NULL)) < 0)
+			return done ? (int)done : -1;
+		done += ret;
+		if ((size_t)ret < size)
+			break;
+	} while (done < count);
+
+	return done;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_write(fd, buf, count);
+
+	record_end(start, RECORD_WRITE, NULL, fd, count, ret);
+	return ret;
+}
+
+static int fsc_read(int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+
+	if (!buf)
+		return -1;
+
+	// Large reads are sent in several requests
+	do {
+		size_t size = count - done < FSD_IO_MAX ? count - done : FSD_IO_MAX;
+		int ret;
+
+		ret = fsc_call(FSD_READ, fd, size, 0, (uint8_t *)buf + done);
+		if (ret < 0)
+			return done ? (int)done : -1;
+		done += ret;
+		if ((size_t)ret < size)
+			break;
+	} while (done < count);
+
+	return done;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_read(fd, buf, count);
+
+	record_end(start, RECORD_READ, NULL, fd, count, ret);
+	return ret;
+}
+
+int fs_dedup_mode(int enable)
+{
+	return fsc_call(FSD_DEDUP_MODE, enable, 0, 0, NULL);
+}
+
+int fs_dedup(void)
+{
+	return fsc_call(FSD_DEDUP, 0, 0, 0, NULL);
+}
+
+int fs_compress(const char *filename, int enable)
+{
+	return fsc_call_names(FSD_COMPRESS, enable, filename, NULL);
+}
+
+int fs_fraginfo(void)
+{
+	return fsc_call(FSD_FRAGINFO, 0, 0, 0, NULL);
+}
+
+int fs_defrag(int budget)
+{
+	return fsc_call(FSD_DEFRAG, budget, 0, 0, NULL);
+}
+
+int fs_grow(int data_blocks)
+{
+	return fsc_call(FSD_GROW, data_blocks, 0, 0, NULL);
+}
+
+int fs_trim(void)
+{
+	return fsc_call(FSD_TRIM, 0, 0, 0, NULL);
+}
+
+int fs_reserve(int fd, size_t size)
+{
+	if (size > UINT32_MAX)
+		return -1;
+	return fsc_call(FSD_RESERVE, fd, size, 0, NULL);
+}
+
+/*
+ * Host files are copied through the client, the server being unable to reach
+ * them. Each chunk is requested before the previous one is written to the host
+ * file, so that the server reads a chunk while the client writes the other:
+ * memory stays bounded by two chunks whatever the size of the file.
+ */
+static int fsc_export_fd(int fd, int host_fd)
+{
+	static uint8_t chunks[2][FSD_IO_MAX];
+	size_t done = 0;
+	int count = -1, cur = 0;
+	int pending = !fsc_request(FSD_READ, fd, FSD_IO_MAX, 0);
+
+	while (pending) {
+		count = fsc_reply(FSD_IO_MAX, chunks[cur]);
+		pending = count == FSD_IO_MAX &&
+			  !fsc_request(FSD_READ, fd, FSD_IO_MAX, 0);
+		if (count <= 0)
+			break;
+
+		for (int out = 0, ret; out < count; out += ret) {
+			if ((ret = write(host_fd, chunks[cur] + out,
+					 count - out)) <= 0) {
+				// The chunk requested ahead is dropped
+				if (pending)
+					fsc_reply(FSD_IO_MAX, chunks[!cur]);
+				return done ? (int)done : -1;
+			}
+		}
+		done += count;
+		cur = !cur;
+	}
+
+	return done || count == 0 ? (int)done : -1;
+}
+
+int fs_export_fd(int fd, int host_fd)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_export_fd(fd, host_fd);
+
+	// The rest of the file is read, whatever its size
+	record_end(start, RECORD_READ, NULL, fd, ret < 0 ? 0 : ret, ret);
+	return ret;
+}
+
+static int fsc_import_fd(int fd, int host_fd, size_t len)
+{
+	size_t done = 0;
+	ssize_t count = 0;
+
+	while (done < len) {
+		size_t size = len - done < FSD_IO_MAX ? len - done : FSD_IO_MAX;
+
+		if ((count = read(host_fd, fsc_payload, size)) < 0 && errno == EINTR)
+			continue;
+		if (count <= 0 ||
+		    (count = fsc_call(FSD_WRITE, fd, 0, count, NULL)) <= 0)
+			break;
+		done += count;
+	}
+
+	return done || count >= 0 ? (int)done : -1;
+}
+
+int fs_import_fd(int fd, int host_fd, size_t len)
+{
+	uint64_t start = record_begin();
+	int ret = fsc_import_fd(fd, host_fd, len);
+
+	record_end(start, RECORD_WRITE, NULL, fd, len, ret);
+	return ret;
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+	if (!stats)
+		return -1;
+	return fsc_call(FSD_STATS, 0, sizeof(*stats), 0, stats);
+}
+
+int fs_stats_reset(void)
+{
+	return fsc_call(FSD_STATS_RESET, 0, 0, 0, NULL);
+}
+
+int fs_heatmap_mode(int enable)
+{
+	return fsc_call(FSD_HEATMAP_MODE, enable, 0, 0, NULL);
+}
+
+int fs_heatmap(void)
+{
+	return fsc_call(FSD_HEATMAP, 0, 0, 0, NULL);
+}
+
+int fs_readdir(const char *dirname, int index, struct fs_dirent *dirent)
+{
+	size_t len;
+
+	if (!dirname || !dirent || (len = strlen(dirname) + 1) > FSD_IO_MAX)
+		return -1;
+
+	memcpy(fsc_payload, dirname, len);
+	return fsc_call(FSD_READDIR, index, sizeof(*dirent), len, dirent);
+}
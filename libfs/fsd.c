@@ -0,0 +1,496 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fsd.h"
+
+#define fsd_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Size of a client's input buffer, which holds at least a whole request */
+#define FSD_IN_SIZE (sizeof(struct fsd_request) + FSD_IO_MAX)
+
+/* Bytes of replies queued for a client past which its requests are left
+   waiting until it reads them */
+#define FSD_OUT_MAX (4 * FSD_IN_SIZE)
+
+/* Connected client */
+struct fsd_client {
+	/* Socket, -1 if the slot is free */
+	int sock;
+	/* Whether the client mounted, and whether read-only */
+	bool mounted;
+	bool readonly;
+	/* File descriptors opened by the client, as a bit mask */
+	uint32_t fds;
+	/* Bytes received and not yet run */
+	uint8_t *in;
+	size_t in_len;
+	/* Replies not yet sent */
+	uint8_t *out;
+	size_t out_len;
+	size_t out_cap;
+};
+
+/* Server state */
+struct fsd_server {
+	struct fs *fs;
+	/* Temporary file catching what operations print */
+	FILE *capture;
+	struct fsd_client clients[FSD_CLIENT_MAX];
+};
+
+/* Operations that modify the file system */
+static const bool fsd_modifies[FSD_OP_COUNT] = {
+	[FSD_CREATE] = true,
+	[FSD_DELETE] = true,
+	[FSD_CLONE] = true,
+	[FSD_MKDIR] = true,
+	[FSD_RMDIR] = true,
+	[FSD_WRITE] = true,
+	[FSD_DEDUP_MODE] = true,
+	[FSD_DEDUP] = true,
+	[FSD_COMPRESS] = true,
+	[FSD_DEFRAG] = true,
+	[FSD_GROW] = true,
+	[FSD_TRIM] = true,
+	[FSD_RESERVE] = true,
+};
+
+/* Operations whose output is sent back to the client */
+static const bool fsd_prints[FSD_OP_COUNT] = {
+	[FSD_INFO] = true,
+	[FSD_LS] = true,
+	[FSD_LSDIR] = true,
+	[FSD_FRAGINFO] = true,
+	[FSD_HEATMAP] = true,
+};
+
+/* Makes room for @size more bytes of replies to @c */
+static uint8_t *fsd_reserve(struct fsd_client *c, size_t size)
+{
+	if (c->out_len + size > c->out_cap) {
+		size_t cap = c->out_cap ? c->out_cap : FSD_IN_SIZE;
+		uint8_t *out;
+
+		while (cap < c->out_len + size)
+			cap *= 2;
+		if ((out = realloc(c->out, cap)) == NULL)
+			return NULL;
+		c->out = out;
+		c->out_cap = cap;
+	}
+
+	return c->out + c->out_len;
+}
+
+/* Sends as much of the replies queued for @c as its socket takes without
+   waiting, returns -1 if the client is gone */
+static int fsd_flush(struct fsd_client *c)
+{
+	size_t pos = 0;
+
+	while (pos < c->out_len) {
+		ssize_t ret = send(c->sock, c->out + pos, c->out_len - pos,
+				   MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret <= 0)
+			return -1;
+		pos += ret;
+	}
+	if (pos) {
+		memmove(c->out, c->out + pos, c->out_len - pos);
+		c->out_len -= pos;
+	}
+
+	return 0;
+}
+
+/* Splits @size bytes of @payload in @count NULL-terminated names */
+static int fsd_names(uint8_t *payload, size_t size, const char **names,
+		     int count)
+{
+	size_t pos = 0;
+
+	for (int i = 0; i < count; i++) {
+		uint8_t *end = memchr(payload + pos, '\0', size - pos);
+		if (end == NULL)
+			return -1;
+		names[i] = (const char *)payload + pos;
+		pos = end - payload + 1;
+	}
+
+	return 0;
+}
+
+/* Whether @fd was opened by @c */
+static bool fsd_owns(struct fsd_client *c, int fd)
+{
+	return fd >= 0 && fd < FS_OPEN_MAX_COUNT && (c->fds & (1u << fd));
+}
+
+/* Runs request @req of @c with its @payload, and adds its reply */
+static int fsd_run(struct fsd_server *srv, struct fsd_client *c,
+		   struct fsd_request *req, uint8_t *payload)
+{
+	struct fsd_reply reply = { 0 };
+	const char *names[2];
+	struct fs_dirent dirent;
+	struct fs_stats stats;
+	int captured = -1, saved = -1;
+	uint8_t *data;
+	int ret = -1;
+
+	// Replies are laid out unaligned, their headers being copied in place,
+	// with room for the largest fixed-size payload
+	if (!fsd_reserve(c, sizeof(reply) + sizeof(struct fs_stats) +
+			 (req->op == FSD_READ ? req->count : 0)))
+		return -1;
+	data = c->out + c->out_len + sizeof(reply);
+
+	// Mounting is the first request of a client
+	if (req->op >= FSD_OP_COUNT || (!c->mounted && req->op != FSD_MOUNT) ||
+	    (c->readonly && fsd_modifies[req->op]))
+		goto done;
+
+	// Operations print to the temporary file instead of stdout
+	if (fsd_prints[req->op]) {
+		captured = fileno(srv->capture);
+		fflush(stdout);
+		if (ftruncate(captured, 0) || lseek(captured, 0, SEEK_SET) ||
+		    (saved = dup(STDOUT_FILENO)) < 0 ||
+		    dup2(captured, STDOUT_FILENO) < 0) {
+			perror("capture");
+			if (saved >= 0)
+				close(saved);
+			goto done;
+		}
+	}
+
+	switch (req->op) {
+	case FSD_MOUNT:
+		if (!c->mounted) {
+			c->mounted = true;
+			c->readonly = req->arg;
+			ret = 0;
+		}
+		break;
+	case FSD_UMOUNT:
+		// Files must be closed first, as with fs_umount()
+		if (!c->fds) {
+			c->mounted = false;
+			ret = 0;
+		}
+		break;
+	case FSD_INFO:
+		ret = fsh_info(srv->fs);
+		break;
+	case FSD_LS:
+		ret = fsh_ls(srv->fs);
+		break;
+	case FSD_FRAGINFO:
+		ret = fsh_fraginfo(srv->fs);
+		break;
+	case FSD_DEDUP_MODE:
+		ret = fsh_dedup_mode(srv->fs, req->arg);
+		break;
+	case FSD_DEDUP:
+		ret = fsh_dedup(srv->fs);
+		break;
+	case FSD_DEFRAG:
+		ret = fsh_defrag(srv->fs, req->arg);
+		break;
+	case FSD_GROW:
+		ret = fsh_grow(srv->fs, req->arg);
+		break;
+	case FSD_TRIM:
+		ret = fsh_trim(srv->fs);
+		break;
+	case FSD_STATS:
+		if ((ret = fsh_stats(srv->fs, &stats)) == 0) {
+			memcpy(data, &stats, sizeof(stats));
+			reply.size = sizeof(stats);
+		}
+		break;
+	case FSD_STATS_RESET:
+		ret = fsh_stats_reset(srv->fs);
+		break;
+	case FSD_HEATMAP_MODE:
+		ret = fsh_heatmap_mode(srv->fs, req->arg);
+		break;
+	case FSD_HEATMAP:
+		ret = fsh_heatmap(srv->fs);
+		break;
+	case FSD_CREATE:
+	case FSD_DELETE:
+	case FSD_LSDIR:
+	case FSD_MKDIR:
+	case FSD_RMDIR:
+	case FSD_OPEN:
+	case FSD_COMPRESS:
+		if (fsd_names(payload, req->size, names, 1))
+			break;
+		if (req->op == FSD_CREATE)
+			ret = fsh_create(srv->fs, names[0]);
+		else if (req->op == FSD_DELETE)
+			ret = fsh_delete(srv->fs, names[0]);
+		else if (req->op == FSD_LSDIR)
+			ret = fsh_lsdir(srv->fs, names[0]);
+		else if (req->op == FSD_MKDIR)
+			ret = fsh_mkdir(srv->fs, names[0]);
+		else if (req->op == FSD_RMDIR)
+			ret = fsh_rmdir(srv->fs, names[0]);
+		else if (req->op == FSD_COMPRESS)
+			ret = fsh_compress(srv->fs, names[0], req->arg);
+		else if ((ret = fsh_open(srv->fs, names[0])) >= 0)
+			c->fds |= 1u << ret;
+		break;
+	case FSD_CLONE:
+		if (!fsd_names(payload, req->size, names, 2))
+			ret = fsh_clone(srv->fs, names[0], names[1]);
+		break;
+	case FSD_READDIR:
+		if (!fsd_names(payload, req->size, names, 1) &&
+		    (ret = fsh_readdir(srv->fs, names[0], req->arg, &dirent)) > 0) {
+			memcpy(data, &dirent, sizeof(dirent));
+			reply.size = sizeof(dirent);
+		}
+		break;
+	case FSD_CLOSE:
+	case FSD_STAT:
+	case FSD_LSEEK:
+	case FSD_WRITE:
+	case FSD_READ:
+	case FSD_RESERVE:
+		// Files opened by other clients are out of reach
+		if (!fsd_owns(c, req->arg))
+			break;
+		if (req->op == FSD_CLOSE) {
+			if ((ret = fsh_close(srv->fs, req->arg)) == 0)
+				c->fds &= ~(1u << req->arg);
+		} else if (req->op == FSD_STAT)
+			ret = fsh_stat(srv->fs, req->arg);
+		else if (req->op == FSD_LSEEK)
+			ret = fsh_lseek(srv->fs, req->arg, req->count);
+		else if (req->op == FSD_WRITE)
+			ret = fsh_write(srv->fs, req->arg, payload, req->size);
+		else if (req->op == FSD_RESERVE)
+			ret = fsh_reserve(srv->fs, req->arg, req->count);
+		else if ((ret = fsh_read(srv->fs, req->arg, data,
+					 req->count)) > 0)
+			reply.size = ret;
+		break;
+	}
+
+	// Send back what was printed
+	if (captured >= 0) {
+		fflush(stdout);
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+
+		off_t size = lseek(captured, 0, SEEK_CUR);
+		if (size > 0 && fsd_reserve(c, sizeof(reply) + size)) {
+			data = c->out + c->out_len + sizeof(reply);
+			if (pread(captured, data, size, 0) == size)
+				reply.size = size;
+		}
+	}
+
+done:
+	reply.ret = ret;
+	memcpy(c->out + c->out_len, &reply, sizeof(reply));
+	c->out_len += sizeof(reply) + reply.size;
+
+	return 0;
+}
+
+/* Disconnects @c, closing the files it left open */
+static void fsd_drop(struct fsd_server *srv, struct fsd_client *c)
+{
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++) {
+		if (fsd_owns(c, fd))
+			fsh_close(srv->fs, fd);
+	}
+
+	close(c->sock);
+	free(c->in);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->sock = -1;
+}
+
+/* Runs the complete requests received from @c while its queued replies are
+   under FSD_OUT_MAX, and sends the replies. Returns -1 to drop the client. */
+static int fsd_process(struct fsd_server *srv, struct fsd_client *c)
+{
+	struct fsd_request req;
+	size_t pos;
+
+	// Pipelined requests are all run before replying, as long as the
+	// client keeps reading its replies: those sent make room for the
+	// requests left waiting
+	do {
+		if (fsd_flush(c))
+			return -1;
+
+		pos = 0;
+		while (c->out_len < FSD_OUT_MAX &&
+		       c->in_len - pos >= sizeof(req)) {
+			memcpy(&req, c->in + pos, sizeof(req));
+			if (req.size > FSD_IO_MAX ||
+			    (req.op == FSD_READ && req.count > FSD_IO_MAX))
+				return -1;
+			if (c->in_len - pos < sizeof(req) + req.size)
+				break;
+
+			if (fsd_run(srv, c, &req, c->in + pos + sizeof(req)))
+				return -1;
+			pos += sizeof(req) + req.size;
+		}
+		memmove(c->in, c->in + pos, c->in_len - pos);
+		c->in_len -= pos;
+	} while (pos);
+
+	return 0;
+}
+
+/* Reads what @c sent and runs it, returns -1 to drop the client */
+static int fsd_receive(struct fsd_server *srv, struct fsd_client *c)
+{
+	ssize_t ret;
+
+	ret = read(c->sock, c->in + c->in_len, FSD_IN_SIZE - c->in_len);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN ||
+			errno == EWOULDBLOCK))
+		return 0;
+	if (ret <= 0)
+		return -1;
+	c->in_len += ret;
+
+	return fsd_process(srv, c);
+}
+
+/* Accepts a new client on listening socket @sock */
+static void fsd_accept(struct fsd_server *srv, int sock)
+{
+	int client = accept(sock, NULL, NULL);
+
+	if (client < 0)
+		return;
+
+	// Replies are sent as the client takes them, so that a client that
+	// does not read them never holds up the others
+	if (fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		close(client);
+		return;
+	}
+
+	for (int i = 0; i < FSD_CLIENT_MAX; i++) {
+		struct fsd_client *c = &srv->clients[i];
+		if (c->sock >= 0)
+			continue;
+		if ((c->in = malloc(FSD_IN_SIZE)) == NULL)
+			break;
+		c->sock = client;
+		return;
+	}
+
+	fsd_error("too many clients");
+	close(client);
+}
+
+int fsd_serve(struct fs *fs, const char *sockname)
+{
+	struct fsd_server srv = { .fs = fs };
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct pollfd fds[FSD_CLIENT_MAX + 1];
+	int sock;
+
+	if (!fs || !sockname || strlen(sockname) >= sizeof(addr.sun_path)) {
+		fsd_error("invalid socket name");
+		return -1;
+	}
+	strcpy(addr.sun_path, sockname);
+
+	if ((srv.capture = tmpfile()) == NULL) {
+		perror("tmpfile");
+		return -1;
+	}
+
+	unlink(sockname);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, FSD_CLIENT_MAX)) {
+		perror("socket");
+		if (sock >= 0)
+			close(sock);
+		fclose(srv.capture);
+		return -1;
+	}
+
+	for (int i = 0; i < FSD_CLIENT_MAX; i++)
+		srv.clients[i].sock = -1;
+
+	// Serve until a signal interrupts the wait
+	for (;;) {
+		int count = 0;
+
+		fds[count++] = (struct pollfd){ .fd = sock, .events = POLLIN };
+		for (int i = 0; i < FSD_CLIENT_MAX; i++) {
+			struct fsd_client *c = &srv.clients[i];
+
+			// Requests of clients with too many replies queued
+			// are left unread until the replies are sent
+			fds[count++] = (struct pollfd){ .fd = c->sock,
+				.events = (c->out_len < FSD_OUT_MAX ? POLLIN : 0) |
+					  (c->out_len ? POLLOUT : 0) };
+		}
+
+		if (poll(fds, count, -1) < 0) {
+			if (errno != EINTR)
+				perror("poll");
+			break;
+		}
+
+		if (fds[0].revents & POLLIN)
+			fsd_accept(&srv, sock);
+		for (int i = 0; i < FSD_CLIENT_MAX; i++) {
+			struct fsd_client *c = &srv.clients[i];
+			short revents = fds[i + 1].revents;
+
+			if (c->sock < 0 || !revents)
+				continue;
+			// Sending replies may let the requests left waiting run
+			if (revents & POLLOUT && fsd_process(&srv, c))
+				fsd_drop(&srv, c);
+			else if (c->out_len < FSD_OUT_MAX &&
+				 revents & (POLLIN | POLLHUP | POLLERR) &&
+				 fsd_receive(&srv, c))
+				fsd_drop(&srv, c);
+			else if (c->out_len >= FSD_OUT_MAX &&
+				 revents & (POLLHUP | POLLERR))
+				fsd_drop(&srv, c);
+		}
+	}
+
+	for (int i = 0; i < FSD_CLIENT_MAX; i++) {
+		if (srv.clients[i].sock >= 0)
+			fsd_drop(&srv, &srv.clients[i]);
+	}
+	close(sock);
+	unlink(sockname);
+	fclose(srv.capture);
+
+	return 0;
+}
@@ -0,0 +1,113 @@
+#ifndef _FSD_H
+#define _FSD_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/** Suffix appended to a disk name to get the socket its server listens on */
+#define FSD_SOCKET_SUFFIX ".sock"
+
+/** Environment variable overriding the socket clients connect to */
+#define FSD_SOCKET_ENV "FSD_SOCKET"
+
+/** Maximum number of clients served at once */
+#define FSD_CLIENT_MAX 64
+
+/** Maximum number of bytes read or written by a single request */
+#define FSD_IO_MAX (256 * 1024)
+
+/**
+ * enum fsd_op - Operations of the fsd protocol
+ *
+ * Each operation but %FSD_MOUNT and %FSD_UMOUNT runs the fs_* function of the
+ * same name on the file system served.
+ */
+enum fsd_op {
+	FSD_MOUNT,
+	FSD_UMOUNT,
+	FSD_INFO,
+	FSD_CREATE,
+	FSD_DELETE,
+	FSD_CLONE,
+	FSD_LS,
+	FSD_LSDIR,
+	FSD_MKDIR,
+	FSD_RMDIR,
+	FSD_OPEN,
+	FSD_CLOSE,
+	FSD_STAT,
+	FSD_LSEEK,
+	FSD_WRITE,
+	FSD_READ,
+	FSD_DEDUP_MODE,
+	FSD_DEDUP,
+	FSD_COMPRESS,
+	FSD_FRAGINFO,
+	FSD_DEFRAG,
+	FSD_GROW,
+	FSD_TRIM,
+	FSD_RESERVE,
+	FSD_READDIR,
+	FSD_STATS,
+	FSD_STATS_RESET,
+	FSD_HEATMAP_MODE,
+	FSD_HEATMAP,
+	FSD_OP_COUNT
+};
+
+/**
+ * struct fsd_request - Request header of the fsd protocol
+ * @size: Number of payload bytes following the header
+ * @op: Operation, one of &enum fsd_op
+ * @flags: Unused, 0
+ * @arg: File descriptor, or integer argument of the operation
+ * @count: Offset of %FSD_LSEEK, size of %FSD_RESERVE, or number of bytes of
+ *         %FSD_READ
+ *
+ * The payload holds the NULL-terminated names taken by the operation, one
+ * after the other, or the bytes written by %FSD_WRITE. %FSD_MOUNT takes
+ * whether the client mounts read-only as @arg.
+ */
+struct fsd_request {
+	uint32_t size;
+	uint16_t op;
+	uint16_t flags;
+	int32_t arg;
+	uint32_t count;
+};
+
+/**
+ * struct fsd_reply - Reply header of the fsd protocol
+ * @size: Number of payload bytes following the header
+ * @ret: Return value of the operation
+ *
+ * The payload holds the bytes read by %FSD_READ, the &struct fs_dirent read
+ * by %FSD_READDIR, the &struct fs_stats of %FSD_STATS, or what the operation
+ * printed.
+ */
+struct fsd_reply {
+	uint32_t size;
+	int32_t ret;
+};
+
+/**
+ * fsd_serve - Serve a file system over a Unix domain socket
+ * @fs: File system handle
+ * @sockname: Name of the socket to listen on
+ *
+ * Serve file system @fs to local clients connecting to socket @sockname, which
+ * is replaced if it exists and removed on return. Each client sends requests
+ * and gets one reply per request, in order, so that it can send several
+ * requests before reading their replies. Every complete request received at
+ * once is run, and their replies sent back together as the client takes them.
+ * The requests of a client that leaves too many replies unread wait until it
+ * reads them, without holding up the other clients. Files opened by a client
+ * can only be used by that client, and are closed when it disconnects. Clients
+ * mounted read-only cannot modify the file system.
+ *
+ * Return: -1 if the socket cannot be created. 0 once interrupted by a signal.
+ */
+int fsd_serve(struct fs *fs, const char *sockname);
+
+#endif /* _FSD_H */
@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Shortest match worth encoding */
+#define LZ_MIN_MATCH 4
+
+/* Longest distance a match can reach back */
+#define LZ_MAX_OFFSET 65535
+
+/* Hash table of recently seen sequences */
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/* Token nibble meaning that the length continues in extra bytes */
+#define LZ_NIBBLE_MAX 15
+
+/* Fixed size of the copies of short literal runs */
+#define LZ_COPY_SIZE 16
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+
+	return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the extra bytes of a length that did not fit in its nibble. */
+static uint8_t *lz_put_length(uint8_t *op, uint8_t *end, size_t length)
+{
+	for (; length >= 255; length -= 255){
+		if (op >= end)
+			return NULL;
+		*op++ = 255;
+	}
+
+	if (op >= end)
+		return NULL;
+	*op++ = length;
+
+	return op;
+}
+
+/* Writes one sequence: literals followed by a match, or the final literals
+   alone when 'match' is 0. */
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *end,
+const uint8_t *literals, size_t literal_len, size_t offset, size_t match)
+{
+	size_t match_len = match ? match - LZ_MIN_MATCH : 0;
+	uint8_t token;
+
+	token = (literal_len < LZ_NIBBLE_MAX ? literal_len : LZ_NIBBLE_MAX) << 4;
+	token |= match_len < LZ_NIBBLE_MAX ? match_len : LZ_NIBBLE_MAX;
+
+	if (op >= end)
+		return NULL;
+	*op++ = token;
+
+	if (literal_len >= LZ_NIBBLE_MAX &&
+	!(op = lz_put_length(op, end, literal_len - LZ_NIBBLE_MAX)))
+		return NULL;
+
+	if ((size_t)(end - op) < literal_len)
+		return NULL;
+	memcpy(op, literals, literal_len);
+	op += literal_len;
+
+	if (!match)
+		return op;
+
+	if (end - op < 2)
+		return NULL;
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+
+	if (match_len >= LZ_NIBBLE_MAX &&
+	!(op = lz_put_length(op, end, match_len - LZ_NIBBLE_MAX)))
+		return NULL;
+
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+	const uint8_t *in = src;
+	uint8_t *op = dst, *end = op + dst_cap;
+	int32_t table[LZ_HASH_SIZE];
+	size_t ip = 0, anchor = 0;
+
+	if (src_len > LZ_MAX_INPUT)
+		return 0;
+
+	memset(table, 0xFF, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= src_len){
+		uint32_t sequence = lz_read32(in + ip);
+		uint32_t hash = lz_hash(sequence);
+		int32_t candidate = table[hash];
+
+		table[hash] = ip;
+
+		if (candidate < 0 || ip - candidate > LZ_MAX_OFFSET ||
+		lz_read32(in + candidate) != sequence){
+			ip++;
+			continue;
+		}
+
+		// Extend the match as far as it goes
+		size_t match = LZ_MIN_MATCH;
+		while (ip + match < src_len && in[candidate + match] == in[ip + match])
+			match++;
+
+		op = lz_put_sequence(op, end, in + anchor, ip - anchor,
+		ip - candidate, match);
+		if (!op)
+			return 0;
+
+		ip += match;
+		anchor = ip;
+	}
+
+	op = lz_put_sequence(op, end, in + anchor, src_len - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+/* Reads the extra bytes of a length that did not fit in its nibble. */
+static int lz_get_length(const uint8_t *in, size_t src_len, size_t *ip,
+size_t *length)
+{
+	uint8_t byte;
+
+	do {
+		if (*ip >= src_len)
+			return -1;
+		byte = in[(*ip)++];
+		*length += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+int lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+	const uint8_t *in = src;
+	uint8_t *out = dst;
+	size_t ip = 0, op = 0;
+
+	while (ip < src_len){
+		uint8_t token = in[ip++];
+		size_t literal_len = token >> 4;
+		size_t match_len = token & LZ_NIBBLE_MAX;
+		size_t offset;
+
+		// Literals
+		if (literal_len == LZ_NIBBLE_MAX &&
+		lz_get_length(in, src_len, &ip, &literal_len) == -1)
+			return -1;
+		if (literal_len > src_len - ip || literal_len > dst_cap - op)
+			return -1;
+		// Short runs are copied with a fixed size when both buffers allow
+		if (literal_len <= LZ_COPY_SIZE && src_len - ip >= LZ_COPY_SIZE &&
+		dst_cap - op >= LZ_COPY_SIZE)
+			memcpy(out + op, in + ip, LZ_COPY_SIZE);
+		else
+			memcpy(out + op, in + ip, literal_len);
+		ip += literal_len;
+		op += literal_len;
+
+		// The last sequence has no match
+		if (ip == src_len)
+			break;
+
+		// Match
+		if (src_len - ip < 2)
+			return -1;
+		offset = in[ip] | in[ip + 1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return -1;
+
+		if (match_len == LZ_NIBBLE_MAX &&
+		lz_get_length(in, src_len, &ip, &match_len) == -1)
+			return -1;
+		match_len += LZ_MIN_MATCH;
+		if (match_len > dst_cap - op)
+			return -1;
+
+		// Matches may overlap the bytes they produce, they are copied by
+		// words when each word is read before being overwritten
+		if (offset >= sizeof(uint64_t) &&
+		dst_cap - op >= match_len + sizeof(uint64_t))
+			for (size_t byte = 0; byte < match_len; byte += sizeof(uint64_t))
+				memcpy(out + op + byte, out + op + byte - offset,
+				sizeof(uint64_t));
+		else if (offset >= match_len)
+			memcpy(out + op, out + op - offset, match_len);
+		else
+			for (size_t byte = 0; byte < match_len; byte++)
+				out[op + byte] = out[op + byte - offset];
+		op += match_len;
+	}
+
+	return op;
+}
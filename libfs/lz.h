@@ -0,0 +1,42 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Maximum size of a buffer handled by the codec in one call */
+#define LZ_MAX_INPUT 65536
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data buffer to compress
+ * @src_len: Number of bytes in @src
+ * @dst: Data buffer to be filled with compressed data
+ * @dst_cap: Number of bytes available in @dst
+ *
+ * Compress the @src_len bytes of @src into @dst with a byte-oriented LZ77
+ * encoding: each sequence is made of a token byte holding the number of
+ * literals and the match length, the literals themselves, and a 16-bit offset
+ * to the earlier data the match copies. Matches are found with a single hash
+ * table lookup per position, trading ratio for speed.
+ *
+ * Return: 0 if @src_len exceeds %LZ_MAX_INPUT or if the compressed data does
+ * not fit in @dst_cap bytes. Otherwise return the size of the compressed data.
+ */
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed data buffer
+ * @src_len: Number of bytes in @src
+ * @dst: Data buffer to be filled with decompressed data
+ * @dst_cap: Number of bytes available in @dst
+ *
+ * Decompress data produced by lz_compress() from @src into @dst.
+ *
+ * Return: -1 if @src is not valid compressed data or if the decompressed data
+ * does not fit in @dst_cap bytes. Otherwise return the size of the
+ * decompressed data.
+ */
+int lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,212 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "record.h"
+
+#define record_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* First bytes of a recording, which then holds a record_entry per call */
+#define RECORD_MAGIC "FSREC001"
+
+/* Recorded call as written to the recording, in host byte order, followed by
+   'name_len' bytes of name */
+struct __attribute__((__packed__)) record_entry {
+	uint8_t op;
+	uint8_t name_len;
+	int16_t fd;
+	int32_t ret;
+	uint32_t offset;
+	uint32_t count;
+	uint64_t start;
+	uint32_t duration;
+};
+
+const char *const record_op_names[RECORD_OP_COUNT] = {
+	[RECORD_MOUNT] = "MOUNT",
+	[RECORD_UMOUNT] = "UMOUNT",
+	[RECORD_CREATE] = "CREATE",
+	[RECORD_DELETE] = "DELETE",
+	[RECORD_MKDIR] = "MKDIR",
+	[RECORD_RMDIR] = "RMDIR",
+	[RECORD_OPEN] = "OPEN",
+	[RECORD_CLOSE] = "CLOSE",
+	[RECORD_SEEK] = "SEEK",
+	[RECORD_WRITE] = "WRITE",
+	[RECORD_READ] = "READ",
+};
+
+int record_enabled;
+
+/* Recording file and time recording started at, both protected by
+   record_lock as calls can be recorded by several threads */
+static FILE *record_file;
+static uint64_t record_origin;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Offset of each file descriptor, followed from the calls recorded as the
+   file system is not asked for them */
+static uint32_t record_offsets[FS_OPEN_MAX_COUNT];
+
+uint64_t record_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int record_start(const char *filename)
+{
+	FILE *f;
+
+	if (record_file) {
+		record_error("already recording");
+		return -1;
+	}
+
+	if (!filename || !(f = fopen(filename, "w"))) {
+		perror("fopen");
+		return -1;
+	}
+	if (fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), f) !=
+	    strlen(RECORD_MAGIC)) {
+		perror("fwrite");
+		fclose(f);
+		return -1;
+	}
+
+	pthread_mutex_lock(&record_lock);
+	record_file = f;
+	record_origin = record_now();
+	memset(record_offsets, 0, sizeof(record_offsets));
+	pthread_mutex_unlock(&record_lock);
+	__atomic_store_n(&record_enabled, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int record_stop(void)
+{
+	FILE *f;
+
+	__atomic_store_n(&record_enabled, 0, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&record_lock);
+	f = record_file;
+	record_file = NULL;
+	pthread_mutex_unlock(&record_lock);
+
+	if (!f)
+		return -1;
+	if (fclose(f)) {
+		perror("fclose");
+		return -1;
+	}
+
+	return 0;
+}
+
+void record_call(uint64_t start, enum record_op op, const char *name, int fd,
+		 uint32_t count, int ret)
+{
+	uint64_t end = record_now();
+	struct record_entry entry = {
+		.op = op,
+		.fd = fd,
+		.ret = ret,
+		.count = count,
+		.duration = end - start > UINT32_MAX ? UINT32_MAX : end - start,
+	};
+	size_t len = name ? strnlen(name, RECORD_NAME_MAX) : 0;
+	int valid = fd >= 0 && fd < FS_OPEN_MAX_COUNT;
+
+	pthread_mutex_lock(&record_lock);
+	if (!record_file) {
+		pthread_mutex_unlock(&record_lock);
+		return;
+	}
+
+	entry.start = start > record_origin ? start - record_origin : 0;
+	entry.name_len = len;
+
+	switch (op) {
+	case RECORD_MOUNT:
+	case RECORD_UMOUNT:
+		memset(record_offsets, 0, sizeof(record_offsets));
+		break;
+	case RECORD_OPEN:
+		// The file descriptor recorded is the one returned
+		entry.fd = ret;
+		if (ret >= 0 && ret < FS_OPEN_MAX_COUNT)
+			record_offsets[ret] = 0;
+		break;
+	case RECORD_SEEK:
+		entry.offset = valid ? record_offsets[fd] : 0;
+		if (valid && ret == 0)
+			record_offsets[fd] = count;
+		break;
+	case RECORD_WRITE:
+	case RECORD_READ:
+		entry.offset = valid ? record_offsets[fd] : 0;
+		if (valid && ret > 0)
+			record_offsets[fd] += ret;
+		break;
+	default:
+		break;
+	}
+
+	if (fwrite(&entry, sizeof(entry), 1, record_file) != 1 ||
+	    (len && fwrite(name, 1, len, record_file) != len)) {
+		// Stop on the first error rather than leave a hole in the recording
+		perror("fwrite");
+		__atomic_store_n(&record_enabled, 0, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&record_lock);
+}
+
+FILE *record_open(const char *filename)
+{
+	char magic[sizeof(RECORD_MAGIC)] = "";
+	FILE *f;
+
+	if (!filename || !(f = fopen(filename, "r")))
+		return NULL;
+
+	if (fread(magic, 1, strlen(RECORD_MAGIC), f) != strlen(RECORD_MAGIC) ||
+	    strcmp(magic, RECORD_MAGIC)) {
+		fclose(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+int record_next(FILE *f, struct record *rec)
+{
+	struct record_entry entry;
+	size_t n;
+
+	n = fread(&entry, 1, sizeof(entry), f);
+	if (n == 0 && feof(f))
+		return 0;
+	if (n != sizeof(entry) || entry.op >= RECORD_OP_COUNT ||
+	    fread(rec->name, 1, entry.name_len, f) != entry.name_len) {
+		record_error("truncated or corrupted recording");
+		return -1;
+	}
+
+	rec->op = entry.op;
+	rec->fd = entry.fd;
+	rec->ret = entry.ret;
+	rec->offset = entry.offset;
+	rec->count = entry.count;
+	rec->start = entry.start;
+	rec->duration = entry.duration;
+	rec->name[entry.name_len] = '\0';
+
+	return 1;
+}
@@ -0,0 +1,134 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Maximum length of the file or disk names kept by records, the longer ones
+ *  being truncated */
+#define RECORD_NAME_MAX 255
+
+/**
+ * enum record_op - Operation of a recorded call
+ *
+ * The operations are the commands of the scripts run by test_fs, which name
+ * them by record_op_names[].
+ */
+enum record_op {
+	RECORD_MOUNT,
+	RECORD_UMOUNT,
+	RECORD_CREATE,
+	RECORD_DELETE,
+	RECORD_MKDIR,
+	RECORD_RMDIR,
+	RECORD_OPEN,
+	RECORD_CLOSE,
+	RECORD_SEEK,
+	RECORD_WRITE,
+	RECORD_READ,
+	RECORD_OP_COUNT
+};
+
+/** Script command of each operation, "MOUNT" for %RECORD_MOUNT and so on */
+extern const char *const record_op_names[RECORD_OP_COUNT];
+
+/**
+ * struct record - Recorded call
+ * @op: Operation of the call
+ * @fd: File descriptor the call was made on, or -1. For %RECORD_OPEN, the file
+ *      descriptor returned.
+ * @ret: Value returned by the call
+ * @offset: Offset of @fd when the call was made
+ * @count: Number of bytes asked for by a read or write, or offset sought to
+ * @start: Time the call was made at, in nanoseconds since recording started
+ * @duration: Time the call took, in nanoseconds
+ * @name: File name of a create, delete or open, directory name of a mkdir or
+ *        rmdir, or disk name of a mount. Empty for the other operations.
+ */
+struct record {
+	enum record_op op;
+	int fd;
+	int ret;
+	uint32_t offset;
+	uint32_t count;
+	uint64_t start;
+	uint32_t duration;
+	char name[RECORD_NAME_MAX + 1];
+};
+
+/**
+ * record_start - Start recording the calls of the application
+ * @filename: Name of the host file to write the recording to
+ *
+ * Create host file @filename, replacing any file of that name, and append to
+ * it every fs_mount(), fs_umount(), fs_create(), fs_delete(), fs_mkdir(),
+ * fs_rmdir(), fs_open(), fs_close(), fs_lseek(), fs_write() and fs_read() call
+ * made from then on, in a compact binary form: a 28-byte record per call,
+ * followed by the name of the call if it has one. fs_mount_ro() is recorded as
+ * a mount, fs_import_fd() as a write and fs_export_fd() as a read.
+ *
+ * Return: -1 if recording is already started or if @filename cannot be
+ * created. 0 otherwise.
+ */
+int record_start(const char *filename);
+
+/**
+ * record_stop - Stop recording
+ *
+ * Stop recording calls, and flush and close the recording file.
+ *
+ * Return: -1 if recording is not started or if the recording file cannot be
+ * written. 0 otherwise.
+ */
+int record_stop(void);
+
+/**
+ * record_open - Open a recording
+ * @filename: Name of the host file holding the recording
+ *
+ * Return: NULL if @filename cannot be opened or does not hold a recording.
+ * Otherwise the recording, read by record_next() and closed by fclose().
+ */
+FILE *record_open(const char *filename);
+
+/**
+ * record_next - Read the next call of a recording
+ * @f: Recording returned by record_open()
+ * @rec: Call read
+ *
+ * Return: -1 if the recording is truncated or corrupted, 0 once every call
+ * has been read. 1 otherwise.
+ */
+int record_next(FILE *f, struct record *rec);
+
+/* Whether recording is started */
+extern int record_enabled;
+
+/* Returns the time of the monotonic clock in nanoseconds */
+uint64_t record_now(void);
+
+/* Records a call started at @start */
+void record_call(uint64_t start, enum record_op op, const char *name, int fd,
+		 uint32_t count, int ret);
+
+/* Returns the time a call starts at if recording, 0 otherwise */
+static inline uint64_t record_begin(void)
+{
+	if (__builtin_expect(record_enabled, 0))
+		return record_now();
+	return 0;
+}
+
+/*
+ * Records the call of operation @op started at @start, if it was. @name, @fd
+ * and @count are as struct record has them, except that @fd is the file
+ * descriptor given and @count the number of bytes or offset asked for.
+ */
+static inline void record_end(uint64_t start, enum record_op op,
+			      const char *name, int fd, uint32_t count, int ret)
+{
+	if (__builtin_expect(start != 0, 0))
+		record_call(start, op, name, fd, count, ret);
+}
+
+#endif /* _RECORD_H */
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define trace_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Event of a traced call, recorded at its entry ('B') or exit ('E') */
+struct trace_event {
+	uint64_t ns;
+	const char *name;
+	uint64_t offset;
+	uint64_t len;
+	int64_t block;
+	int32_t fd;
+	char phase;
+	char path[TRACE_PATH_LEN];
+};
+
+/* Ring of the events of a thread, only written by that thread. Rings are
+   pushed on a list on first use and never freed, so that the events of
+   threads that are gone can still be dumped. */
+struct trace_ring {
+	struct trace_ring *next;
+	pid_t tid;
+	/* Number of events ever recorded, the latest TRACE_RING_SIZE being
+	   kept */
+	uint64_t head;
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+int trace_enabled;
+
+/* Rings of every thread that recorded an event */
+static struct trace_ring *trace_rings;
+
+/* Ring of the calling thread */
+static __thread struct trace_ring *trace_ring;
+
+static uint64_t trace_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *ring = trace_ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	ring->tid = gettid();
+
+	/* Push the ring without a lock, other threads pushing theirs */
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE))
+		;
+
+	return trace_ring = ring;
+}
+
+void trace_record(struct trace_call *call)
+{
+	struct trace_ring *ring = trace_ring_get();
+	struct trace_event *event;
+
+	if (!ring) {
+		call->start = 0;
+		return;
+	}
+
+	event = &ring->events[ring->head % TRACE_RING_SIZE];
+	event->ns = trace_now();
+	event->name = call->name;
+	event->offset = call->offset;
+	event->len = call->len;
+	event->block = call->block;
+	event->fd = call->fd;
+	event->phase = call->start ? 'E' : 'B';
+	event->path[0] = '\0';
+	if (call->path)
+		snprintf(event->path, sizeof(event->path), "%s", call->path);
+
+	/* The exit of the call is recorded once the entry is */
+	call->start = event->ns;
+	if (event->phase == 'E')
+		call->start = 0;
+
+	/* Publish the event to trace_dump() */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_start(void)
+{
+#ifdef FS_TRACE
+	struct trace_ring *ring;
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next)
+		__atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+	return 0;
+#else
+	trace_error("libfs built without tracepoints");
+	return -1;
+#endif
+}
+
+void trace_stop(void)
+{
+#ifdef FS_TRACE
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+/* Writes @s as a JSON string */
+static void trace_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+int trace_dump(const char *filename)
+{
+	struct trace_ring *ring;
+	pid_t pid = getpid();
+	int count = 0;
+	FILE *f;
+
+	if (!filename || !(f = fopen(filename, "w"))) {
+		perror("fopen");
+		return -1;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t first = head > TRACE_RING_SIZE ?
+				 head - TRACE_RING_SIZE : 0;
+
+		for (uint64_t i = first; i < head; i++) {
+			struct trace_event *event =
+				&ring->events[i % TRACE_RING_SIZE];
+
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\","
+				"\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d",
+				count ? "," : "", event->name, event->phase,
+				(unsigned long long)event->ns / 1000,
+				(unsigned long long)event->ns % 1000,
+				pid, ring->tid);
+			count++;
+
+			/* Arguments are given at the entry of the call */
+			if (event->phase == 'E') {
+				fputc('}', f);
+				continue;
+			}
+			fprintf(f, ",\"args\":{");
+			if (event->path[0]) {
+				fprintf(f, "\"path\":");
+				trace_string(f, event->path);
+				fputc(',', f);
+			}
+			if (event->fd >= 0)
+				fprintf(f, "\"fd\":%d,\"offset\":%llu,",
+					event->fd,
+					(unsigned long long)event->offset);
+			if (event->block >= 0)
+				fprintf(f, "\"block\":%lld,",
+					(long long)event->block);
+			fprintf(f, "\"len\":%llu}}",
+				(unsigned long long)event->len);
+		}
+	}
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f)) {
+		perror("fclose");
+		return -1;
+	}
+
+	return count;
+}
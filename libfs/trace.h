@@ -0,0 +1,113 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/** Number of events kept by the ring of each thread, the oldest ones being
+ *  overwritten */
+#define TRACE_RING_SIZE 32768
+
+/** Length of the file names recorded by events, NULL character included */
+#define TRACE_PATH_LEN 16
+
+/**
+ * struct trace_call - Call being traced
+ * @name: Name of the function called
+ * @path: File name the function was called on, or NULL
+ * @fd: File descriptor the function was called on, or -1
+ * @offset: Offset of the file descriptor when the function was called
+ * @len: Number of bytes or blocks the function was asked to move
+ * @block: Index of the first block the function was called on, or -1
+ * @start: Time the call was recorded at, 0 if it was not
+ *
+ * Filled by the tracepoint at the entry of a function, and recorded again
+ * when the function returns.
+ */
+struct trace_call {
+	const char *name;
+	const char *path;
+	int fd;
+	uint64_t offset;
+	uint64_t len;
+	int64_t block;
+	uint64_t start;
+};
+
+/**
+ * trace_start - Start tracing
+ *
+ * Empty the ring of every thread, and start recording the entry and exit of
+ * every traced fs_* and disk_* call, each thread into its own ring. Tracing
+ * should be started and stopped while no other thread uses the file system.
+ *
+ * Return: -1 if libfs was not built with tracepoints (make T=1). 0 otherwise.
+ */
+int trace_start(void);
+
+/**
+ * trace_stop - Stop tracing
+ *
+ * Stop recording calls. The rings keep their events until tracing is started
+ * again.
+ */
+void trace_stop(void);
+
+/**
+ * trace_dump - Dump traced calls
+ * @filename: Name of the host file to write the trace to
+ *
+ * Write the events of every ring to @filename in the Chrome trace event
+ * format, which chrome://tracing and Perfetto load: one pair of begin and end
+ * events per call, with the file name, file descriptor, offset, length and
+ * block number of the call as arguments. Tracing should be stopped first.
+ *
+ * Return: -1 if @filename cannot be written. Otherwise the number of events
+ * written.
+ */
+int trace_dump(const char *filename);
+
+/* Records @call at its entry, or at its exit if @call->start is set */
+void trace_record(struct trace_call *call);
+
+static inline void trace_exit(struct trace_call *call)
+{
+	if (__builtin_expect(call->start != 0, 0))
+		trace_record(call);
+}
+
+#ifdef FS_TRACE
+/* Whether tracing is started */
+extern int trace_enabled;
+
+/*
+ * Tracepoint at the entry of a function, which records its exit as well when
+ * it goes out of scope. Must be the first statement of the function, and its
+ * arguments are only evaluated while tracing.
+ */
+#define TRACE_ENTER(_path, _fd, _offset, _len, _block)			\
+	struct trace_call trace_call __attribute__((cleanup(trace_exit)));	\
+	trace_call.start = 0;						\
+	if (__builtin_expect(trace_enabled, 0)) {			\
+		trace_call.name = __func__;				\
+		trace_call.path = (_path);				\
+		trace_call.fd = (_fd);					\
+		trace_call.offset = (_offset);				\
+		trace_call.len = (_len);				\
+		trace_call.block = (_block);				\
+		trace_record(&trace_call);				\
+	}
+#else
+#define TRACE_ENTER(_path, _fd, _offset, _len, _block)
+#endif
+
+/** Tracepoint of a file system call on file @path (or NULL) */
+#define TRACE_PATH(path) TRACE_ENTER(path, -1, 0, 0, -1)
+
+/** Tracepoint of a file system call moving @len bytes at the offset of @fd */
+#define TRACE_FD(fs, fd, len) \
+	TRACE_ENTER(NULL, fd, fd_offset(fs, fd), len, -1)
+
+/** Tracepoint of a disk call on @count blocks from block @block on */
+#define TRACE_BLOCK(block, count) TRACE_ENTER(NULL, -1, 0, count, block)
+
+#endif /* _TRACE_H */